@@ -0,0 +1,570 @@
+// Benchmarks for the code-to-image render pipeline.
+//
+// Each stage is timed on its own (glyph blending, text drawing, layout, highlighting, font
+// discovery, font setup, PNG encoding) plus whole renders, over synthetic inputs and the
+// bundled JetBrains Mono and Fira Code fonts. Results are written as JSON, one benchmark per
+// line, so two runs can be diffed directly or with --compare.
+//
+// Build and run from the repository root:
+//   gcc -O2 -I. -I./stb bench/bench.c -o bench/bench -lm -lpthread
+//   ./bench/bench --out before.json
+//   ./bench/bench --compare before.json after.json
+//
+// Options:
+//   --out FILE         Write the JSON results to FILE (default: stdout)
+//   --filter TEXT      Only run benchmarks whose name contains TEXT
+//   --min-time SEC     Time each benchmark for at least SEC seconds (default: 0.5)
+//   --generate DIR     Write the synthetic inputs to DIR and exit (used by bench/pgo.sh)
+//   --compare OLD NEW  Print the change in median time per benchmark; exits with 1 if any
+//                      benchmark got slower than --threshold percent (default: 5)
+//   --verbose          Keep the renderer's own stderr output
+
+#define CODE_TO_IMAGE_NO_MAIN
+#include "../code-to-image.c"
+
+#include <fcntl.h>
+
+// --- Synthetic Inputs ---
+
+typedef struct {
+    const char *name;
+    char *text;
+    size_t size;
+} BenchInput;
+
+static uint32_t bench_random_state = 12345;
+
+// Small deterministic generator, so every run sees the same inputs
+static uint32_t bench_random(void) {
+    bench_random_state = bench_random_state * 1664525u + 1013904223u;
+    return bench_random_state >> 8;
+}
+
+static const char *bench_pick(const char *const *words, int count) {
+    return words[bench_random() % count];
+}
+
+static const char *const code_words[] = {
+    "int", "return", "if", "for", "while", "const", "char", "size_t", "static", "void",
+    "buffer", "count", "index", "result", "value", "node->next", "data[i]", "0x7f", "42",
+    "\"text\"", "(", ")", "{", "}", "+", "==", "&&", "// note", "/* block */",
+};
+
+static const char *const unicode_words[] = {
+    "café", "naïve", "Größe", "résumé", "λx", "π≈3.14", "Σ", "→", "≤", "≠", "✓",
+    "日本語", "中文字符", "한국어", "Ωμέγα", "кириллица", "│", "├──", "😀", "🚀", "€", "£",
+};
+
+// Append one synthetic line of words with the given indentation prefix
+static void bench_append_line(ByteBuffer *out, const char *indent, int depth,
+                              const char *const *words, int word_count, int length) {
+    for (int i = 0; i < depth; ++i) byte_buffer_append(out, indent, strlen(indent));
+    int written = 0;
+    while (written < length) {
+        const char *word = bench_pick(words, word_count);
+        byte_buffer_append(out, word, strlen(word));
+        byte_buffer_append(out, " ", 1);
+        written += (int)strlen(word) + 1;
+    }
+    byte_buffer_append(out, "\n", 1);
+}
+
+static BenchInput bench_generate(const char *name) {
+    ByteBuffer out = {0};
+    int code_count = (int)(sizeof(code_words) / sizeof(code_words[0]));
+    int unicode_count = (int)(sizeof(unicode_words) / sizeof(unicode_words[0]));
+    bench_random_state = 12345;
+
+    if (strcmp(name, "snippet") == 0) {
+        static const char snippet[] =
+            "#include <stdio.h>\n\n"
+            "// Sum the first n squares\n"
+            "static long sum_squares(int n) {\n"
+            "    long total = 0;\n"
+            "    for (int i = 1; i <= n; ++i) {\n"
+            "        total += (long)i * i;\n"
+            "    }\n"
+            "    return total;\n"
+            "}\n\n"
+            "int main(void) {\n"
+            "    printf(\"%ld\\n\", sum_squares(10));\n"
+            "    return 0;\n"
+            "}\n";
+        byte_buffer_append(&out, snippet, sizeof(snippet) - 1);
+    } else if (strcmp(name, "long_lines") == 0) {
+        for (int i = 0; i < 50; ++i) bench_append_line(&out, "", 0, code_words, code_count, 20000);
+    } else if (strcmp(name, "100k_lines") == 0) {
+        for (int i = 0; i < 100000; ++i) {
+            bench_append_line(&out, "    ", (int)(bench_random() % 4), code_words, code_count, 20 + (int)(bench_random() % 60));
+        }
+    } else if (strcmp(name, "tabs") == 0) {
+        for (int i = 0; i < 2000; ++i) {
+            bench_append_line(&out, "\t", (int)(bench_random() % 8), code_words, code_count, 10 + (int)(bench_random() % 30));
+        }
+    } else if (strcmp(name, "unicode") == 0) {
+        for (int i = 0; i < 2000; ++i) {
+            bench_append_line(&out, "  ", (int)(bench_random() % 3), unicode_words, unicode_count, 20 + (int)(bench_random() % 60));
+        }
+    }
+    byte_buffer_append(&out, "", 1); // Keep the text NUL-terminated like load_file does
+    BenchInput input = { name, (char *)out.data, out.size - 1 };
+    return input;
+}
+
+static const char *const input_names[] = { "snippet", "long_lines", "100k_lines", "tabs", "unicode" };
+#define INPUT_COUNT ((int)(sizeof(input_names) / sizeof(input_names[0])))
+
+static const char *const font_names[] = { "JetBrainsMono-Regular", "FiraCode-Regular" };
+#define FONT_COUNT ((int)(sizeof(font_names) / sizeof(font_names[0])))
+
+#define RENDER_BENCH_MAX_INPUT (512 * 1024) // Larger inputs are not rendered end to end
+
+// --- Timing ---
+
+typedef void (*BenchFn)(void *context);
+
+typedef struct {
+    FILE *out;
+    const char *filter;
+    double min_time;
+    int result_count;
+    int saved_stderr;       // Real stderr while the renderer's output is silenced, or -1
+} BenchRun;
+
+static void bench_note(BenchRun *run, const char *format, ...) {
+    FILE *err = run->saved_stderr >= 0 ? fdopen(dup(run->saved_stderr), "w") : stderr;
+    va_list args;
+    va_start(args, format);
+    vfprintf(err, format, args);
+    va_end(args);
+    if (err != stderr) fclose(err); else fflush(err);
+}
+
+// Function to time fn until min_time has passed (and at least 3 samples were taken), calling
+// it in batches large enough that one sample lasts about a millisecond, and print one JSON line
+static void bench_measure(BenchRun *run, const char *name, BenchFn fn, void *context, size_t bytes_per_op) {
+    if (run->filter && !strstr(name, run->filter)) return;
+
+    fn(context); // Warm-up: caches filled, pages touched
+    long batch = 1;
+    for (;;) {
+        double start = now_seconds();
+        for (long i = 0; i < batch; ++i) fn(context);
+        double elapsed = now_seconds() - start;
+        if (elapsed >= 1e-3 || batch >= (1L << 24)) break;
+        batch *= elapsed > 1e-5 ? (long)(1e-3 / elapsed) + 1 : 100;
+    }
+
+    int capacity = 64, count = 0;
+    double *samples = malloc(sizeof(double) * capacity);
+    double began = now_seconds();
+    long iterations = 0;
+    while (samples) {
+        double start = now_seconds();
+        for (long i = 0; i < batch; ++i) fn(context);
+        double end = now_seconds();
+        iterations += batch;
+        if (count == capacity) {
+            double *grown = realloc(samples, sizeof(double) * capacity * 2);
+            if (!grown) break;
+            samples = grown;
+            capacity *= 2;
+        }
+        samples[count++] = (end - start) * 1e9 / batch;
+        double total = end - began;
+        if ((total >= run->min_time && count >= 3) || total >= run->min_time * 10) break;
+    }
+    if (!samples) return;
+    qsort(samples, count, sizeof(double), compare_doubles);
+
+    double median = samples[count / 2];
+    fprintf(run->out, "%s    {\"name\": \"%s\", \"iterations\": %ld, \"min_ns\": %.1f, \"median_ns\": %.1f, \"max_ns\": %.1f, \"bytes_per_op\": %zu, \"mb_per_s\": %.2f}",
+            run->result_count ? ",\n" : "", name, iterations, samples[0], median, samples[count - 1],
+            bytes_per_op, bytes_per_op && median > 0 ? bytes_per_op / median * 1e3 : 0.0);
+    fflush(run->out);
+    run->result_count++;
+    bench_note(run, "%-60s %14.1f ns/op\n", name, median);
+    free(samples);
+}
+
+// --- Benchmarks ---
+
+typedef struct {
+    GlyphCache *cache;
+    Canvas canvas;
+    const CachedGlyph *glyph;
+    const BenchInput *input;
+    const LineIndex *lines;
+    int x;
+} DrawContext;
+
+static void bench_draw_char_bitmap(void *arg) {
+    DrawContext *ctx = arg;
+    const CachedGlyph *glyph = ctx->glyph;
+    ctx->x = (ctx->x + glyph->advance) % (ctx->canvas.width - glyph->width);
+    draw_char_bitmap(&ctx->canvas, glyph->bitmap, glyph->width, glyph->height, ctx->x, 0, 248, 248, 242);
+}
+
+// Draws every line of the input onto the same row of a small canvas
+static void bench_draw_text(void *arg) {
+    DrawContext *ctx = arg;
+    const LineIndex *lines = ctx->lines;
+    for (int i = 0; i < lines->line_count; ++i) {
+        uint32_t start = lines->starts[i];
+        size_t length = lines->starts[i + 1] - 1 - start;
+        draw_text(&ctx->canvas, 10, 10, 0, ctx->input->text + start, length, ctx->cache, 248, 248, 242);
+    }
+}
+
+static void bench_get_code_dimensions(void *arg) {
+    DrawContext *ctx = arg;
+    LineIndex lines;
+    if (build_line_index(ctx->input->text, ctx->input->size, ctx->cache, &lines)) {
+        int width, height;
+        get_code_dimensions(&lines, ctx->cache, 1.5f, 20, &width, &height);
+        line_index_free(&lines);
+    }
+}
+
+static void bench_highlight(void *arg) {
+    const BenchInput *input = arg;
+    TokenSpans spans = {0};
+    highlight_code(find_language("c"), input->text, input->size, &spans);
+    token_spans_free(&spans);
+}
+
+static void bench_font_discovery_rescan(void *arg) {
+    FontCatalog *catalog = arg;
+    free_discovered_fonts(catalog);
+    discover_fonts(catalog, "Fonts", true);
+}
+
+static void bench_font_discovery_index(void *arg) {
+    FontCatalog *catalog = arg;
+    free_discovered_fonts(catalog);
+    discover_fonts(catalog, "Fonts", false);
+}
+
+static void bench_font_init(void *arg) {
+    const LoadedFont *font = arg;
+    stbtt_fontinfo info;
+    GlyphMap map;
+    stbtt_InitFont(&info, font->buffer, 0);
+    glyph_map_init(&map, &info, NULL);
+    glyph_map_free(&map);
+}
+
+typedef struct {
+    const uint8_t *pixels;
+    int width, height;
+    int level, threads;
+    ByteBuffer out;
+} EncodeContext;
+
+static void bench_png_encode(void *arg) {
+    EncodeContext *ctx = arg;
+    ctx->out.size = 0;
+    PngOptions options = { .width = ctx->width, .height = ctx->height, .color_type = PNG_COLOR_RGB,
+                           .bit_depth = 8, .level = ctx->level, .threads = ctx->threads };
+    PngEncoder *encoder = png_encoder_begin(&options, buffer_sink(&ctx->out));
+    if (!encoder) return;
+    png_encoder_write_rows(encoder, ctx->pixels, ctx->height, (size_t)ctx->width * CHANNELS);
+    png_encoder_finish(encoder, NULL);
+}
+
+typedef struct {
+    const BenchInput *input;
+    RenderJob job;
+    RenderWorker *worker;
+    ByteBuffer out;
+} BenchRender;
+
+static void bench_render(void *arg) {
+    BenchRender *ctx = arg;
+    ctx->out.size = 0;
+    render_code(ctx->input->text, ctx->input->size, &ctx->job, ctx->worker);
+}
+
+// Draw the input onto a plain code-block background, as the PNG encoding benchmarks' image
+static uint8_t *bench_render_pixels(GlyphCache *cache, const BenchInput *input, int width, int height) {
+    uint8_t *pixels = malloc((size_t)width * height * CHANNELS);
+    if (!pixels) return NULL;
+    for (size_t i = 0; i < (size_t)width * height; ++i) {
+        pixels[i * 3 + 0] = 13;
+        pixels[i * 3 + 1] = 13;
+        pixels[i * 3 + 2] = 13;
+    }
+    Canvas canvas = { .pixels = pixels, .width = width, .y0 = 0, .rows = height };
+    const char *line = input->text;
+    int line_step = (int)(cache->pixel_height * 1.8f);
+    for (int y = 10; y + line_step < height && *line; y += line_step) {
+        const char *end = strchr(line, '\n');
+        size_t length = end ? (size_t)(end - line) : strlen(line);
+        draw_text(&canvas, 20, 20, y, line, length, cache, 248, 248, 242);
+        line = end ? end + 1 : line + length;
+    }
+    return pixels;
+}
+
+static void run_benchmarks(BenchRun *run) {
+    char name[256];
+    BenchInput inputs[INPUT_COUNT];
+    for (int i = 0; i < INPUT_COUNT; ++i) inputs[i] = bench_generate(input_names[i]);
+
+    fprintf(run->out, "{\n  \"compiler\": \"%s\",\n  \"min_time\": %.3f,\n  \"results\": [\n",
+#ifdef __VERSION__
+            __VERSION__,
+#else
+            "unknown",
+#endif
+            run->min_time);
+
+    FontCatalog catalog = {0};
+    bench_measure(run, "font_discovery/rescan", bench_font_discovery_rescan, &catalog, 0);
+    bench_measure(run, "font_discovery/index", bench_font_discovery_index, &catalog, 0);
+    free_discovered_fonts(&catalog);
+    RenderContext *context = cti_context_create("Fonts", false);
+
+    for (int i = 0; i < INPUT_COUNT; ++i) {
+        snprintf(name, sizeof(name), "highlight/%s", inputs[i].name);
+        bench_measure(run, name, bench_highlight, &inputs[i], inputs[i].size);
+    }
+
+    for (int f = 0; context && f < FONT_COUNT; ++f) {
+        const char *path = find_font_path(&context->fonts, font_names[f]);
+        LoadedFont *font = path ? load_font(&context->loaded, path) : NULL;
+        if (!font) {
+            bench_note(run, "Skipping font '%s': not found under Fonts/\n", font_names[f]);
+            continue;
+        }
+        GlyphCache cache;
+        if (!glyph_cache_init(&cache, &font->glyph_map, 18.0f)) continue;
+
+        snprintf(name, sizeof(name), "font_init/%s", font_names[f]);
+        bench_measure(run, name, bench_font_init, font, 0);
+
+        uint8_t *pixels = calloc((size_t)4096 * 64, CHANNELS);
+        DrawContext draw = { .cache = &cache, .canvas = { pixels, 4096, 0, 64 } };
+        draw.glyph = glyph_cache_get(&cache, glyph_map_lookup(cache.map, 'M'));
+        if (pixels && draw.glyph && draw.glyph->bitmap) {
+            snprintf(name, sizeof(name), "draw_char_bitmap/%s", font_names[f]);
+            bench_measure(run, name, bench_draw_char_bitmap, &draw, (size_t)draw.glyph->width * draw.glyph->height);
+        }
+
+        for (int i = 0; pixels && i < INPUT_COUNT; ++i) {
+            LineIndex lines;
+            if (!build_line_index(inputs[i].text, inputs[i].size, &cache, &lines)) continue;
+            draw.input = &inputs[i];
+            draw.lines = &lines;
+            snprintf(name, sizeof(name), "get_code_dimensions/%s/%s", font_names[f], inputs[i].name);
+            bench_measure(run, name, bench_get_code_dimensions, &draw, inputs[i].size);
+            snprintf(name, sizeof(name), "draw_text/%s/%s", font_names[f], inputs[i].name);
+            bench_measure(run, name, bench_draw_text, &draw, inputs[i].size);
+            line_index_free(&lines);
+        }
+
+        // Encoding depends on the image, not the font, so it is measured with the first font only
+        if (f == 0) {
+            int width = 1200, height = 4000;
+            EncodeContext encode = { .width = width, .height = height };
+            encode.pixels = bench_render_pixels(&cache, &inputs[2], width, height);
+            static const int levels[] = { 0, 1, 6, 9 };
+            for (int l = 0; encode.pixels && l < 4; ++l) {
+                encode.level = levels[l];
+                encode.threads = 1;
+                snprintf(name, sizeof(name), "png_encode/level%d", levels[l]);
+                bench_measure(run, name, bench_png_encode, &encode, (size_t)width * height * CHANNELS);
+            }
+            int threads = default_thread_count();
+            if (encode.pixels && threads > 1) {
+                encode.level = PNG_DEFAULT_LEVEL;
+                encode.threads = threads;
+                snprintf(name, sizeof(name), "png_encode/level%d/threads%d", PNG_DEFAULT_LEVEL, threads);
+                bench_measure(run, name, bench_png_encode, &encode, (size_t)width * height * CHANNELS);
+            }
+            free((void *)encode.pixels);
+            byte_buffer_free(&encode.out);
+        }
+
+        // Whole renders of the multi-megabyte inputs take minutes; their stages are timed above
+        RenderWorker worker = { .context = context };
+        for (int i = 0; i < INPUT_COUNT; ++i) {
+            if (inputs[i].size > RENDER_BENCH_MAX_INPUT) continue;
+            BenchRender render = { .input = &inputs[i], .worker = &worker };
+            render.job = (RenderJob){ .input_path = "bench.c", .output_buffer = &render.out,
+                                      .font_name = font_names[f], .font_pixel_height = 18.0f,
+                                      .png_level = PNG_DEFAULT_LEVEL, .png_threads = 1, .raster_threads = 1 };
+            snprintf(name, sizeof(name), "render/%s/%s", font_names[f], inputs[i].name);
+            bench_measure(run, name, bench_render, &render, inputs[i].size);
+            byte_buffer_free(&render.out);
+        }
+        worker_free(&worker);
+        glyph_cache_free(&cache);
+        free(pixels);
+    }
+
+    fprintf(run->out, "\n  ]\n}\n");
+    for (int i = 0; i < INPUT_COUNT; ++i) free(inputs[i].text);
+    cti_context_free(context);
+}
+
+// --- Comparing Runs ---
+
+typedef struct {
+    char name[256];
+    double median_ns;
+} BenchResult;
+
+// Function to read the name and median of every result line of a JSON file written above
+static BenchResult *read_results(const char *path, int *out_count) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "Error: Could not open '%s'.\n", path);
+        return NULL;
+    }
+    int count = 0, capacity = 64;
+    BenchResult *results = malloc(sizeof(BenchResult) * capacity);
+    char line[1024];
+    while (results && fgets(line, sizeof(line), fp)) {
+        const char *name = strstr(line, "\"name\": \"");
+        const char *median = strstr(line, "\"median_ns\": ");
+        if (!name || !median) continue;
+        if (count == capacity) {
+            BenchResult *grown = realloc(results, sizeof(BenchResult) * capacity * 2);
+            if (!grown) break;
+            results = grown;
+            capacity *= 2;
+        }
+        name += strlen("\"name\": \"");
+        const char *end = strchr(name, '"');
+        size_t length = end ? (size_t)(end - name) : 0;
+        if (length >= sizeof(results[count].name)) length = sizeof(results[count].name) - 1;
+        memcpy(results[count].name, name, length);
+        results[count].name[length] = '\0';
+        results[count].median_ns = strtod(median + strlen("\"median_ns\": "), NULL);
+        count++;
+    }
+    fclose(fp);
+    *out_count = count;
+    return results;
+}
+
+static int compare_runs(const char *old_path, const char *new_path, double threshold) {
+    int old_count = 0, new_count = 0;
+    BenchResult *old_results = read_results(old_path, &old_count);
+    BenchResult *new_results = read_results(new_path, &new_count);
+    if (!old_results || !new_results) {
+        free(old_results);
+        free(new_results);
+        return 2;
+    }
+
+    int regressions = 0;
+    printf("%-60s %14s %14s %9s\n", "benchmark", "old ns/op", "new ns/op", "change");
+    for (int i = 0; i < new_count; ++i) {
+        const BenchResult *now = &new_results[i];
+        const BenchResult *before = NULL;
+        for (int j = 0; j < old_count && !before; ++j) {
+            if (strcmp(old_results[j].name, now->name) == 0) before = &old_results[j];
+        }
+        if (!before || before->median_ns <= 0) {
+            printf("%-60s %14s %14.1f %9s\n", now->name, "-", now->median_ns, "new");
+            continue;
+        }
+        double change = (now->median_ns / before->median_ns - 1.0) * 100.0;
+        bool regressed = change > threshold;
+        regressions += regressed;
+        printf("%-60s %14.1f %14.1f %+8.1f%%%s\n", now->name, before->median_ns, now->median_ns, change, regressed ? "  REGRESSION" : "");
+    }
+    printf("%d regression(s) above %.1f%%\n", regressions, threshold);
+    free(old_results);
+    free(new_results);
+    return regressions ? 1 : 0;
+}
+
+// Function to write every synthetic input to DIR, for training runs of the real binary
+static int generate_inputs(const char *dir) {
+    mkdir(dir, 0755);
+    for (int i = 0; i < INPUT_COUNT; ++i) {
+        BenchInput input = bench_generate(input_names[i]);
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s.c", dir, input.name);
+        FILE *fp = fopen(path, "wb");
+        bool ok = fp && fwrite(input.text, 1, input.size, fp) == input.size;
+        if (fp && fclose(fp) != 0) ok = false;
+        free(input.text);
+        if (!ok) {
+            fprintf(stderr, "Error: Could not write '%s'.\n", path);
+            return 1;
+        }
+        printf("%s\n", path);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    BenchRun run = { .out = stdout, .min_time = 0.5, .saved_stderr = -1 };
+    const char *out_path = NULL;
+    double threshold = 5.0;
+    bool verbose = false;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            out_path = argv[++i];
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            run.filter = argv[++i];
+        } else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) {
+            run.min_time = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+            threshold = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--generate") == 0 && i + 1 < argc) {
+            return generate_inputs(argv[++i]);
+        } else if (strcmp(argv[i], "--compare") == 0 && i + 2 < argc) {
+            const char *old_path = argv[++i];
+            const char *new_path = argv[++i];
+            for (++i; i + 1 < argc; ++i) {
+                if (strcmp(argv[i], "--threshold") == 0) threshold = atof(argv[++i]);
+            }
+            return compare_runs(old_path, new_path, threshold);
+        } else if (strcmp(argv[i], "--verbose") == 0) {
+            verbose = true;
+        } else {
+            fprintf(stderr, "Usage: %s [--out FILE] [--filter TEXT] [--min-time SEC] [--verbose]\n"
+                            "       %s --compare OLD.json NEW.json [--threshold PCT]\n"
+                            "       %s --generate DIR\n", argv[0], argv[0], argv[0]);
+            return 2;
+        }
+    }
+
+    if (out_path) {
+        run.out = fopen(out_path, "w");
+        if (!run.out) {
+            fprintf(stderr, "Error: Could not write '%s'.\n", out_path);
+            return 1;
+        }
+    }
+
+    // The renderer reports progress on stderr; keep it out of the timings
+    if (!verbose) {
+        fflush(stderr);
+        run.saved_stderr = dup(STDERR_FILENO);
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDERR_FILENO);
+            close(null_fd);
+        }
+    }
+
+    run_benchmarks(&run);
+
+    if (run.saved_stderr >= 0) {
+        fflush(stderr);
+        dup2(run.saved_stderr, STDERR_FILENO);
+        close(run.saved_stderr);
+    }
+    if (out_path && fclose(run.out) != 0) {
+        fprintf(stderr, "Error: Could not write '%s'.\n", out_path);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,87 @@
+#!/bin/sh
+# Checks that every encoder's output decodes to the pixels of the raw renderer output.
+#
+# Builds code-to-image and an independent decoder (bench/decode.c, zlib and the reference QOI
+# algorithm), renders a few generated inputs as raw RGB, then renders them again as PNG at
+# levels 0, 1, 6 and 9, indexed PNG, QOI and PPM, each with one and with several threads, and
+# compares the decoded pixels. Images with more than 256 colors get a quantized palette, so
+# their indexed PNGs are only checked to decode and to match across thread counts.
+# Run from the repository root:
+#
+#   bench/check.sh                    # exits 1 if any image differs
+#   CC=clang THREADS=8 bench/check.sh
+set -eu
+
+CC=${CC:-gcc}
+CFLAGS=${CFLAGS:--O2}
+THREADS=${THREADS:-4}
+INCLUDES="-I. -I./stb"
+LIBS="-lm -lpthread"
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT INT TERM
+
+echo "Building"
+$CC $CFLAGS $INCLUDES code-to-image.c -o "$WORK/code-to-image" $LIBS
+$CC $CFLAGS bench/decode.c -o "$WORK/decode" -lz
+
+# A short snippet, tabs and non-ASCII text, very long lines and a tall file
+mkdir "$WORK/inputs"
+cat > "$WORK/inputs/snippet.c" <<'EOF'
+#include <stdio.h>
+
+// Print a greeting
+int main(void) {
+    const char *name = "world";
+    for (int i = 0; i < 3; ++i) printf("Hello, %s! %d\n", name, i * 42);
+    return 0;
+}
+EOF
+printf 'if (x)\t{\n\treturn\tx;\t// tab\n}\n\t\t\tdone\n' > "$WORK/inputs/snippet.tabs.c"
+printf 'caf\303\251 na\303\257ve \316\273 \342\206\222 \344\270\255\346\226\207 \360\237\231\202\n' > "$WORK/inputs/snippet.unicode.txt"
+awk 'BEGIN { for (i = 0; i < 60; i++) { s = ""; for (j = 0; j < 200; j++) s = s "v" j " = " i * j "; "; print s } }' \
+    > "$WORK/inputs/long_lines.c"
+awk 'BEGIN { for (i = 0; i < 20000; i++) printf "int value_%d = %d; // line %d\n", i, i * 7, i }' > "$WORK/inputs/tall.c"
+
+# Keep the font index and other caches of these runs out of the user's cache
+export XDG_CACHE_HOME="$WORK/cache"
+failures=0
+checks=0
+for input in "$WORK"/inputs/*; do
+    name=$(basename "$input")
+    # Big inputs are laid out in full, but only partly drawn
+    case "$name" in
+        snippet.*) size="" ;;
+        *) size="-w 2000 -h 4000" ;;
+    esac
+    # shellcheck disable=SC2086
+    "$WORK/code-to-image" -i "$input" $size -j 1 --format raw "$WORK/expected.raw" > /dev/null 2> "$WORK/log" ||
+        { cat "$WORK/log" >&2; exit 1; }
+    quantized=$([ "$("$WORK/decode" --colors "$WORK/expected.raw")" -gt 256 ] && echo 1 || echo 0)
+    for options in "--png-level 0" "--png-level 1" "--png-level 6" "--png-level 9" "--palette" \
+                   "--format qoi" "--format ppm" "--format raw"; do
+        for threads in 1 "$THREADS"; do
+            checks=$((checks + 1))
+            expected="$WORK/expected.raw"
+            if [ "$options" = "--palette" ] && [ "$quantized" = 1 ]; then
+                expected="$WORK/palette.raw" # Written by the first thread count
+            fi
+            # shellcheck disable=SC2086
+            if "$WORK/code-to-image" -i "$input" $size -j "$threads" $options "$WORK/out" > /dev/null 2> "$WORK/log" &&
+               { case "$options" in
+                     *raw) cp "$WORK/out" "$WORK/decoded.raw" ;;
+                     *) "$WORK/decode" "$WORK/out" "$WORK/decoded.raw" > /dev/null ;;
+                 esac; } &&
+               { [ "$expected" != "$WORK/palette.raw" ] || [ "$threads" != 1 ] || cp "$WORK/decoded.raw" "$expected"; } &&
+               cmp -s "$expected" "$WORK/decoded.raw"; then
+                :
+            else
+                cat "$WORK/log" >&2
+                echo "FAIL: $name $options -j $threads" >&2
+                failures=$((failures + 1))
+            fi
+        done
+    done
+done
+
+echo "$((checks - failures)) of $checks images decode to the raw pixels"
+[ "$failures" -eq 0 ]
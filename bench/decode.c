@@ -0,0 +1,229 @@
+// decode - independent decoder for checking code-to-image's encoders
+//
+// Decodes a PNG (truecolor or indexed at any bit depth, inflated by zlib), QOI or PPM image
+// and writes its pixels as raw RGB rows, the same bytes `code-to-image --format raw` writes.
+// None of code-to-image's own encoding code is used, so bench/check.sh can compare the two.
+//
+//   gcc -O2 bench/decode.c -o bench/decode -lz
+//   bench/decode IMAGE OUT.raw      # prints "WIDTH HEIGHT" on success
+//   bench/decode --colors RAW       # prints the number of distinct colors in raw RGB pixels
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+typedef struct {
+    int width, height;
+    uint8_t *rgb;
+} Image;
+
+static uint32_t read_u32be(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static bool fail(const char *message) {
+    fprintf(stderr, "decode: %s\n", message);
+    return false;
+}
+
+static int paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+// Function to decode a non-interlaced PNG, checking chunk CRCs and the zlib stream
+static bool decode_png(const uint8_t *data, size_t size, Image *image) {
+    uint8_t palette[256][3];
+    int palette_size = 0, depth = 0, color_type = -1;
+    uint8_t *idat = NULL;
+    size_t idat_size = 0;
+    bool ended = false;
+    for (size_t pos = 8; pos + 12 <= size && !ended;) {
+        uint32_t length = read_u32be(data + pos);
+        if (length > size - pos - 12) return fail("truncated chunk");
+        const uint8_t *type = data + pos + 4, *body = type + 4;
+        if (crc32(crc32(0, NULL, 0), type, length + 4) != read_u32be(body + length)) return fail("bad chunk CRC");
+        if (memcmp(type, "IHDR", 4) == 0) {
+            image->width = (int)read_u32be(body);
+            image->height = (int)read_u32be(body + 4);
+            depth = body[8];
+            color_type = body[9];
+            if (body[10] || body[11] || body[12]) return fail("unsupported compression, filter or interlace method");
+        } else if (memcmp(type, "PLTE", 4) == 0) {
+            palette_size = (int)length / 3;
+            memcpy(palette, body, (size_t)palette_size * 3);
+        } else if (memcmp(type, "IDAT", 4) == 0) {
+            idat = realloc(idat, idat_size + length);
+            memcpy(idat + idat_size, body, length);
+            idat_size += length;
+        } else if (memcmp(type, "IEND", 4) == 0) {
+            ended = true;
+        }
+        pos += 12 + length;
+    }
+    if (!ended) return fail("missing IEND");
+    if (!((color_type == 2 && depth == 8) || (color_type == 3 && (depth == 1 || depth == 2 || depth == 4 || depth == 8)))) {
+        return fail("unsupported color type or bit depth");
+    }
+
+    int channels = color_type == 2 ? 3 : 1;
+    size_t stride = ((size_t)image->width * channels * depth + 7) / 8;
+    size_t raw_size = (stride + 1) * image->height;
+    uint8_t *raw = malloc(raw_size + 1);
+    z_stream stream = { .next_in = idat, .avail_in = (uInt)idat_size, .next_out = raw, .avail_out = (uInt)raw_size + 1 };
+    bool ok = inflateInit(&stream) == Z_OK && inflate(&stream, Z_FINISH) == Z_STREAM_END && stream.total_out == raw_size;
+    inflateEnd(&stream);
+    free(idat);
+    if (!ok) {
+        free(raw);
+        return fail("zlib stream does not inflate to the image size");
+    }
+
+    // Undo the filters in place; bpp is the byte distance of the "left" pixel
+    int bpp = depth == 8 ? channels : 1;
+    image->rgb = malloc((size_t)image->width * image->height * 3);
+    for (int y = 0; y < image->height && ok; ++y) {
+        uint8_t *line = raw + y * (stride + 1) + 1, *prior = y ? line - (stride + 1) : NULL;
+        int filter = line[-1];
+        for (size_t x = 0; x < stride; ++x) {
+            int a = x >= (size_t)bpp ? line[x - bpp] : 0, b = prior ? prior[x] : 0;
+            int c = prior && x >= (size_t)bpp ? prior[x - bpp] : 0;
+            switch (filter) {
+                case 0: break;
+                case 1: line[x] += a; break;
+                case 2: line[x] += b; break;
+                case 3: line[x] += (a + b) / 2; break;
+                case 4: line[x] += paeth(a, b, c); break;
+                default: ok = fail("bad filter type");
+            }
+        }
+        for (int x = 0; x < image->width && ok; ++x) {
+            uint8_t *out = image->rgb + ((size_t)y * image->width + x) * 3;
+            if (color_type == 2) {
+                memcpy(out, line + x * 3, 3);
+                continue;
+            }
+            int bit = x * depth;
+            int index = (line[bit / 8] >> (8 - depth - bit % 8)) & ((1 << depth) - 1);
+            if (index >= palette_size) ok = fail("palette index out of range");
+            else memcpy(out, palette[index], 3);
+        }
+    }
+    free(raw);
+    return ok;
+}
+
+// Function to decode a QOI image as the format's reference decoder does
+static bool decode_qoi(const uint8_t *data, size_t size, Image *image) {
+    static const uint8_t end_marker[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    if (size < 14 + 8 || memcmp(data + size - 8, end_marker, 8) != 0) return fail("missing QOI end marker");
+    image->width = (int)read_u32be(data + 4);
+    image->height = (int)read_u32be(data + 8);
+    size_t pixels = (size_t)image->width * image->height;
+    image->rgb = malloc(pixels * 3 + 1);
+    uint8_t index[64][4] = {{0}}, px[4] = { 0, 0, 0, 255 };
+    size_t pos = 14, end = size - 8;
+    int run = 0;
+    for (size_t i = 0; i < pixels; ++i) {
+        if (run > 0) {
+            run--;
+        } else if (pos < end) {
+            int b1 = data[pos++];
+            if (b1 == 0xfe) {
+                px[0] = data[pos]; px[1] = data[pos + 1]; px[2] = data[pos + 2];
+                pos += 3;
+            } else if (b1 == 0xff) {
+                memcpy(px, data + pos, 4);
+                pos += 4;
+            } else if ((b1 & 0xc0) == 0x00) {
+                memcpy(px, index[b1], 4);
+            } else if ((b1 & 0xc0) == 0x40) {
+                px[0] += ((b1 >> 4) & 3) - 2;
+                px[1] += ((b1 >> 2) & 3) - 2;
+                px[2] += (b1 & 3) - 2;
+            } else if ((b1 & 0xc0) == 0x80) {
+                int b2 = data[pos++], dg = (b1 & 0x3f) - 32;
+                px[0] += dg - 8 + ((b2 >> 4) & 0x0f);
+                px[1] += dg;
+                px[2] += dg - 8 + (b2 & 0x0f);
+            } else {
+                run = b1 & 0x3f;
+            }
+            memcpy(index[(px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64], px, 4);
+        } else {
+            return fail("QOI data ends early");
+        }
+        memcpy(image->rgb + i * 3, px, 3);
+    }
+    return pos == end || fail("QOI data left over");
+}
+
+static bool decode_ppm(const uint8_t *data, size_t size, Image *image) {
+    int maxval, header = 0;
+    if (sscanf((const char *)data, "P6 %d %d %d%n", &image->width, &image->height, &maxval, &header) != 3 || maxval != 255) {
+        return fail("unsupported PPM header");
+    }
+    size_t bytes = (size_t)image->width * image->height * 3;
+    if ((size_t)header + 1 + bytes != size) return fail("PPM size does not match its header");
+    image->rgb = malloc(bytes);
+    memcpy(image->rgb, data + header + 1, bytes);
+    return true;
+}
+
+// Function to count the distinct colors of raw RGB pixels, one bit per possible color
+static long count_colors(const uint8_t *rgb, size_t size) {
+    uint8_t *seen = calloc(1 << 21, 1);
+    long colors = 0;
+    for (size_t i = 0; seen && i + 3 <= size; i += 3) {
+        uint32_t color = (uint32_t)rgb[i] << 16 | rgb[i + 1] << 8 | rgb[i + 2];
+        if (!(seen[color >> 3] & (1 << (color & 7)))) {
+            seen[color >> 3] |= 1 << (color & 7);
+            colors++;
+        }
+    }
+    free(seen);
+    return colors;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s IMAGE OUT.raw\n"
+                        "       %s --colors RAW\n", argv[0], argv[0]);
+        return 2;
+    }
+    bool colors = strcmp(argv[1], "--colors") == 0;
+    if (colors) argv++;
+    FILE *in = fopen(argv[1], "rb");
+    if (!in) return fail("cannot open input"), 1;
+    fseek(in, 0, SEEK_END);
+    long size = ftell(in);
+    rewind(in);
+    uint8_t *data = malloc((size_t)size + 1);
+    size_t got = fread(data, 1, (size_t)size, in);
+    fclose(in);
+    data[got] = 0;
+    if (colors) {
+        printf("%ld\n", count_colors(data, got));
+        free(data);
+        return 0;
+    }
+
+    Image image = {0};
+    bool ok;
+    if (got >= 8 && memcmp(data, "\x89PNG\r\n\x1a\n", 8) == 0) ok = decode_png(data, got, &image);
+    else if (got >= 4 && memcmp(data, "qoif", 4) == 0) ok = decode_qoi(data, got, &image);
+    else if (got >= 2 && memcmp(data, "P6", 2) == 0) ok = decode_ppm(data, got, &image);
+    else ok = fail("unknown image format");
+
+    FILE *out = ok ? fopen(argv[2], "wb") : NULL;
+    ok = out && fwrite(image.rgb, 3, (size_t)image.width * image.height, out) == (size_t)image.width * image.height;
+    if (out) ok = fclose(out) == 0 && ok;
+    if (ok) printf("%d %d\n", image.width, image.height);
+    free(data);
+    free(image.rgb);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,64 @@
+#!/bin/sh
+# Profile-guided build of code-to-image.
+#
+# Builds an instrumented binary, trains it on the benchmark's synthetic inputs (both bundled
+# fonts, several PNG levels, palette output and threaded drawing), then rebuilds it with the
+# collected profile. Run from the repository root:
+#
+#   bench/pgo.sh                      # writes ./code-to-image
+#   CC=clang bench/pgo.sh OUTPUT      # clang also needs llvm-profdata on PATH
+#
+# Compare the result against a plain build with bench/bench --compare, or by timing renders.
+set -eu
+
+CC=${CC:-gcc}
+CFLAGS=${CFLAGS:--O2}
+OUTPUT=${1:-code-to-image}
+INCLUDES="-I. -I./stb"
+LIBS="-lm -lpthread"
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT INT TERM
+
+if "$CC" --version 2>/dev/null | grep -q clang; then
+    CLANG=1
+    GENERATE="-fprofile-instr-generate=$WORK/profile/%p.profraw"
+    USE="-fprofile-instr-use=$WORK/merged.profdata"
+else
+    CLANG=0
+    GENERATE="-fprofile-generate=$WORK/profile -fprofile-update=atomic"
+    USE="-fprofile-use=$WORK/profile -fprofile-correction -Wno-missing-profile"
+fi
+
+echo "Generating training inputs"
+$CC $CFLAGS $INCLUDES bench/bench.c -o "$WORK/bench" $LIBS
+"$WORK/bench" --generate "$WORK/inputs" > /dev/null
+
+# Both builds compile to the same object path, so GCC finds the profile again
+echo "Building instrumented binary"
+$CC $CFLAGS $INCLUDES $GENERATE -c code-to-image.c -o "$WORK/code-to-image.o"
+$CC $CFLAGS $GENERATE "$WORK/code-to-image.o" -o "$WORK/code-to-image-instrumented" $LIBS
+
+echo "Training"
+"$WORK/code-to-image-instrumented" --rescan-fonts -i "$WORK/inputs/snippet.c" "$WORK/out.png" > /dev/null 2>&1
+for font in JetBrainsMono-Regular FiraCode-Regular; do
+    for input in "$WORK"/inputs/*.c; do
+        # Inputs are laid out and highlighted in full, but big images are only partly drawn
+        case "$input" in
+            *snippet.c) size="" ;;
+            *) size="-w 2000 -h 4000" ;;
+        esac
+        for options in "-j 1" "-j 1 --png-level 1" "-j 1 --png-level 9" "-j 1 --palette" "-j 4"; do
+            if ! "$WORK/code-to-image-instrumented" -f "$font" -i "$input" $size $options "$WORK/out.png" > /dev/null 2>&1; then
+                echo "warning: training run failed: -f $font -i $(basename "$input") $size $options" >&2
+            fi
+        done
+    done
+done
+
+echo "Building optimized binary"
+if [ "$CLANG" = 1 ]; then
+    llvm-profdata merge -output="$WORK/merged.profdata" "$WORK"/profile/*.profraw
+fi
+$CC $CFLAGS $INCLUDES $USE -c code-to-image.c -o "$WORK/code-to-image.o"
+$CC $CFLAGS "$WORK/code-to-image.o" -o "$OUTPUT" $LIBS
+echo "Wrote $OUTPUT"
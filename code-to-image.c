@@ -1,19 +1,50 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h> // For strncasecmp
 #include <stdint.h> // For uint8_t
 #include <stdbool.h> // For bool
 #include <math.h>   // Required for sqrt, floor, ceil, acos, cos, pow, fmod
 #include <dirent.h> // Required for directory traversal
+#include <pthread.h> // Worker threads for batch rendering
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h> // Peak RSS for --stats
+#include <sys/file.h>     // flock, for the output cache
+#include <sys/mman.h>     // Mapped font and glyph files
+#include <fcntl.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/inotify.h> // Watch mode
+#endif
+#include <sys/socket.h> // Render daemon
+#include <sys/un.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <limits.h> // For PATH_MAX
+#include <assert.h> // Used by stb_truetype; must come before the visibility pragma below
 
-// Define STB_IMAGE_WRITE_IMPLEMENTATION and STB_TRUETYPE_IMPLEMENTATION
-// in ONE .c file (this one) before including their headers to get the implementations.
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb/stb_image_write.h" // Path to stb_image_write.h
+// Built as a library, only the cti_* API (marked CTI_API in code-to-image.h) is exported.
+// Everything else, stb_truetype included, is hidden so it cannot clash with the host program.
+#ifdef CODE_TO_IMAGE_NO_MAIN
+#pragma GCC visibility push(hidden)
+#endif
 
+// Define STB_TRUETYPE_IMPLEMENTATION in ONE .c file (this one) before including
+// the header to get the implementation. PNG output is encoded below (see PNG Encoder).
 #define STB_TRUETYPE_IMPLEMENTATION
+// Its temporary buffers come from a per-thread arena (see Scratch Arena)
+void *scratch_alloc(size_t size);
+void scratch_free(void *pointer);
+#define STBTT_malloc(x, u) ((void)(u), scratch_alloc(x))
+#define STBTT_free(x, u) ((void)(u), scratch_free(x))
 #include "stb/stb_truetype.h"    // Path to stb_truetype.h
 
+#include "code-to-image.h" // The library API, implemented at the end of this file
+
 // --- GLOBAL CONSTANT ---
 #define CHANNELS 3 // Define CHANNELS as a global constant for RGB images
 
@@ -23,146 +54,91 @@
 typedef struct {
     char *name; // User-friendly name (e.g., "JetBrainsMono-Regular")
     char *path; // Full path to the .ttf file
+    // Key vertical metrics read from the hhea/head tables, in font units
+    int ascent, descent, line_gap;
+    int units_per_em;
+    const char *coverage; // Codepoint ranges the font has glyphs for (see Font Discovery), or NULL
 } FontInfo;
 
-// Global list of discovered fonts
-FontInfo *discovered_fonts = NULL;
-int discovered_fonts_count = 0;
-int discovered_fonts_capacity = 0;
-
-// --- Helper Functions ---
-
-// Function to convert hex color string to RGB values
-// Assumes hex_color is "#RRGGBB"
-void hex_to_rgb(const char* hex_color, uint8_t* r, uint8_t* g, uint8_t* b) {
-    if (!hex_color || strlen(hex_color) != 7 || hex_color[0] != '#') {
-        *r = *g = *b = 0; // Default to black on error
-        return;
-    }
-    sscanf(hex_color + 1, "%2hhx%2hhx%2hhx", r, g, b);
-}
-
-// Function to draw a single character bitmap onto the main image buffer
-void draw_char_bitmap(uint8_t* img_pixels, int img_width, int img_height,
-                      uint8_t* char_pixels, int char_width, int char_height,
-                      int draw_x, int draw_y,
-                      uint8_t r, uint8_t g, uint8_t b) {
-    for (int cy = 0; cy < char_height; ++cy) {
-        for (int cx = 0; cx < char_width; ++cx) {
-            int img_px = draw_x + cx;
-            int img_py = draw_y + cy;
-
-            // Check boundaries
-            if (img_px >= 0 && img_px < img_width && img_py >= 0 && img_py < img_height) {
-                uint8_t alpha = char_pixels[cy * char_width + cx];
-                int img_idx = (img_py * img_width + img_px) * CHANNELS; // Use CHANNELS constant
-
-                float alpha_norm = alpha / 255.0f;
+// Work done drawing into a canvas, reported by --stats
+typedef struct {
+    uint64_t glyphs;        // Glyph bitmaps drawn at least partly inside the canvas
+    uint64_t pixels;        // Glyph pixels with nonzero coverage written
+    double fill_seconds;    // Filling the background
+    double raster_seconds;  // Drawing the glyphs
+} DrawStats;
 
-                img_pixels[img_idx + 0] = (uint8_t)(alpha_norm * r + (1.0f - alpha_norm) * img_pixels[img_idx + 0]);
-                img_pixels[img_idx + 1] = (uint8_t)(alpha_norm * g + (1.0f - alpha_norm) * img_pixels[img_idx + 1]);
-                img_pixels[img_idx + 2] = (uint8_t)(alpha_norm * b + (1.0f - alpha_norm) * img_pixels[img_idx + 2]);
-            }
-        }
-    }
+static inline void draw_stats_add(DrawStats *total, const DrawStats *part) {
+    total->glyphs += part->glyphs;
+    total->pixels += part->pixels;
+    total->fill_seconds += part->fill_seconds;
+    total->raster_seconds += part->raster_seconds;
 }
 
-// Function to draw text string onto the image buffer and return the end x-position
-int draw_text(uint8_t* img_pixels, int img_width, int img_height,
-               int start_x, int start_y, const char* text,
-               stbtt_fontinfo* font, float scale, uint8_t r, uint8_t g, uint8_t b) {
-
-    int x_cursor = start_x;
-
-    int ascent, descent, lineGap;
-    stbtt_GetFontVMetrics(font, &ascent, &descent, &lineGap);
-    int baseline = (int)(ascent * scale);
-
-    for (int i = 0; text[i]; ++i) {
-        int codepoint = (unsigned char)text[i]; // Simple ASCII assumed, handle UTF-8 for real
-
-        int char_width, char_height, x_offset, y_offset;
-        uint8_t* char_bitmap = stbtt_GetCodepointBitmap(font, 0, scale, codepoint, &char_width, &char_height, &x_offset, &y_offset);
+// A horizontal band of the image being drawn: image rows [y0, y0 + rows).
+// Drawing takes image coordinates and clips to the band.
+typedef struct {
+    uint8_t *pixels;  // rows * width * CHANNELS bytes
+    int width;        // Image width in pixels
+    int y0;           // Image row of the band's first row
+    int rows;
+    DrawStats stats;  // Added to by everything drawn into the canvas
+} Canvas;
 
-        if (char_bitmap) {
-            int draw_x = x_cursor + x_offset;
-            int draw_y = start_y + baseline + y_offset;
+// --- Logging ---
+//
+// Diagnostics go through log_message and are off by default: -v shows info messages, -vv
+// debug messages too. Errors are still printed unconditionally with fprintf.
 
-            draw_char_bitmap(img_pixels, img_width, img_height,
-                             char_bitmap, char_width, char_height,
-                             draw_x, draw_y, r, g, b);
+typedef enum {
+    LOG_OFF,
+    LOG_WARN,
+    LOG_INFO,
+    LOG_DEBUG,
+} LogLevel;
 
-            free(char_bitmap);
-        }
+static const char *const log_level_names[] = { "off", "warn", "info", "debug" };
+LogLevel log_level = LOG_OFF;
 
-        int advance_width;
-        stbtt_GetCodepointHMetrics(font, codepoint, &advance_width, NULL);
-        x_cursor += (int)(advance_width * scale);
+// Function to print one diagnostic line to stderr if its level is enabled. The message is
+// formatted in one piece so lines from different threads do not interleave; a trailing
+// newline is dropped.
+__attribute__((format(printf, 2, 3)))
+void log_message(LogLevel level, const char *format, ...) {
+    if (level > log_level) return;
+    static const char *const prefixes[] = { "", "WARNING", "INFO", "DEBUG" };
+    char line[1024];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (length > 0 && (size_t)length < sizeof(line) && line[length - 1] == '\n') {
+        line[length - 1] = '\0';
     }
-    return x_cursor;
+    fprintf(stderr, "%s: %s\n", prefixes[level], line);
 }
 
-// Function to add a font to the discovered_fonts list
-void add_font(const char* name, const char* path) {
-    if (discovered_fonts_count >= discovered_fonts_capacity) {
-        discovered_fonts_capacity = (discovered_fonts_capacity == 0) ? 4 : discovered_fonts_capacity * 2;
-        discovered_fonts = realloc(discovered_fonts, sizeof(FontInfo) * discovered_fonts_capacity);
-        if (!discovered_fonts) {
-            fprintf(stderr, "Memory allocation failed for fonts list!\n");
-            exit(EXIT_FAILURE);
+// Function to look up a log level by name. Returns false for unknown names.
+bool parse_log_level(const char *name, LogLevel *out_level) {
+    for (int i = 0; i <= LOG_DEBUG; ++i) {
+        if (strcmp(name, log_level_names[i]) == 0) {
+            *out_level = (LogLevel)i;
+            return true;
         }
     }
-    discovered_fonts[discovered_fonts_count].name = strdup(name);
-    discovered_fonts[discovered_fonts_count].path = strdup(path);
-    if (!discovered_fonts[discovered_fonts_count].name || !discovered_fonts[discovered_fonts_count].path) {
-        fprintf(stderr, "Memory allocation failed for font name/path!\n");
-        exit(EXIT_FAILURE);
-    }
-    discovered_fonts_count++;
+    return false;
 }
 
-// Recursive function to collect .ttf font files
-void collect_fonts_recursive(const char* base_path) {
-    DIR *dir = opendir(base_path); 
-    if (!dir) {
-        return;
-    }
-
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
-
-        char path[1024];
-        snprintf(path, sizeof(path), "%s/%s", base_path, entry->d_name);
-
-        if (entry->d_type == DT_DIR) { // If it's a directory, recurse
-            collect_fonts_recursive(path);
-        } else if (entry->d_type == DT_REG) { // If it's a regular file
-            const char* ext = strrchr(entry->d_name, '.');
-            if (ext && strcmp(ext, ".ttf") == 0) {
-                // Extract a friendly name from the filename (e.g., "FiraCode-Regular")
-                char font_name[256];
-                strncpy(font_name, entry->d_name, ext - entry->d_name);
-                font_name[ext - entry->d_name] = '\0';
-                add_font(font_name, path);
-            }
-        }
-    }
-    closedir(dir);
-}
+// --- Helper Functions ---
 
-// Function to free all discovered font info
-void free_discovered_fonts() {
-    for (int i = 0; i < discovered_fonts_count; ++i) {
-        free(discovered_fonts[i].name);
-        free(discovered_fonts[i].path);
+// Function to convert hex color string to RGB values
+// Assumes hex_color is "#RRGGBB"
+void hex_to_rgb(const char* hex_color, uint8_t* r, uint8_t* g, uint8_t* b) {
+    if (!hex_color || strlen(hex_color) != 7 || hex_color[0] != '#') {
+        *r = *g = *b = 0; // Default to black on error
+        return;
     }
-    free(discovered_fonts);
-    discovered_fonts = NULL;
-    discovered_fonts_count = 0;
-    discovered_fonts_capacity = 0;
+    sscanf(hex_color + 1, "%2hhx%2hhx%2hhx", r, g, b);
 }
 
 // Function to load the content of a file into a malloc'ed buffer
@@ -196,363 +172,7225 @@ char *load_file(const char *filename, size_t *out_size) {
     return buf;
 }
 
-// Function to calculate the required image dimensions based on code content and font
-// Added font_pixel_height as a parameter here
-void get_code_dimensions(const char* code_buffer, stbtt_fontinfo* font, float scale, float font_pixel_height, float line_spacing_multiplier, int padding, int* out_max_width, int* out_total_height) {
-    *out_max_width = 0;
-    *out_total_height = 0;
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-    if (!code_buffer || !font) {
-        fprintf(stderr, "DEBUG: get_code_dimensions received null code_buffer or font.\n");
-        return;
+// Function to write all of data to a file descriptor, retrying short writes
+static bool write_all(int fd, const void *data, size_t size) {
+    const uint8_t *src = data;
+    while (size > 0) {
+        ssize_t n = write(fd, src, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        src += n;
+        size -= (size_t)n;
     }
+    return true;
+}
 
-    int line_count = 0;
-    int current_line_char_count = 0; // Number of characters on the current line
-    int max_line_char_count = 0; // Maximum number of characters on any line
-
-    int ascent, descent, lineGap;
-    stbtt_GetFontVMetrics(font, &ascent, &descent, &lineGap);
-    // Use the vertical metrics to get an accurate line height
-    float font_line_height_base = (ascent - descent + lineGap) * scale;
+// Growable byte buffer used for in-memory image output
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+    bool failed;     // Set when an append ran out of memory
+} ByteBuffer;
 
-    // Get the advance width of a space character. This is typically the character width for monospace fonts.
-    int space_advance_width_units;
-    stbtt_GetCodepointHMetrics(font, ' ', &space_advance_width_units, NULL);
-    float assumed_char_width = space_advance_width_units * scale;
-    
-    // Fallback if space has zero width or invalid (e.g., non-displayable characters)
-    if (assumed_char_width <= 0) { 
-        stbtt_GetCodepointHMetrics(font, 'M', &space_advance_width_units, NULL);
-        assumed_char_width = space_advance_width_units * scale;
-        if (assumed_char_width <= 0) {
-            assumed_char_width = font_pixel_height * 0.6f; // A heuristic fallback using the passed parameter
-        }
+// Function to append bytes to a ByteBuffer, growing it as needed
+bool byte_buffer_append(ByteBuffer *buffer, const void *data, size_t size) {
+    if (size == 0) return true; // data may be NULL
+    if (buffer->size + size > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+        while (capacity < buffer->size + size) capacity *= 2;
+        uint8_t *grown = realloc(buffer->data, capacity);
+        if (!grown) return false;
+        buffer->data = grown;
+        buffer->capacity = capacity;
     }
-    fprintf(stderr, "DEBUG: Assumed Char Width for calculation: %.2f pixels\n", assumed_char_width);
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+    return true;
+}
 
+void byte_buffer_free(ByteBuffer *buffer) {
+    free(buffer->data);
+    memset(buffer, 0, sizeof(*buffer));
+}
 
-    for (size_t i = 0; code_buffer[i] != '\0'; ++i) {
-        int codepoint = (unsigned char)code_buffer[i]; // Simple ASCII assumed, handle UTF-8 for real
-        if (codepoint == '\n') {
-            if (current_line_char_count > max_line_char_count) {
-                max_line_char_count = current_line_char_count;
-            }
-            current_line_char_count = 0;
-            line_count++;
-        } else if (codepoint == '\t') { // Handle tabs as 4 spaces for width calculation
-            current_line_char_count += 4; // Assuming 4 space tab width
-        } else {
-            current_line_char_count++;
-        }
-    }
-    // Handle the last line if it doesn't end with a newline
-    if (current_line_char_count > max_line_char_count) {
-        max_line_char_count = current_line_char_count;
-    }
-    line_count++; // Account for the last line (even empty files have 1 line)
+// --- Scratch Arena ---
+//
+// stb_truetype allocates and frees several buffers for every glyph it rasterizes (outline
+// points, edge lists, active edges and the bitmap handed to the glyph cache). With many
+// threads rendering, those mallocs contend in the allocator and fragment the heap. They come
+// from a bump arena owned by the calling thread instead: allocation is a pointer increment,
+// free only counts down, and the arena is rewound once nothing in it is live, which is after
+// every glyph. scratch_end_render() marks the end of a render; the peak use of any arena is
+// reported by --stats. Build with -DSCRATCH_ARENA_DEBUG to tag every allocation and abort
+// when one outlives its render, is freed twice or is freed on another thread.
 
-    // Calculate width based on max character count and assumed monospace width
-    *out_max_width = (int)(max_line_char_count * assumed_char_width + 0.5f); // Round up to nearest integer
-    *out_max_width += 2 * padding; // Add horizontal padding for code block
+#define SCRATCH_CHUNK_BYTES (256 * 1024)
+#define SCRATCH_ALIGN 16
+#define SCRATCH_CHUNK_HEADER ((sizeof(ScratchChunk) + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1))
+#ifdef SCRATCH_ARENA_DEBUG
+#define SCRATCH_TAG_BYTES SCRATCH_ALIGN
+#define SCRATCH_MAGIC 0x5c7a7c4u
+#define SCRATCH_POISON 0xdd
+#else
+#define SCRATCH_TAG_BYTES 0
+#endif
 
-    *out_total_height = (int)(line_count * font_line_height_base * line_spacing_multiplier + 0.5f); // Round up
-    *out_total_height += 2 * padding; // Add vertical padding for code block
+typedef struct ScratchChunk {
+    struct ScratchChunk *next; // Chunk filled before this one
+    size_t size;
+    size_t used;
+} ScratchChunk;
 
-    // Ensure minimum dimensions (these should be generous enough for a small snippet)
-    if (*out_max_width < (int)(font_pixel_height * 10)) *out_max_width = (int)(font_pixel_height * 10); // Minimum 10 chars wide
-    if (*out_total_height < (int)(font_pixel_height * 3)) *out_total_height = (int)(font_pixel_height * 3); // Minimum 3 lines tall
+typedef struct {
+    ScratchChunk *chunk;       // Chunk allocations come from; earlier chunks follow it
+    size_t live;               // Allocations not freed yet
+    size_t used;               // Bytes handed out since the arena was last rewound
+    size_t peak;               // Most bytes in use at once
+    size_t next_size;          // After spilling into a second chunk, one chunk this big replaces them
+#ifdef SCRATCH_ARENA_DEBUG
+    uint32_t generation;       // Renders ended on this thread; tags from older ones are stale
+#endif
+} ScratchArena;
+
+#ifdef SCRATCH_ARENA_DEBUG
+typedef struct {
+    uint32_t magic;
+    uint32_t generation;
+    ScratchArena *arena;
+} ScratchTag;
+#endif
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_key_once = PTHREAD_ONCE_INIT;
+static atomic_size_t scratch_peak_bytes; // Largest peak of any thread's arena
+
+static void scratch_record_peak(const ScratchArena *arena) {
+    size_t peak = atomic_load_explicit(&scratch_peak_bytes, memory_order_relaxed);
+    while (arena->peak > peak &&
+           !atomic_compare_exchange_weak_explicit(&scratch_peak_bytes, &peak, arena->peak,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
 
-    fprintf(stderr, "DEBUG: Lines: %d, Max Chars per line: %d\n", line_count, max_line_char_count);
-    fprintf(stderr, "DEBUG: Calculated Image Dimensions (before user override): %dx%d\n", *out_max_width, *out_total_height);
+static void scratch_free_chunks(ScratchArena *arena) {
+    while (arena->chunk) {
+        ScratchChunk *next = arena->chunk->next;
+        free(arena->chunk);
+        arena->chunk = next;
+    }
 }
 
+// Runs when a thread that used its arena exits
+static void scratch_arena_destroy(void *pointer) {
+    ScratchArena *arena = pointer;
+    scratch_record_peak(arena);
+    scratch_free_chunks(arena);
+    free(arena);
+}
 
-// Print usage help
-void print_usage(const char *progname) {
-    fprintf(stderr, "Usage: %s [options] <output_image_path>\n\n", progname);
-    fprintf(stderr, "Options:\n");
-    fprintf(stderr, "  -i FILE    Input code file to convert (e.g., my_script.c)\n"); // New input option
-    fprintf(stderr, "  -f FONT    Select font (e.g., 'JetBrainsMono-Regular'). See available fonts below.\n");
-    fprintf(stderr, "  -fs SIZE   Set font size in pixels (default: 18.0)\n");
-    fprintf(stderr, "  -w WIDTH   Set image width in pixels (default: calculated based on content, or 200 if no content)\n"); // Updated help
-    fprintf(stderr, "  -h HEIGHT  Set image height in pixels (default: calculated based on content, or 100 if no content)\n"); // Updated help
-    fprintf(stderr, "\nAvailable Fonts (from ./Fonts/ directory):\n");
-    if (discovered_fonts_count == 0) {
-        fprintf(stderr, "  No fonts found. Ensure .ttf files are in 'Fonts/' or its subdirectories.\n");
-    } else {
-        for (int i = 0; i < discovered_fonts_count; ++i) {
-            fprintf(stderr, "  - %s\n", discovered_fonts[i].name);
+static void scratch_key_init(void) {
+    pthread_key_create(&scratch_key, scratch_arena_destroy);
+}
+
+// Function to get the calling thread's arena, creating it on first use
+static ScratchArena *scratch_arena(void) {
+    pthread_once(&scratch_key_once, scratch_key_init);
+    ScratchArena *arena = pthread_getspecific(scratch_key);
+    if (!arena) {
+        arena = calloc(1, sizeof(ScratchArena));
+        if (!arena || pthread_setspecific(scratch_key, arena) != 0) {
+            free(arena);
+            return NULL;
         }
     }
-    fprintf(stderr, "\n");
+    return arena;
 }
 
+// Function to hand out everything again. A spilled arena is replaced by one chunk that fits it.
+static void scratch_rewind(ScratchArena *arena) {
+    if (arena->chunk && arena->chunk->next) {
+        arena->next_size = arena->used;
+        scratch_free_chunks(arena);
+    } else if (arena->chunk) {
+#ifdef SCRATCH_ARENA_DEBUG
+        memset((uint8_t *)arena->chunk + SCRATCH_CHUNK_HEADER, SCRATCH_POISON, arena->chunk->used);
+#endif
+        arena->chunk->used = 0;
+    }
+    arena->used = 0;
+}
 
-int main(int argc, char **argv) {
-    const char *output_image_path = "highlighted_code.png";
-    const char *input_file_path = NULL; // New variable for input file
-    const char *selected_font_name = NULL;
-    float font_pixel_height = 18.0f; // This is the definition needed
-    int img_width_arg = 0; // Use 0 to indicate not set by user
-    int img_height_arg = 0; // Use 0 to indicate not set by user
+void *scratch_alloc(size_t size) {
+    ScratchArena *arena = scratch_arena();
+    if (!arena) return NULL;
+    size_t need = (size + SCRATCH_TAG_BYTES + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+    ScratchChunk *chunk = arena->chunk;
+    if (!chunk || chunk->size - chunk->used < need) {
+        size_t chunk_size = arena->next_size > SCRATCH_CHUNK_BYTES ? arena->next_size : SCRATCH_CHUNK_BYTES;
+        if (chunk_size < need) chunk_size = need;
+        chunk = malloc(SCRATCH_CHUNK_HEADER + chunk_size);
+        if (!chunk) return NULL;
+        *chunk = (ScratchChunk){ .next = arena->chunk, .size = chunk_size };
+        arena->chunk = chunk;
+        arena->next_size = 0;
+    }
+    uint8_t *block = (uint8_t *)chunk + SCRATCH_CHUNK_HEADER + chunk->used;
+    chunk->used += need;
+    arena->used += need;
+    arena->live++;
+    if (arena->used > arena->peak) arena->peak = arena->used;
+#ifdef SCRATCH_ARENA_DEBUG
+    *(ScratchTag *)block = (ScratchTag){ SCRATCH_MAGIC, arena->generation, arena };
+#endif
+    return block + SCRATCH_TAG_BYTES;
+}
 
-    // Discover fonts BEFORE parsing arguments so we can list them in usage
-    collect_fonts_recursive("Fonts");
+void scratch_free(void *pointer) {
+    if (!pointer) return;
+    ScratchArena *arena = pthread_getspecific(scratch_key);
+#ifdef SCRATCH_ARENA_DEBUG
+    ScratchTag *tag = (ScratchTag *)((uint8_t *)pointer - SCRATCH_TAG_BYTES);
+    if (tag->magic != SCRATCH_MAGIC || tag->arena != arena || tag->generation != arena->generation) {
+        fprintf(stderr, "Error: Scratch allocation %p freed twice, on another thread or after its render.\n", pointer);
+        abort();
+    }
+    tag->magic = 0;
+#endif
+    if (--arena->live == 0) {
+        scratch_rewind(arena);
+    }
+}
 
-    // Parse arguments
-    for (int i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-u") == 0) {
-            print_usage(argv[0]);
-            free_discovered_fonts();
-            return 0; // EXIT IMMEDIATELY AFTER PRINTING HELP
-        }
-        else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
-            input_file_path = argv[++i];
-        }
-        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
-            selected_font_name = argv[++i];
-        } else if (strcmp(argv[i], "-fs") == 0 && i + 1 < argc) {
-            font_pixel_height = atof(argv[++i]);
-            if (font_pixel_height <= 0) {
-                fprintf(stderr, "Error: Font size must be positive.\n");
-                free_discovered_fonts();
-                return 1;
-            }
-        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
-            img_width_arg = atoi(argv[++i]);
-            if (img_width_arg <= 0) {
-                fprintf(stderr, "Error: Image width must be positive.\n");
-                free_discovered_fonts();
-                return 1;
-            }
-        } else if (strcmp(argv[i], "-h") == 0 && i + 1 < argc) {
-            img_height_arg = atoi(argv[++i]);
-            if (img_height_arg <= 0) {
-                fprintf(stderr, "Error: Image height must be positive.\n");
-                free_discovered_fonts();
-                return 1;
-            }
-        } else if (argv[i][0] == '-') {
-            fprintf(stderr, "Unknown option '%s'\n", argv[i]);
-            print_usage(argv[0]);
-            free_discovered_fonts();
-            return 1;
-        } else {
-            output_image_path = argv[i]; // Positional argument for output file
-        }
+// Function to end a render on the calling thread: nothing allocated during it may still be live
+void scratch_end_render(void) {
+    ScratchArena *arena = scratch_arena();
+    if (!arena) return;
+    if (arena->live > 0) {
+#ifdef SCRATCH_ARENA_DEBUG
+        fprintf(stderr, "Error: %zu scratch allocations outlived their render.\n", arena->live);
+        abort();
+#else
+        log_message(LOG_WARN, "%zu scratch allocations outlived their render", arena->live);
+        return;
+#endif
     }
+#ifdef SCRATCH_ARENA_DEBUG
+    arena->generation++;
+#endif
+    scratch_record_peak(arena);
+}
 
-    // --- Validate Input File and Load Content ---
-    char *code_content = NULL;
-    size_t code_content_size = 0;
-    if (input_file_path) {
-        code_content = load_file(input_file_path, &code_content_size);
-        if (!code_content) {
-            fprintf(stderr, "Error: Could not read input file '%s'.\n", input_file_path);
-            free_discovered_fonts();
-            return 1;
-        }
-    } else {
-        fprintf(stderr, "Error: No input code file specified. Use -i <filepath>.\n");
-        print_usage(argv[0]);
-        free_discovered_fonts();
-        return 1;
+// Function to free the calling thread's arena now, for threads that return from main
+void scratch_thread_exit(void) {
+    pthread_once(&scratch_key_once, scratch_key_init);
+    ScratchArena *arena = pthread_getspecific(scratch_key);
+    if (arena) {
+        pthread_setspecific(scratch_key, NULL);
+        scratch_arena_destroy(arena);
     }
+}
 
+static inline size_t scratch_peak(void) {
+    return atomic_load_explicit(&scratch_peak_bytes, memory_order_relaxed);
+}
 
-    // --- Font Loading Setup (needed for dimension calculation and drawing) ---
-    const char* font_to_load_path = NULL;
-    if (selected_font_name == NULL && discovered_fonts_count > 0) {
-        font_to_load_path = discovered_fonts[0].path; // Default to the first discovered font
-        fprintf(stderr, "No font specified. Defaulting to '%s'.\n", discovered_fonts[0].name);
-    } else if (selected_font_name == NULL && discovered_fonts_count == 0) {
-         fprintf(stderr, "Error: No fonts found in 'Fonts/' directory. Cannot proceed without a font.\n");
-         free(code_content);
-         free_discovered_fonts();
-         return 1;
-    } else {
-        // Find the specified font
-        for (int i = 0; i < discovered_fonts_count; ++i) {
-            if (strcmp(selected_font_name, discovered_fonts[i].name) == 0) {
-                font_to_load_path = discovered_fonts[i].path;
-                break;
-            }
-        }
-        if (!font_to_load_path) {
-            fprintf(stderr, "Error: Specified font '%s' not found.\n", selected_font_name);
-            print_usage(argv[0]); // Print usage again if font not found
-            free(code_content);
-            free_discovered_fonts();
-            return 1;
-        }
+// --- Span Blending ---
+
+// Longest run of pixels handed to a blend kernel in one call; longer runs are split
+#define BLEND_CHUNK_PIXELS 256
+
+// Blends n bytes of src over dst using a per-byte coverage value:
+// dst = (src * a + dst * (255 - a)) / 255, rounded down.
+// Every kernel must produce bit-identical output to blend_bytes_scalar.
+typedef void (*BlendBytesFn)(uint8_t *dst, const uint8_t *src, const uint8_t *alpha, int n);
+
+// Exact floor(t / 255) for 0 <= t <= 255 * 255
+static inline uint8_t div255(unsigned int t) {
+    return (uint8_t)((t + 1 + (t >> 8)) >> 8);
+}
+
+static void blend_bytes_scalar(uint8_t *dst, const uint8_t *src, const uint8_t *alpha, int n) {
+    for (int i = 0; i < n; ++i) {
+        unsigned int a = alpha[i];
+        dst[i] = div255(src[i] * a + dst[i] * (255 - a));
     }
+}
 
-    long font_buffer_size;
-    unsigned char* font_buffer = NULL;
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
 
-    FILE* font_file = fopen(font_to_load_path, "rb");
-    if (!font_file) {
-        fprintf(stderr, "Error: Could not open font file '%s'. This should not happen if discovered correctly.\n", font_to_load_path);
-        free(code_content);
-        free_discovered_fonts();
-        return 1;
+__attribute__((target("sse2")))
+static void blend_bytes_sse2(uint8_t *dst, const uint8_t *src, const uint8_t *alpha, int n) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max = _mm_set1_epi16(255);
+    const __m128i one = _mm_set1_epi16(1);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i a = _mm_loadu_si128((const __m128i *)(alpha + i));
+
+        __m128i a_lo = _mm_unpacklo_epi8(a, zero), a_hi = _mm_unpackhi_epi8(a, zero);
+        __m128i t_lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), a_lo),
+                                     _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_sub_epi16(max, a_lo)));
+        __m128i t_hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), a_hi),
+                                     _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_sub_epi16(max, a_hi)));
+        // (t + 1 + (t >> 8)) >> 8, all in unsigned 16-bit lanes
+        t_lo = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(t_lo, one), _mm_srli_epi16(t_lo, 8)), 8);
+        t_hi = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(t_hi, one), _mm_srli_epi16(t_hi, 8)), 8);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(t_lo, t_hi));
     }
+    blend_bytes_scalar(dst + i, src + i, alpha + i, n - i);
+}
 
-    fseek(font_file, 0, SEEK_END);
-    font_buffer_size = ftell(font_file);
-    fseek(font_file, 0, SEEK_SET);
+__attribute__((target("avx2")))
+static void blend_bytes_avx2(uint8_t *dst, const uint8_t *src, const uint8_t *alpha, int n) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i max = _mm256_set1_epi16(255);
+    const __m256i one = _mm256_set1_epi16(1);
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i a = _mm256_loadu_si256((const __m256i *)(alpha + i));
 
-    font_buffer = (unsigned char*)malloc(font_buffer_size);
-    if (!font_buffer) {
-        fprintf(stderr, "Failed to allocate font buffer memory!\n");
-        fclose(font_file);
-        free(code_content);
-        free_discovered_fonts();
-        return 1;
+        // unpack/pack both work within 128-bit lanes, so byte order is preserved
+        __m256i a_lo = _mm256_unpacklo_epi8(a, zero), a_hi = _mm256_unpackhi_epi8(a, zero);
+        __m256i t_lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(s, zero), a_lo),
+                                        _mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), _mm256_sub_epi16(max, a_lo)));
+        __m256i t_hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(s, zero), a_hi),
+                                        _mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), _mm256_sub_epi16(max, a_hi)));
+        t_lo = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(t_lo, one), _mm256_srli_epi16(t_lo, 8)), 8);
+        t_hi = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(t_hi, one), _mm256_srli_epi16(t_hi, 8)), 8);
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_packus_epi16(t_lo, t_hi));
     }
-    fread(font_buffer, 1, font_buffer_size, font_file);
-    fclose(font_file);
+    blend_bytes_sse2(dst + i, src + i, alpha + i, n - i);
+}
+#endif
 
-    stbtt_fontinfo font_info;
-    if (!stbtt_InitFont(&font_info, font_buffer, 0)) {
-        fprintf(stderr, "Failed to initialize font from '%s'!\n", font_to_load_path);
-        free(font_buffer);
-        free(code_content);
-        free_discovered_fonts();
-        return 1;
+static BlendBytesFn blend_bytes = blend_bytes_scalar;
+static const char *blend_kernel_name = "scalar";
+
+// Function to pick the widest blend kernel the CPU supports.
+// CODE_TO_IMAGE_BLEND=scalar|sse2|avx2 forces a kernel (useful for comparing output).
+void span_blend_init(void) {
+    const char *forced = getenv("CODE_TO_IMAGE_BLEND");
+    blend_bytes = blend_bytes_scalar;
+    blend_kernel_name = "scalar";
+    if (forced && strcmp(forced, "scalar") == 0) {
+        return;
     }
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    bool want_avx2 = !forced || strcmp(forced, "avx2") == 0;
+    if (want_avx2 && __builtin_cpu_supports("avx2")) {
+        blend_bytes = blend_bytes_avx2;
+        blend_kernel_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        blend_bytes = blend_bytes_sse2;
+        blend_kernel_name = "sse2";
+    }
+#endif
+}
 
-    float scale = stbtt_ScaleForPixelHeight(&font_info, font_pixel_height);
+// Function to draw a single character bitmap onto a canvas band.
+// The glyph rectangle is clipped once; each row is then split into runs that are
+// skipped (fully transparent), copied (fully opaque) or blended by the span kernel.
+void draw_char_bitmap(Canvas *canvas,
+                      const uint8_t* char_pixels, int char_width, int char_height,
+                      int draw_x, int draw_y,
+                      uint8_t r, uint8_t g, uint8_t b) {
+    int img_width = canvas->width;
+    int band_end = canvas->y0 + canvas->rows;
+    int cx0 = draw_x < 0 ? -draw_x : 0;
+    int cy0 = draw_y < canvas->y0 ? canvas->y0 - draw_y : 0;
+    int cx1 = (draw_x + char_width > img_width) ? img_width - draw_x : char_width;
+    int cy1 = (draw_y + char_height > band_end) ? band_end - draw_y : char_height;
+    if (cx0 >= cx1 || cy0 >= cy1) {
+        return;
+    }
+    int span_width = cx1 - cx0;
+    uint64_t covered = 0;
 
-    // --- Determine Image Dimensions ---
-    int calculated_img_width, calculated_img_height;
-    float line_spacing_multiplier = 1.5f; // Matches the constant used in draw loop
-    int inner_padding = 20; // Padding inside the code block for text
+    // Color pattern and expanded coverage for one chunk of pixels
+    uint8_t color[BLEND_CHUNK_PIXELS * CHANNELS];
+    uint8_t alpha[BLEND_CHUNK_PIXELS * CHANNELS];
+    int pattern_pixels = span_width < BLEND_CHUNK_PIXELS ? span_width : BLEND_CHUNK_PIXELS;
+    for (int i = 0; i < pattern_pixels; ++i) {
+        color[i * CHANNELS + 0] = r;
+        color[i * CHANNELS + 1] = g;
+        color[i * CHANNELS + 2] = b;
+    }
 
-    get_code_dimensions(code_content, &font_info, scale, font_pixel_height, line_spacing_multiplier, inner_padding, &calculated_img_width, &calculated_img_height);
+    for (int cy = cy0; cy < cy1; ++cy) {
+        const uint8_t *coverage = char_pixels + (size_t)cy * char_width + cx0;
+        uint8_t *row = canvas->pixels + ((size_t)(draw_y + cy - canvas->y0) * img_width + draw_x + cx0) * CHANNELS;
 
-    // Use user-provided dimensions if available, otherwise use calculated ones
-    int img_width = (img_width_arg > 0) ? img_width_arg : calculated_img_width;
-    int img_height = (img_height_arg > 0) ? img_height_arg : calculated_img_height;
-    
-    // Ensure minimums if calculated dimensions are too small or user provides tiny ones
-    if (img_width < 200) img_width = 200;
-    if (img_height < 100) img_height = 100;
+        int x = 0;
+        while (x < span_width) {
+            if (coverage[x] == 0) {
+                x++;
+                continue;
+            }
 
+            // Collect a run of covered pixels, noting whether all of it is opaque
+            int end = x;
+            bool opaque = true;
+            while (end < span_width && end - x < BLEND_CHUNK_PIXELS && coverage[end] != 0) {
+                opaque &= coverage[end] == 255;
+                end++;
+            }
+            int run = end - x;
+            covered += run;
 
-    // Allocate memory for image pixels
-    uint8_t *pixels = (uint8_t *)malloc(img_width * img_height * CHANNELS); 
-    if (!pixels) {
-        fprintf(stderr, "Failed to allocate pixel buffer memory!\n");
-        free(font_buffer);
-        free(code_content);
-        free_discovered_fonts();
-        return 1;
+            if (opaque) {
+                memcpy(row + x * CHANNELS, color, (size_t)run * CHANNELS);
+            } else {
+                for (int i = 0; i < run; ++i) {
+                    memset(alpha + i * CHANNELS, coverage[x + i], CHANNELS);
+                }
+                blend_bytes(row + x * CHANNELS, color, alpha, run * CHANNELS);
+            }
+            x = end;
+        }
     }
+    canvas->stats.glyphs++;
+    canvas->stats.pixels += covered;
+}
 
+// --- Glyph Map ---
+//
+// Each font keeps a table from codepoint to (glyph index, advance), filled in the first time a
+// character is seen so the cmap is searched at most once per character. ASCII is resolved up
+// front, the rest of the BMP lives in 256-entry pages allocated on demand, and codepoints above
+// U+FFFF go into a small hash table. Entries are written with atomics, so rendering threads can
+// share one map without locking on the common path.
+//
+// A codepoint the font lacks is looked up in the fallback chain (see Font Fallback). The glyph
+// found there gets an index past the font's own glyphs, so glyph caches store it like any other
+// glyph, and its advance is converted to this font's units. ASCII never falls back.
 
-    // --- 2. Define Colors (Dracula-like theme for this example) ---
-    uint8_t bg_r, bg_g, bg_b;
-    uint8_t code_bg_r, code_bg_g, code_bg_b;
-    uint8_t default_text_r, default_text_g, default_text_b;
-    uint8_t comment_r, comment_g, comment_b;
-    uint8_t keyword_r, keyword_g, keyword_b;
-    uint8_t function_r, function_g, function_b;
-    uint8_t string_r, string_g, string_b;
-    uint8_t literal_r, literal_g, literal_b;
+#define GLYPH_MAP_UNSET 0xffffffffu // Entry not looked up yet
+#define GLYPH_MAP_PAGES 256         // One page per high byte of a BMP codepoint
+#define UTF8_REPLACEMENT 0xFFFD
+
+// A resolved entry packs the glyph index in the high 16 bits and the advance in font units
+// (both 16-bit quantities in TrueType) in the low 16 bits.
+typedef struct {
+    _Atomic uint32_t entries[256];
+} GlyphMapPage;
+
+typedef struct {
+    int codepoint;      // 0 marks an empty slot
+    uint32_t value;
+} GlyphMapAstral;
+
+typedef struct FontFallback FontFallback;
+
+// A glyph of another font, standing in for a codepoint this font lacks
+typedef struct {
+    const stbtt_fontinfo *font;
+    int glyph_index;
+    float scale_ratio;  // Its font's scale at any pixel height, relative to this font's
+} FallbackGlyph;
 
-    hex_to_rgb("#1a1a1a", &bg_r, &bg_g, &bg_b);         // Dark background
-    hex_to_rgb("#0d0d0d", &code_bg_r, &code_bg_g, &code_bg_b); // Even darker for code block
-    hex_to_rgb("#f8f8f2", &default_text_r, &default_text_g, &default_text_b); // Foreground (Dracula: #F8F8F2)
-    hex_to_rgb("#6272a4", &comment_r, &comment_g, &comment_b); // Comment (Dracula: #6272A4)
-    hex_to_rgb("#ff79c6", &keyword_r, &keyword_g, &keyword_b); // Keyword (Dracula: #FF79C6)
-    hex_to_rgb("#50fa7b", &function_r, &function_g, &function_b); // Function (Dracula: #50FA7B)
-    hex_to_rgb("#f1fa8c", &string_r, &string_g, &string_b);   // String (Dracula: #F1FA8C)
-    hex_to_rgb("#ffb86c", &literal_r, &literal_g, &literal_b); // Literal/Number (Dracula: #FFB86C)
+bool font_fallback_find(FontFallback *fallback, const stbtt_fontinfo *primary, int codepoint, FallbackGlyph *out);
 
+typedef struct {
+    const stbtt_fontinfo *font;
+    int glyph_count;                              // The font's own glyphs; fallback glyphs follow
+    FontFallback *fallback;                       // Chain for missing codepoints, or NULL
+    pthread_mutex_t fallback_lock;                // Guards the glyphs below
+    FallbackGlyph *fallback_glyphs;
+    int fallback_count;
+    int fallback_capacity;
+    uint32_t ascii[128];                          // Filled when the map is created
+    _Atomic(GlyphMapPage *) pages[GLYPH_MAP_PAGES];
+    pthread_mutex_t astral_lock;                  // Guards the table above the BMP
+    GlyphMapAstral *astral;
+    size_t astral_capacity;                       // Power of two, or 0 before first use
+    size_t astral_count;
+} GlyphMap;
+
+static inline int glyph_map_glyph(uint32_t value) { return (int)(value >> 16); }
+static inline int glyph_map_advance(uint32_t value) { return (int)(value & 0xffff); }
 
-    // --- 3. Fill Background ---
-    for (int y = 0; y < img_height; ++y) {
-        for (int x = 0; x < img_width; ++x) {
-            int index = (y * img_width + x) * CHANNELS;
-            pixels[index + 0] = bg_r;
-            pixels[index + 1] = bg_g;
-            pixels[index + 2] = bg_b;
+// Function to give a fallback glyph an index in this map. Racing threads may both add the same
+// glyph; either index draws the same bitmap. Returns false when the index space is full.
+static bool glyph_map_add_fallback(GlyphMap *map, const FallbackGlyph *glyph, int *out_index) {
+    pthread_mutex_lock(&map->fallback_lock);
+    bool ok = map->glyph_count + map->fallback_count < 0xffff;
+    if (ok && map->fallback_count == map->fallback_capacity) {
+        int capacity = map->fallback_capacity ? map->fallback_capacity * 2 : 16;
+        FallbackGlyph *glyphs = realloc(map->fallback_glyphs, sizeof(FallbackGlyph) * capacity);
+        ok = glyphs != NULL;
+        if (ok) {
+            map->fallback_glyphs = glyphs;
+            map->fallback_capacity = capacity;
         }
     }
+    if (ok) {
+        map->fallback_glyphs[map->fallback_count] = *glyph;
+        *out_index = map->glyph_count + map->fallback_count++;
+    }
+    pthread_mutex_unlock(&map->fallback_lock);
+    return ok;
+}
 
-    // --- 4. Draw Code Block Background ---
-    int code_block_x = inner_padding;
-    int code_block_y = inner_padding;
-    int code_block_width = img_width - 2 * inner_padding;
-    int code_block_height = img_height - 2 * inner_padding;
+// Function to find the fallback glyph behind a glyph index past the font's own glyphs
+bool glyph_map_fallback_glyph(GlyphMap *map, int glyph_index, FallbackGlyph *out) {
+    pthread_mutex_lock(&map->fallback_lock);
+    int slot = glyph_index - map->glyph_count;
+    bool found = slot >= 0 && slot < map->fallback_count;
+    if (found) *out = map->fallback_glyphs[slot];
+    pthread_mutex_unlock(&map->fallback_lock);
+    return found;
+}
 
-    for (int y = code_block_y; y < code_block_y + code_block_height; ++y) {
-        for (int x = code_block_x; x < code_block_x + code_block_width; ++x) {
-            if (x >=0 && x < img_width && y >= 0 && y < img_height) { // Safety check
-                int index = (y * img_width + x) * CHANNELS;
-                pixels[index + 0] = code_bg_r;
-                pixels[index + 1] = code_bg_g;
-                pixels[index + 2] = code_bg_b;
-            }
-        }
+// Search the cmap and hmtx for one codepoint, then the fallback chain if the font lacks it
+static uint32_t glyph_map_resolve(GlyphMap *map, int codepoint) {
+    const stbtt_fontinfo *font = map->font;
+    int glyph = stbtt_FindGlyphIndex(font, codepoint);
+    int advance;
+    FallbackGlyph fallback;
+    if (glyph == 0 && codepoint >= 128 && map->fallback &&
+        font_fallback_find(map->fallback, font, codepoint, &fallback) &&
+        glyph_map_add_fallback(map, &fallback, &glyph)) {
+        stbtt_GetGlyphHMetrics(fallback.font, fallback.glyph_index, &advance, NULL);
+        advance = (int)lroundf(advance * fallback.scale_ratio);
+        if (advance > 0xffff) advance = 0xffff;
+    } else {
+        stbtt_GetGlyphHMetrics(font, glyph, &advance, NULL);
     }
+    return ((uint32_t)glyph << 16) | ((uint32_t)advance & 0xffff);
+}
 
-    // --- 5. Draw Loaded Code Content ---
-    int current_line_y = code_block_y + (int)(font_pixel_height * 0.25); // Small offset for first line from top padding
-    //float line_spacing_factor = 1.5f; // Already used in get_code_dimensions via parameter
-    
-    // Recalculate true line height for drawing, using ascent/descent directly
-    int ascent_draw, descent_draw, lineGap_draw;
-    stbtt_GetFontVMetrics(&font_info, &ascent_draw, &descent_draw, &lineGap_draw);
-    float actual_font_line_height = (ascent_draw - descent_draw + lineGap_draw) * scale * line_spacing_multiplier;
+// Function to set up the codepoint map for a parsed font, falling back to the fonts of
+// fallback (which may be NULL) for missing codepoints
+void glyph_map_init(GlyphMap *map, const stbtt_fontinfo *font, FontFallback *fallback) {
+    memset(map, 0, sizeof(*map));
+    map->font = font;
+    map->glyph_count = font->numGlyphs;
+    for (int c = 0; c < 128; ++c) {
+        map->ascii[c] = glyph_map_resolve(map, c);
+    }
+    map->fallback = fallback;
+    pthread_mutex_init(&map->astral_lock, NULL);
+    pthread_mutex_init(&map->fallback_lock, NULL);
+}
 
-    char *line_start = code_content;
-    char *line_end;
+// Function to release the pages and hash table of a codepoint map
+void glyph_map_free(GlyphMap *map) {
+    for (int i = 0; i < GLYPH_MAP_PAGES; ++i) {
+        free(atomic_load(&map->pages[i]));
+    }
+    free(map->astral);
+    free(map->fallback_glyphs);
+    pthread_mutex_destroy(&map->astral_lock);
+    pthread_mutex_destroy(&map->fallback_lock);
+    memset(map, 0, sizeof(*map));
+}
 
-    // Use a temp buffer for each line to avoid issues with non-null-terminated strncpy
-    char temp_line_buffer[2048]; // Increased buffer size for longer lines
+static uint32_t glyph_map_lookup_astral(GlyphMap *map, int codepoint) {
+    pthread_mutex_lock(&map->astral_lock);
+    uint32_t value = GLYPH_MAP_UNSET;
+    size_t slot = 0;
+    if (map->astral_capacity > 0) {
+        slot = ((unsigned int)codepoint * 2654435761u) & (map->astral_capacity - 1);
+        while (map->astral[slot].codepoint) {
+            if (map->astral[slot].codepoint == codepoint) {
+                value = map->astral[slot].value;
+                break;
+            }
+            slot = (slot + 1) & (map->astral_capacity - 1);
+        }
+    }
 
-    while (true) {
-        line_end = strchr(line_start, '\n');
-        size_t line_len;
+    if (value == GLYPH_MAP_UNSET) {
+        value = glyph_map_resolve(map, codepoint);
 
-        if (line_end != NULL) {
-            line_len = line_end - line_start;
-        } else {
-            line_len = strlen(line_start);
+        // Keep the load factor under 1/2; on allocation failure the result is simply not remembered
+        if ((map->astral_count + 1) * 2 > map->astral_capacity) {
+            size_t capacity = map->astral_capacity ? map->astral_capacity * 2 : 64;
+            GlyphMapAstral *table = calloc(capacity, sizeof(GlyphMapAstral));
+            if (table) {
+                for (size_t i = 0; i < map->astral_capacity; ++i) {
+                    if (!map->astral[i].codepoint) continue;
+                    size_t s = ((unsigned int)map->astral[i].codepoint * 2654435761u) & (capacity - 1);
+                    while (table[s].codepoint) s = (s + 1) & (capacity - 1);
+                    table[s] = map->astral[i];
+                }
+                free(map->astral);
+                map->astral = table;
+                map->astral_capacity = capacity;
+                slot = ((unsigned int)codepoint * 2654435761u) & (capacity - 1);
+                while (table[slot].codepoint) slot = (slot + 1) & (capacity - 1);
+            }
         }
-        
-        // Copy line to temporary buffer, ensuring null-termination and bounds check
-        if (line_len >= sizeof(temp_line_buffer)) {
-            line_len = sizeof(temp_line_buffer) - 1; // Truncate if line is too long
+        if ((map->astral_count + 1) * 2 <= map->astral_capacity) {
+            map->astral[slot] = (GlyphMapAstral){ codepoint, value };
+            map->astral_count++;
         }
-        strncpy(temp_line_buffer, line_start, line_len);
-        temp_line_buffer[line_len] = '\0';
+    }
+    pthread_mutex_unlock(&map->astral_lock);
+    return value;
+}
 
-        // Draw the line (for now, all in default text color)
-        draw_text(pixels, img_width, img_height, code_block_x + 10, current_line_y, temp_line_buffer, &font_info, scale, default_text_r, default_text_g, default_text_b);
-        current_line_y += (int)actual_font_line_height;
+// Function to map a codepoint to its packed glyph index and advance, searching the font only
+// the first time the codepoint is seen
+uint32_t glyph_map_lookup(GlyphMap *map, int codepoint) {
+    if ((unsigned int)codepoint < 128) {
+        return map->ascii[codepoint];
+    }
+    if (codepoint > 0xFFFF) {
+        return glyph_map_lookup_astral(map, codepoint);
+    }
 
-        if (line_end == NULL) { // Reached end of content
-            break;
+    _Atomic(GlyphMapPage *) *page_slot = &map->pages[codepoint >> 8];
+    GlyphMapPage *page = atomic_load_explicit(page_slot, memory_order_acquire);
+    if (!page) {
+        GlyphMapPage *fresh = malloc(sizeof(GlyphMapPage));
+        if (!fresh) {
+            return glyph_map_resolve(map, codepoint);
+        }
+        for (int i = 0; i < 256; ++i) {
+            atomic_init(&fresh->entries[i], GLYPH_MAP_UNSET);
         }
-        line_start = line_end + 1; // Move to the character after newline
+        // Another thread may have installed the page first; use theirs
+        if (atomic_compare_exchange_strong_explicit(page_slot, &page, fresh,
+                                                    memory_order_acq_rel, memory_order_acquire)) {
+            page = fresh;
+        } else {
+            free(fresh);
+        }
+    }
+
+    _Atomic uint32_t *entry = &page->entries[codepoint & 0xff];
+    uint32_t value = atomic_load_explicit(entry, memory_order_relaxed);
+    if (value == GLYPH_MAP_UNSET) {
+        // Racing threads compute the same value, so a plain store is enough
+        value = glyph_map_resolve(map, codepoint);
+        atomic_store_explicit(entry, value, memory_order_relaxed);
     }
+    return value;
+}
 
+// --- UTF-8 ---
 
-    // --- 6. Save the Image ---
-    if (stbi_write_png(output_image_path, img_width, img_height, CHANNELS, pixels, img_width * CHANNELS)) {
-        printf("Successfully wrote '%s'\n", output_image_path);
-    } else {
-        fprintf(stderr, "Failed to write PNG file '%s'!\n", output_image_path);
+// Function to count the leading 7-bit bytes of a string, 32 or 16 bytes at a time where the CPU allows
+static inline size_t utf8_ascii_prefix(const char *text, size_t length) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    while (length - i >= 32) {
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(text + i)));
+        if (mask) return i + __builtin_ctz(mask);
+        i += 32;
+    }
+#endif
+#if defined(__SSE2__)
+    while (length - i >= 16) {
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(text + i)));
+        if (mask) return i + __builtin_ctz(mask);
+        i += 16;
+    }
+#endif
+    while (i < length && (signed char)text[i] >= 0) i++;
+    return i;
+}
+
+// Function to decode one UTF-8 sequence at text[*pos] and advance *pos past it.
+// Malformed, overlong and surrogate sequences decode as U+FFFD and consume one byte.
+static inline int utf8_decode(const char *text, size_t length, size_t *pos) {
+    const uint8_t *s = (const uint8_t *)text + *pos;
+    size_t left = length - *pos;
+    uint8_t lead = s[0];
+    if (lead < 0x80) {
+        *pos += 1;
+        return lead;
     }
 
-    // --- Cleanup ---
-    free(font_buffer);
-    free(pixels);
-    free(code_content); // Free the loaded code content
-    free_discovered_fonts(); // Free all dynamically allocated font info
-    return 0;
+    int size, codepoint, min;
+    if (lead >= 0xC2 && lead <= 0xDF) { size = 2; codepoint = lead & 0x1F; min = 0x80; }
+    else if (lead >= 0xE0 && lead <= 0xEF) { size = 3; codepoint = lead & 0x0F; min = 0x800; }
+    else if (lead >= 0xF0 && lead <= 0xF4) { size = 4; codepoint = lead & 0x07; min = 0x10000; }
+    else { *pos += 1; return UTF8_REPLACEMENT; }
+
+    if (left < (size_t)size) {
+        *pos += 1;
+        return UTF8_REPLACEMENT;
+    }
+    for (int i = 1; i < size; ++i) {
+        if ((s[i] & 0xC0) != 0x80) {
+            *pos += 1;
+            return UTF8_REPLACEMENT;
+        }
+        codepoint = (codepoint << 6) | (s[i] & 0x3F);
+    }
+    if (codepoint < min || codepoint > 0x10FFFF || (codepoint >= 0xD800 && codepoint <= 0xDFFF)) {
+        *pos += 1;
+        return UTF8_REPLACEMENT;
+    }
+    *pos += size;
+    return codepoint;
 }
+
+// --- Glyph Cache ---
+
+// Glyph bitmaps are packed into fixed-size atlas pages that never move,
+// so pointers handed out by the cache stay valid until it is freed.
+#define GLYPH_ATLAS_PAGE_SIZE (64 * 1024)
+#define GLYPH_CACHE_INITIAL_CAPACITY 256 // Must be a power of two
+#define TAB_STOP_COLUMNS 4 // Tab stops every four space widths
+
+// A glyph rasterized once and reused for every later occurrence
+typedef struct {
+    int glyph_index;
+    bool used;          // Slot is occupied in the hash table
+    int width, height;  // Bitmap size in pixels (0x0 for blank glyphs such as space)
+    int x_offset, y_offset; // Bitmap offset from the pen position / baseline
+    int advance;        // Horizontal advance in pixels
+    const uint8_t *bitmap; // Coverage bitmap inside an atlas page or a glyph file, or NULL
+} CachedGlyph;
+
+typedef struct GlyphFile GlyphFile;
+bool glyph_file_find(GlyphFile *file, int glyph_index, CachedGlyph *glyph);
+void glyph_file_add(GlyphFile *file, const CachedGlyph *glyph);
+
+typedef struct AtlasPage {
+    struct AtlasPage *next;
+    size_t used;
+    size_t capacity;
+    uint8_t data[];
+} AtlasPage;
+
+typedef struct SdfAtlas SdfAtlas;
+uint8_t *sdf_glyph_bitmap(SdfAtlas *atlas, int glyph_index, float scale,
+                          int *width, int *height, int *x_offset, int *y_offset);
+
+// Cache of rasterized glyphs for one (font, pixel size) pair
+typedef struct {
+    const stbtt_fontinfo *font;
+    GlyphMap *map;              // The font's shared codepoint map
+    float pixel_height;
+    float scale;
+    int baseline;               // Ascent in pixels, shared by every glyph
+    int ascii_advance[128];     // Pixel advance of each ASCII character, as drawn
+    int mono_advance;           // Advance shared by all printable ASCII, or 0 if proportional
+    int tab_width;              // Distance between tab stops in pixels
+    CachedGlyph *glyphs;        // Open-addressed hash table keyed by glyph index
+    int glyph_capacity;
+    int glyph_count;
+    AtlasPage *pages;           // Most recently allocated page first
+    unsigned long hits;
+    unsigned long misses;
+    size_t atlas_bytes;         // Bytes of glyph bitmaps stored in the atlas
+    SdfAtlas *sdf;              // When set, bitmaps are resampled from these distance fields
+    GlyphFile *file;            // Glyphs rasterized by earlier runs, or NULL
+} GlyphCache;
+
+static inline unsigned int glyph_hash(int glyph_index, int capacity) {
+    return ((unsigned int)glyph_index * 2654435761u) & (unsigned int)(capacity - 1);
+}
+
+// Function to set up an empty glyph cache for a font at a given pixel height
+bool glyph_cache_init(GlyphCache *cache, GlyphMap *map, float pixel_height) {
+    const stbtt_fontinfo *font = map->font;
+    memset(cache, 0, sizeof(*cache));
+    cache->font = font;
+    cache->map = map;
+    cache->pixel_height = pixel_height;
+    cache->scale = stbtt_ScaleForPixelHeight(font, pixel_height);
+
+    int ascent, descent, lineGap;
+    stbtt_GetFontVMetrics(font, &ascent, &descent, &lineGap);
+    cache->baseline = (int)(ascent * cache->scale);
+
+    // Advances come from the glyph map, so layout never has to rasterize
+    for (int c = 0; c < 128; ++c) {
+        cache->ascii_advance[c] = (int)(glyph_map_advance(map->ascii[c]) * cache->scale);
+    }
+    cache->mono_advance = cache->ascii_advance[' '];
+    for (int c = ' '; c < 127; ++c) {
+        if (cache->ascii_advance[c] != cache->mono_advance) {
+            cache->mono_advance = 0;
+            break;
+        }
+    }
+    int space_width = cache->ascii_advance[' '] > 0 ? cache->ascii_advance[' '] : cache->ascii_advance['M'];
+    if (space_width <= 0) {
+        space_width = (int)(pixel_height * 0.6f);
+    }
+    cache->tab_width = TAB_STOP_COLUMNS * (space_width > 0 ? space_width : 1);
+
+    cache->glyph_capacity = GLYPH_CACHE_INITIAL_CAPACITY;
+    cache->glyphs = calloc(cache->glyph_capacity, sizeof(CachedGlyph));
+    return cache->glyphs != NULL;
+}
+
+// Function to release every glyph and atlas page owned by the cache
+void glyph_cache_free(GlyphCache *cache) {
+    AtlasPage *page = cache->pages;
+    while (page) {
+        AtlasPage *next = page->next;
+        free(page);
+        page = next;
+    }
+    free(cache->glyphs);
+    memset(cache, 0, sizeof(*cache));
+}
+
+// Copy a glyph bitmap into the atlas, opening a new page when the current one is full
+static uint8_t *glyph_atlas_store(GlyphCache *cache, const uint8_t *bitmap, size_t size) {
+    AtlasPage *page = cache->pages;
+    if (!page || page->capacity - page->used < size) {
+        size_t capacity = size > GLYPH_ATLAS_PAGE_SIZE ? size : GLYPH_ATLAS_PAGE_SIZE;
+        page = malloc(sizeof(AtlasPage) + capacity);
+        if (!page) return NULL;
+        page->used = 0;
+        page->capacity = capacity;
+        page->next = cache->pages;
+        cache->pages = page;
+    }
+    uint8_t *dst = page->data + page->used;
+    memcpy(dst, bitmap, size);
+    page->used += size;
+    cache->atlas_bytes += size;
+    return dst;
+}
+
+// Double the hash table and reinsert every glyph (bitmaps stay where they are)
+static bool glyph_cache_grow(GlyphCache *cache) {
+    int new_capacity = cache->glyph_capacity * 2;
+    CachedGlyph *new_glyphs = calloc(new_capacity, sizeof(CachedGlyph));
+    if (!new_glyphs) return false;
+
+    for (int i = 0; i < cache->glyph_capacity; ++i) {
+        if (!cache->glyphs[i].used) continue;
+        unsigned int slot = glyph_hash(cache->glyphs[i].glyph_index, new_capacity);
+        while (new_glyphs[slot].used) {
+            slot = (slot + 1) & (new_capacity - 1);
+        }
+        new_glyphs[slot] = cache->glyphs[i];
+    }
+    free(cache->glyphs);
+    cache->glyphs = new_glyphs;
+    cache->glyph_capacity = new_capacity;
+    return true;
+}
+
+// Function to look up a glyph by its packed glyph map entry, rasterizing and storing it on
+// first use. Returns NULL only if memory runs out.
+const CachedGlyph *glyph_cache_get(GlyphCache *cache, uint32_t mapped) {
+    int glyph_index = glyph_map_glyph(mapped);
+    unsigned int slot = glyph_hash(glyph_index, cache->glyph_capacity);
+    while (cache->glyphs[slot].used) {
+        if (cache->glyphs[slot].glyph_index == glyph_index) {
+            cache->hits++;
+            return &cache->glyphs[slot];
+        }
+        slot = (slot + 1) & (cache->glyph_capacity - 1);
+    }
+
+    // Miss: keep the load factor under 1/2 before inserting
+    cache->misses++;
+    if ((cache->glyph_count + 1) * 2 > cache->glyph_capacity) {
+        if (!glyph_cache_grow(cache)) return NULL;
+        slot = glyph_hash(glyph_index, cache->glyph_capacity);
+        while (cache->glyphs[slot].used) {
+            slot = (slot + 1) & (cache->glyph_capacity - 1);
+        }
+    }
+
+    CachedGlyph glyph = {0};
+    glyph.glyph_index = glyph_index;
+    glyph.used = true;
+
+    // Fallback glyphs are rasterized from their own font, at that font's scale for this size
+    const stbtt_fontinfo *font = cache->font;
+    int font_glyph = glyph_index;
+    float scale = cache->scale;
+    FallbackGlyph fallback;
+    bool is_fallback = glyph_index >= cache->map->glyph_count;
+    if (is_fallback && glyph_map_fallback_glyph(cache->map, glyph_index, &fallback)) {
+        font = fallback.font;
+        font_glyph = fallback.glyph_index;
+        scale *= fallback.scale_ratio;
+    }
+
+    if (is_fallback || !cache->file || !glyph_file_find(cache->file, glyph_index, &glyph)) {
+        uint8_t *char_bitmap = cache->sdf && !is_fallback
+                                   ? sdf_glyph_bitmap(cache->sdf, glyph_index, cache->scale,
+                                                      &glyph.width, &glyph.height, &glyph.x_offset, &glyph.y_offset)
+                                   : stbtt_GetGlyphBitmap(font, 0, scale, font_glyph,
+                                                          &glyph.width, &glyph.height, &glyph.x_offset, &glyph.y_offset);
+        if (char_bitmap) {
+            glyph.bitmap = glyph_atlas_store(cache, char_bitmap, (size_t)glyph.width * glyph.height);
+            scratch_free(char_bitmap); // Both kinds of bitmap come from the scratch arena
+            if (!glyph.bitmap) return NULL;
+        } else {
+            glyph.width = glyph.height = 0;
+        }
+        if (!is_fallback && cache->file) {
+            glyph_file_add(cache->file, &glyph);
+        }
+    }
+
+    glyph.advance = (int)(glyph_map_advance(mapped) * cache->scale);
+
+    cache->glyphs[slot] = glyph;
+    cache->glyph_count++;
+    return &cache->glyphs[slot];
+}
+
+// Draw one mapped glyph at the pen position and return the advanced pen position
+static inline int draw_glyph(Canvas *canvas, int x_cursor, int start_y, uint32_t mapped,
+                             GlyphCache *cache, uint8_t r, uint8_t g, uint8_t b) {
+    const CachedGlyph *glyph = glyph_cache_get(cache, mapped);
+    if (!glyph) {
+        return x_cursor;
+    }
+
+    if (glyph->bitmap) {
+        int draw_x = x_cursor + glyph->x_offset;
+        int draw_y = start_y + cache->baseline + glyph->y_offset;
+
+        draw_char_bitmap(canvas,
+                         glyph->bitmap, glyph->width, glyph->height,
+                         draw_x, draw_y, r, g, b);
+    }
+    return x_cursor + glyph->advance;
+}
+
+// Function to move a pen position to the next tab stop of a line starting at line_x
+static inline int64_t tab_stop(const GlyphCache *cache, int64_t x, int64_t line_x) {
+    return line_x + ((x - line_x) / cache->tab_width + 1) * cache->tab_width;
+}
+
+// Function to draw length bytes of UTF-8 text onto a canvas band and return the end x-position.
+// Tabs advance to the next stop of the line that starts at line_x.
+int draw_text(Canvas *canvas,
+               int start_x, int line_x, int start_y, const char* text, size_t length,
+               GlyphCache* cache, uint8_t r, uint8_t g, uint8_t b) {
+
+    int x_cursor = start_x;
+    const uint32_t *ascii = cache->map->ascii;
+
+    size_t i = 0;
+    while (i < length) {
+        // Runs of 7-bit text skip decoding and go straight to the ASCII table
+        size_t run_end = i + utf8_ascii_prefix(text + i, length - i);
+        for (; i < run_end; ++i) {
+            uint8_t c = (uint8_t)text[i];
+            if (c == '\t') {
+                x_cursor = (int)tab_stop(cache, x_cursor, line_x);
+                continue;
+            }
+            x_cursor = draw_glyph(canvas, x_cursor, start_y, ascii[c], cache, r, g, b);
+        }
+        if (i < length) {
+            int codepoint = utf8_decode(text, length, &i);
+            x_cursor = draw_glyph(canvas, x_cursor, start_y, glyph_map_lookup(cache->map, codepoint), cache, r, g, b);
+        }
+    }
+    return x_cursor;
+}
+
+// --- Signed Distance Field Glyphs ---
+//
+// With --sdf, each glyph of a font is rasterized once, as a signed distance field at
+// SDF_REFERENCE_PIXELS, and the glyph caches of every size resample their coverage bitmaps
+// from it instead of rasterizing the outline again. Rendering one input at several --scales
+// then rasterizes each glyph once in total. Edges are anti-aliased over one output pixel, close
+// to the rasterizer's exact coverage at code sizes; very thin strokes come out a little lighter.
+
+#define SDF_REFERENCE_PIXELS 64.0f
+#define SDF_PADDING 4                              // Reference pixels of distance around each glyph
+#define SDF_ON_EDGE 128                            // Field value on the outline
+#define SDF_DISTANCE_SCALE (128.0f / SDF_PADDING)  // Field units per reference pixel
+
+typedef struct {
+    int width, height;       // Field size, padding included (0x0 for blank glyphs)
+    int x_offset, y_offset;  // Field offset from the pen position / baseline, in reference pixels
+    uint8_t *field;
+} SdfGlyph;
+
+// Distance fields of one font, built on first use and shared by every thread
+struct SdfAtlas {
+    const stbtt_fontinfo *font;
+    float scale;             // Font units to reference pixels
+    pthread_mutex_t lock;
+    SdfGlyph **glyphs;       // Indexed by glyph index, NULL until built
+    int glyph_count;
+    AtlasPage *pages;
+    size_t atlas_bytes;
+};
+
+static const SdfGlyph sdf_blank_glyph = {0};
+
+void sdf_atlas_init(SdfAtlas *atlas, const stbtt_fontinfo *font) {
+    memset(atlas, 0, sizeof(*atlas));
+    atlas->font = font;
+    atlas->scale = stbtt_ScaleForPixelHeight(font, SDF_REFERENCE_PIXELS);
+    atlas->glyph_count = font->numGlyphs;
+    pthread_mutex_init(&atlas->lock, NULL);
+}
+
+void sdf_atlas_free(SdfAtlas *atlas) {
+    AtlasPage *page = atlas->pages;
+    while (page) {
+        AtlasPage *next = page->next;
+        free(page);
+        page = next;
+    }
+    free(atlas->glyphs);
+    pthread_mutex_destroy(&atlas->lock);
+    memset(atlas, 0, sizeof(*atlas));
+}
+
+// Carve size bytes out of the atlas pages, 8-byte aligned
+static void *sdf_atlas_alloc(SdfAtlas *atlas, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    AtlasPage *page = atlas->pages;
+    if (!page || page->capacity - page->used < size) {
+        size_t capacity = size > GLYPH_ATLAS_PAGE_SIZE ? size : GLYPH_ATLAS_PAGE_SIZE;
+        page = malloc(sizeof(AtlasPage) + capacity);
+        if (!page) return NULL;
+        page->used = 0;
+        page->capacity = capacity;
+        page->next = atlas->pages;
+        atlas->pages = page;
+    }
+    void *p = page->data + page->used;
+    page->used += size;
+    atlas->atlas_bytes += size;
+    return p;
+}
+
+// Function to get the distance field of a glyph, building it on first use. Returns NULL only if
+// memory runs out.
+static const SdfGlyph *sdf_atlas_get(SdfAtlas *atlas, int glyph_index) {
+    if (glyph_index < 0 || glyph_index >= atlas->glyph_count) {
+        return &sdf_blank_glyph;
+    }
+    pthread_mutex_lock(&atlas->lock);
+    if (!atlas->glyphs) {
+        atlas->glyphs = calloc(atlas->glyph_count, sizeof(SdfGlyph *));
+    }
+    SdfGlyph *glyph = atlas->glyphs ? atlas->glyphs[glyph_index] : NULL;
+    if (atlas->glyphs && !glyph) {
+        int width = 0, height = 0, x_offset = 0, y_offset = 0;
+        uint8_t *field = stbtt_GetGlyphSDF(atlas->font, atlas->scale, glyph_index, SDF_PADDING, SDF_ON_EDGE,
+                                           SDF_DISTANCE_SCALE, &width, &height, &x_offset, &y_offset);
+        size_t field_size = field ? (size_t)width * height : 0;
+        glyph = sdf_atlas_alloc(atlas, sizeof(SdfGlyph) + field_size);
+        if (glyph) {
+            *glyph = (SdfGlyph){ .x_offset = x_offset, .y_offset = y_offset };
+            if (field) {
+                glyph->width = width;
+                glyph->height = height;
+                glyph->field = (uint8_t *)(glyph + 1);
+                memcpy(glyph->field, field, field_size);
+            }
+            atlas->glyphs[glyph_index] = glyph;
+        }
+        if (field) stbtt_FreeSDF(field, atlas->font->userdata);
+    }
+    pthread_mutex_unlock(&atlas->lock);
+    return glyph;
+}
+
+static inline float sdf_texel(const SdfGlyph *glyph, int x, int y) {
+    if (x < 0 || y < 0 || x >= glyph->width || y >= glyph->height) return 0.0f; // Far outside
+    return glyph->field[(size_t)y * glyph->width + x];
+}
+
+// Bilinear sample of the field at (u, v), in field pixels from the first texel's center
+static inline float sdf_sample(const SdfGlyph *glyph, float u, float v) {
+    float fu = floorf(u), fv = floorf(v);
+    int x = (int)fu, y = (int)fv;
+    float tx = u - fu, ty = v - fv;
+    float top = sdf_texel(glyph, x, y) + (sdf_texel(glyph, x + 1, y) - sdf_texel(glyph, x, y)) * tx;
+    float bottom = sdf_texel(glyph, x, y + 1) + (sdf_texel(glyph, x + 1, y + 1) - sdf_texel(glyph, x, y + 1)) * tx;
+    return top + (bottom - top) * ty;
+}
+
+// Function to make a glyph's coverage bitmap at a font scale from its distance field. Works like
+// stbtt_GetGlyphBitmap, but the result comes from the scratch arena; NULL for blank glyphs or no memory.
+uint8_t *sdf_glyph_bitmap(SdfAtlas *atlas, int glyph_index, float scale,
+                          int *width, int *height, int *x_offset, int *y_offset) {
+    // The outline's box at this scale, so the bitmap matches the rasterizer's
+    int x0, y0, x1, y1;
+    stbtt_GetGlyphBitmapBox(atlas->font, glyph_index, scale, scale, &x0, &y0, &x1, &y1);
+    *width = x1 - x0;
+    *height = y1 - y0;
+    *x_offset = x0;
+    *y_offset = y0;
+    const SdfGlyph *glyph = *width > 0 && *height > 0 ? sdf_atlas_get(atlas, glyph_index) : NULL;
+    uint8_t *bitmap = glyph && glyph->field ? scratch_alloc((size_t)*width * *height) : NULL;
+    if (!bitmap) {
+        return NULL;
+    }
+
+    float ratio = scale / atlas->scale; // Output pixels per reference pixel
+    for (int y = 0; y < *height; ++y) {
+        float v = (y0 + y + 0.5f) / ratio - glyph->y_offset - 0.5f;
+        for (int x = 0; x < *width; ++x) {
+            float u = (x0 + x + 0.5f) / ratio - glyph->x_offset - 0.5f;
+            // Signed distance to the outline in output pixels, positive inside
+            float distance = (sdf_sample(glyph, u, v) - SDF_ON_EDGE) / SDF_DISTANCE_SCALE * ratio;
+            float coverage = distance + 0.5f;
+            coverage = coverage < 0.0f ? 0.0f : coverage > 1.0f ? 1.0f : coverage;
+            bitmap[(size_t)y * *width + x] = (uint8_t)(coverage * 255.0f + 0.5f);
+        }
+    }
+    return bitmap;
+}
+
+// --- Font Discovery ---
+//
+// Walking Fonts/ and reading every font header is slow for large font trees, so the
+// result is kept in an on-disk index (one per font root, under the user's cache directory).
+// Each directory is stored with its mtime, subdirectories and fonts. A directory whose mtime
+// is unchanged is taken from the index without readdir(); only changed subtrees are rescanned.
+//
+// Index format (text, one record per line, fields separated by tabs):
+//   code-to-image font index 2
+//   root  <absolute font root>
+//   D     <mtime sec> <mtime nsec> <directory path>
+//   S     <subdirectory name>                                  (belongs to the last D)
+//   F     <name> <file name> <ascent> <descent> <line gap> <units per em> <coverage>
+//                                                              (belongs to the last D)
+// where coverage lists the codepoints the font's cmap maps to glyphs, e.g. "20-7e,a0,2500-257f".
+
+#define FONT_INDEX_MAGIC "code-to-image font index 2"
+#define STRING_POOL_CHUNK_SIZE (16 * 1024)
+
+// Chunked string storage: strings never move, and everything is freed at once
+typedef struct StringPoolChunk {
+    struct StringPoolChunk *next;
+    size_t used;
+    size_t capacity;
+    char data[];
+} StringPoolChunk;
+
+static char *string_pool_add(StringPoolChunk **pool, const char *str, size_t len) {
+    StringPoolChunk *chunk = *pool;
+    if (!chunk || chunk->capacity - chunk->used < len + 1) {
+        size_t capacity = len + 1 > STRING_POOL_CHUNK_SIZE ? len + 1 : STRING_POOL_CHUNK_SIZE;
+        chunk = malloc(sizeof(StringPoolChunk) + capacity);
+        if (!chunk) return NULL;
+        chunk->used = 0;
+        chunk->capacity = capacity;
+        chunk->next = *pool;
+        *pool = chunk;
+    }
+    char *dst = chunk->data + chunk->used;
+    memcpy(dst, str, len);
+    dst[len] = '\0';
+    chunk->used += len + 1;
+    return dst;
+}
+
+static void string_pool_free(StringPoolChunk **pool) {
+    while (*pool) {
+        StringPoolChunk *next = (*pool)->next;
+        free(*pool);
+        *pool = next;
+    }
+}
+
+// The fonts found under a font root. Filled by discover_fonts and read-only afterwards, so
+// any number of threads can look fonts up.
+typedef struct {
+    FontInfo *fonts;
+    int count;
+    int capacity;
+    StringPoolChunk *strings;  // Names and paths
+    int *name_table;           // Indices into fonts, keyed by name (-1 marks an empty slot)
+    int name_table_capacity;
+    bool discovered;
+} FontCatalog;
+
+static uint32_t hash_string(const char *str) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (; *str; ++str) {
+        hash = (hash ^ (uint8_t)*str) * 16777619u;
+    }
+    return hash;
+}
+
+// Function to add a font to a catalog
+void add_font(FontCatalog *catalog, const char* name, const char* path, const FontInfo *metrics) {
+    if (catalog->count >= catalog->capacity) {
+        catalog->capacity = (catalog->capacity == 0) ? 4 : catalog->capacity * 2;
+        catalog->fonts = realloc(catalog->fonts, sizeof(FontInfo) * catalog->capacity);
+        if (!catalog->fonts) {
+            fprintf(stderr, "Memory allocation failed for fonts list!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    FontInfo *font = &catalog->fonts[catalog->count];
+    *font = *metrics;
+    font->name = string_pool_add(&catalog->strings, name, strlen(name));
+    font->path = string_pool_add(&catalog->strings, path, strlen(path));
+    if (metrics->coverage) {
+        font->coverage = string_pool_add(&catalog->strings, metrics->coverage, strlen(metrics->coverage));
+    }
+    if (!font->name || !font->path || (metrics->coverage && !font->coverage)) {
+        fprintf(stderr, "Memory allocation failed for font name/path!\n");
+        exit(EXIT_FAILURE);
+    }
+    catalog->count++;
+}
+
+// Function to (re)build the name lookup table after discovery
+static void build_font_name_table(FontCatalog *catalog) {
+    free(catalog->name_table);
+    catalog->name_table_capacity = 16;
+    while (catalog->name_table_capacity < catalog->count * 2) catalog->name_table_capacity *= 2;
+    catalog->name_table = malloc(sizeof(int) * catalog->name_table_capacity);
+    if (!catalog->name_table) {
+        fprintf(stderr, "Memory allocation failed for fonts list!\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(catalog->name_table, 0xff, sizeof(int) * catalog->name_table_capacity);
+
+    int mask = catalog->name_table_capacity - 1;
+    for (int i = 0; i < catalog->count; ++i) {
+        int slot = hash_string(catalog->fonts[i].name) & mask;
+        bool duplicate = false;
+        while (catalog->name_table[slot] >= 0) {
+            if (strcmp(catalog->fonts[catalog->name_table[slot]].name, catalog->fonts[i].name) == 0) {
+                duplicate = true; // The first font discovered under a name wins
+                break;
+            }
+            slot = (slot + 1) & mask;
+        }
+        if (!duplicate) catalog->name_table[slot] = i;
+    }
+}
+
+// Function to find a discovered font by its friendly name (NULL if unknown)
+const FontInfo *find_font(const FontCatalog *catalog, const char *name) {
+    if (!catalog->name_table) return NULL;
+    int mask = catalog->name_table_capacity - 1;
+    for (int slot = hash_string(name) & mask; catalog->name_table[slot] >= 0; slot = (slot + 1) & mask) {
+        const FontInfo *font = &catalog->fonts[catalog->name_table[slot]];
+        if (strcmp(font->name, name) == 0) return font;
+    }
+    return NULL;
+}
+
+static uint16_t read_u16be(const uint8_t *p) { return (uint16_t)(p[0] << 8 | p[1]); }
+static uint32_t read_u32be(const uint8_t *p) { return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3]; }
+
+// Coverage is kept as text, "start-end" or "codepoint" in hex separated by commas, as in the
+// index. Runs of adjacent codepoints are merged before they are written.
+typedef struct {
+    ByteBuffer *out;
+    long start, end; // Pending run, or start < 0
+} CoverageWriter;
+
+static void coverage_flush(CoverageWriter *writer) {
+    if (writer->start < 0) return;
+    char range[32];
+    int length = writer->start == writer->end
+                     ? snprintf(range, sizeof(range), "%s%lx", writer->out->size ? "," : "", writer->start)
+                     : snprintf(range, sizeof(range), "%s%lx-%lx", writer->out->size ? "," : "", writer->start, writer->end);
+    if (!byte_buffer_append(writer->out, range, (size_t)length)) writer->out->failed = true;
+    writer->start = -1;
+}
+
+static void coverage_add(CoverageWriter *writer, long start, long end) {
+    if (writer->start >= 0 && start <= writer->end + 1) {
+        if (end > writer->end) writer->end = end;
+        return;
+    }
+    coverage_flush(writer);
+    writer->start = start;
+    writer->end = end;
+}
+
+// Function to read the codepoints a font has glyphs for from its best Unicode cmap subtable
+// (format 12, else format 4) into out. Returns false if there is none.
+static bool read_font_coverage(FILE *fp, uint32_t cmap, ByteBuffer *out) {
+    uint8_t header[4];
+    if (fseek(fp, cmap, SEEK_SET) != 0 || fread(header, 1, sizeof(header), fp) != sizeof(header)) return false;
+    int table_count = read_u16be(header + 2);
+    uint32_t best = 0;
+    int best_rank = 0;
+    for (int i = 0; i < table_count; ++i) {
+        uint8_t record[8];
+        if (fread(record, 1, sizeof(record), fp) != sizeof(record)) return false;
+        int platform = read_u16be(record), encoding = read_u16be(record + 2);
+        // Full Unicode before BMP-only, Windows before the Unicode platform
+        int rank = platform == 3 && encoding == 10 ? 4 : platform == 0 && encoding >= 4 ? 3
+                 : platform == 3 && encoding == 1  ? 2 : platform == 0 ? 1 : 0;
+        if (rank > best_rank) {
+            best_rank = rank;
+            best = cmap + read_u32be(record + 4);
+        }
+    }
+
+    uint8_t format_header[16];
+    if (!best_rank || fseek(fp, best, SEEK_SET) != 0 || fread(format_header, 1, 16, fp) != 16) return false;
+    int format = read_u16be(format_header);
+    uint32_t groups = read_u32be(format_header + 12);
+    if (format == 12 && groups > ((64u << 20) - 16) / 12) return false;
+    uint64_t length = format == 12 ? 16 + 12 * (uint64_t)groups : read_u16be(format_header + 2);
+    if ((format != 4 && format != 12) || length < 16 || length > (64u << 20)) return false;
+    uint8_t *table = malloc(length);
+    bool ok = table && fseek(fp, best, SEEK_SET) == 0 && fread(table, 1, length, fp) == length;
+
+    CoverageWriter writer = { .out = out, .start = -1 };
+    if (ok && format == 12) {
+        for (uint64_t g = 0; g < (length - 16) / 12; ++g) {
+            const uint8_t *group = table + 16 + 12 * g;
+            long start = read_u32be(group), end = read_u32be(group + 4);
+            if (read_u32be(group + 8) == 0) start++; // The first codepoint maps to the missing glyph
+            if (start <= end && end <= 0x10FFFF) coverage_add(&writer, start, end);
+        }
+    } else if (ok) {
+        int segments = read_u16be(table + 6) / 2;
+        ok = 16 + (size_t)segments * 8 <= length;
+        const uint8_t *ends = table + 14, *starts = ends + segments * 2 + 2;
+        const uint8_t *deltas = starts + segments * 2, *range_offsets = deltas + segments * 2;
+        for (int s = 0; ok && s < segments; ++s) {
+            int end = read_u16be(ends + s * 2), start = read_u16be(starts + s * 2);
+            int delta = read_u16be(deltas + s * 2), range_offset = read_u16be(range_offsets + s * 2);
+            for (int c = start; c <= end && c < 0xFFFF; ++c) {
+                int glyph = 0;
+                if (range_offset == 0) {
+                    glyph = (c + delta) & 0xffff;
+                } else {
+                    size_t at = (size_t)(range_offsets + s * 2 - table) + range_offset + (size_t)(c - start) * 2;
+                    glyph = at + 2 <= length ? read_u16be(table + at) : 0;
+                    if (glyph) glyph = (glyph + delta) & 0xffff;
+                }
+                if (glyph) coverage_add(&writer, c, c);
+            }
+        }
+    }
+    coverage_flush(&writer);
+    free(table);
+    return ok && !out->failed;
+}
+
+// Codepoints a font covers, as a sorted list of 256-codepoint blocks with one bit per
+// codepoint. Blocks without any covered codepoint are left out.
+typedef struct {
+    uint32_t block;    // Codepoint >> 8
+    uint32_t bits[8];
+} CoverageBlock;
+
+typedef struct {
+    CoverageBlock *blocks;
+    int count;
+    int capacity;
+} FontCoverage;
+
+// Function to build the bitsets from coverage text. Returns false if memory runs out.
+bool font_coverage_parse(FontCoverage *coverage, const char *ranges) {
+    memset(coverage, 0, sizeof(*coverage));
+    while (ranges && *ranges) {
+        char *end;
+        unsigned long first = strtoul(ranges, &end, 16), last = first;
+        if (*end == '-') last = strtoul(end + 1, &end, 16);
+        if (end == ranges || last > 0x10FFFF) break;
+        ranges = *end == ',' ? end + 1 : end;
+        for (unsigned long c = first; c <= last; ++c) {
+            uint32_t block = (uint32_t)(c >> 8);
+            if (coverage->count == 0 || coverage->blocks[coverage->count - 1].block != block) {
+                if (coverage->count == coverage->capacity) {
+                    int capacity = coverage->capacity ? coverage->capacity * 2 : 16;
+                    CoverageBlock *blocks = realloc(coverage->blocks, sizeof(CoverageBlock) * capacity);
+                    if (!blocks) return false;
+                    coverage->blocks = blocks;
+                    coverage->capacity = capacity;
+                }
+                coverage->blocks[coverage->count++] = (CoverageBlock){ .block = block };
+            }
+            coverage->blocks[coverage->count - 1].bits[(c >> 5) & 7] |= 1u << (c & 31);
+        }
+    }
+    return true;
+}
+
+bool font_coverage_has(const FontCoverage *coverage, int codepoint) {
+    uint32_t block = (uint32_t)codepoint >> 8;
+    int low = 0, high = coverage->count - 1;
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        const CoverageBlock *entry = &coverage->blocks[mid];
+        if (entry->block == block) return entry->bits[(codepoint >> 5) & 7] >> (codepoint & 31) & 1;
+        if (entry->block < block) low = mid + 1;
+        else high = mid - 1;
+    }
+    return false;
+}
+
+void font_coverage_free(FontCoverage *coverage) {
+    free(coverage->blocks);
+    memset(coverage, 0, sizeof(*coverage));
+}
+
+// Function to read a font's vertical metrics from its table directory, and its coverage into
+// coverage, without loading the whole file. Returns false if the file is not a usable
+// TrueType/OpenType font.
+bool read_font_metrics(const char *path, FontInfo *metrics, ByteBuffer *coverage) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return false;
+
+    uint8_t header[12];
+    uint32_t font_start = 0;
+    bool ok = fread(header, 1, sizeof(header), fp) == sizeof(header);
+    if (ok && memcmp(header, "ttcf", 4) == 0) { // Collection: use the first font, like stbtt_InitFont(..., 0)
+        uint8_t offset[4];
+        ok = fread(offset, 1, 4, fp) == 4;
+        font_start = ok ? read_u32be(offset) : 0;
+        ok = ok && fseek(fp, font_start, SEEK_SET) == 0 && fread(header, 1, sizeof(header), fp) == sizeof(header);
+    }
+
+    uint32_t hhea = 0, head = 0, cmap = 0;
+    int table_count = ok ? read_u16be(header + 4) : 0;
+    for (int i = 0; ok && i < table_count; ++i) {
+        uint8_t record[16];
+        if (fread(record, 1, sizeof(record), fp) != sizeof(record)) {
+            ok = false;
+            break;
+        }
+        if (memcmp(record, "hhea", 4) == 0) hhea = read_u32be(record + 8);
+        if (memcmp(record, "head", 4) == 0) head = read_u32be(record + 8);
+        if (memcmp(record, "cmap", 4) == 0) cmap = read_u32be(record + 8);
+    }
+
+    uint8_t hhea_data[10], head_data[20];
+    ok = ok && hhea && head
+        && fseek(fp, hhea, SEEK_SET) == 0 && fread(hhea_data, 1, sizeof(hhea_data), fp) == sizeof(hhea_data)
+        && fseek(fp, head, SEEK_SET) == 0 && fread(head_data, 1, sizeof(head_data), fp) == sizeof(head_data);
+    if (ok && !(cmap && read_font_coverage(fp, cmap, coverage))) {
+        coverage->size = 0; // Unknown coverage: never used as a fallback
+        coverage->failed = false;
+    }
+    fclose(fp);
+    if (!ok) return false;
+
+    metrics->ascent = (int16_t)read_u16be(hhea_data + 4);
+    metrics->descent = (int16_t)read_u16be(hhea_data + 6);
+    metrics->line_gap = (int16_t)read_u16be(hhea_data + 8);
+    metrics->units_per_em = read_u16be(head_data + 18);
+    return true;
+}
+
+// One directory record loaded from the previous index
+typedef struct {
+    char *path;
+    long long mtime_sec;
+    long mtime_nsec;
+    char *lines;      // The directory's S and F lines, verbatim
+} FontIndexDir;
+
+typedef struct {
+    FontIndexDir *dirs;
+    int dir_count;
+    int dir_capacity;
+    char *text;       // Backing storage for every string above
+    FontCatalog *catalog; // Receives every font found
+    ByteBuffer out;   // The index being written for this run
+    bool changed;     // Whether any directory had to be rescanned
+    int rescanned;
+} FontIndex;
+
+static const FontIndexDir *font_index_find_dir(const FontIndex *index, const char *path) {
+    for (int i = 0; i < index->dir_count; ++i) {
+        if (strcmp(index->dirs[i].path, path) == 0) return &index->dirs[i];
+    }
+    return NULL;
+}
+
+// Function to find (and create) the tool's cache directory: $XDG_CACHE_HOME/code-to-image
+// or ~/.cache/code-to-image. Returns false if there is no home.
+bool cache_directory(char *out, size_t size) {
+    const char *cache_home = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (cache_home && cache_home[0]) {
+        snprintf(out, size, "%s/code-to-image", cache_home);
+    } else if (home && home[0]) {
+        snprintf(out, size, "%s/.cache", home);
+        mkdir(out, 0755);
+        snprintf(out, size, "%s/.cache/code-to-image", home);
+    } else {
+        return false;
+    }
+    mkdir(out, 0755);
+    return true;
+}
+
+// Function to compute the index file path for a font root: one file per absolute root in the
+// cache directory. Returns false if there is no home.
+bool font_index_path(const char *abs_root, char *out, size_t size) {
+    char dir[1024];
+    if (!cache_directory(dir, sizeof(dir))) {
+        return false;
+    }
+    snprintf(out, size, "%s/fonts-%08x.idx", dir, hash_string(abs_root));
+    return true;
+}
+
+// Function to parse an existing index. A missing or mismatching index simply loads nothing.
+static void font_index_load(FontIndex *index, const char *index_path, const char *abs_root) {
+    index->text = load_file(index_path, NULL);
+    if (!index->text) return;
+
+    char *save = NULL;
+    char *line = strtok_r(index->text, "\n", &save);
+    if (!line || strcmp(line, FONT_INDEX_MAGIC) != 0) return;
+    line = strtok_r(NULL, "\n", &save);
+    if (!line || strncmp(line, "root\t", 5) != 0 || strcmp(line + 5, abs_root) != 0) return;
+
+    FontIndexDir *current = NULL;
+    char *lines_start = NULL;
+    while ((line = strtok_r(NULL, "\n", &save)) != NULL) {
+        if (line[0] == 'D' && line[1] == '\t') {
+            if (current && lines_start) current->lines = lines_start;
+            if (index->dir_count >= index->dir_capacity) {
+                int capacity = index->dir_capacity ? index->dir_capacity * 2 : 16;
+                FontIndexDir *dirs = realloc(index->dirs, sizeof(FontIndexDir) * capacity);
+                if (!dirs) return;
+                index->dirs = dirs;
+                index->dir_capacity = capacity;
+            }
+            current = &index->dirs[index->dir_count];
+            memset(current, 0, sizeof(*current));
+            char *fields = line + 2;
+            char *path = NULL;
+            current->mtime_sec = strtoll(fields, &fields, 10);
+            current->mtime_nsec = strtol(fields, &path, 10);
+            if (*path != '\t') return;
+            current->path = path + 1;
+            current->lines = "";
+            lines_start = NULL;
+            index->dir_count++;
+        } else if (current && (line[0] == 'S' || line[0] == 'F') && line[1] == '\t') {
+            // Re-join this directory's record lines (strtok_r replaced the '\n' with '\0')
+            if (!lines_start) {
+                lines_start = line;
+            } else {
+                line[-1] = '\n';
+            }
+            current->lines = lines_start;
+        }
+    }
+}
+
+static void record_append(ByteBuffer *record, const char *format, ...) __attribute__((format(printf, 2, 3)));
+static void record_append(ByteBuffer *record, const char *format, ...) {
+    char line[2048];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (len > 0 && !byte_buffer_append(record, line, len < (int)sizeof(line) ? (size_t)len : sizeof(line) - 1)) {
+        record->failed = true;
+    }
+}
+
+static void scan_font_dir(FontIndex *index, const char *dir_path);
+
+// Function to replay an unchanged directory from the index: fonts are added without touching
+// the font files, and recorded subdirectories are visited (and stat'ed) in turn.
+static void replay_font_dir(FontIndex *index, const FontIndexDir *record, ByteBuffer *out) {
+    char *lines = strdup(record->lines);
+    if (!lines) return;
+    char *save = NULL;
+    for (char *line = strtok_r(lines, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        char path[1024];
+        if (line[0] == 'S') {
+            record_append(out, "%s\n", line);
+            snprintf(path, sizeof(path), "%s/%s", record->path, line + 2);
+            scan_font_dir(index, path);
+        } else {
+            FontInfo metrics = {0};
+            char name[256], file[256];
+            int coverage_at = 0;
+            if (sscanf(line + 2, "%255[^\t]\t%255[^\t]\t%d\t%d\t%d\t%d\t%n", name, file, &metrics.ascent,
+                       &metrics.descent, &metrics.line_gap, &metrics.units_per_em, &coverage_at) != 6) {
+                continue;
+            }
+            metrics.coverage = coverage_at ? line + 2 + coverage_at : "";
+            if (!byte_buffer_append(out, line, strlen(line)) || !byte_buffer_append(out, "\n", 1)) {
+                out->failed = true; // Lines with long coverage do not fit record_append
+            }
+            snprintf(path, sizeof(path), "%s/%s", record->path, file);
+            add_font(index->catalog, name, path, &metrics);
+        }
+    }
+    free(lines);
+}
+
+// Function to read a directory from disk, recording its subdirectories and fonts.
+// Entries are recorded in readdir order so a replay adds fonts in the same order.
+static void read_font_dir(FontIndex *index, const char *dir_path, ByteBuffer *out) {
+    DIR *dir = opendir(dir_path);
+    if (!dir) {
+        return;
+    }
+    index->changed = true;
+    index->rescanned++;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN) { // Some filesystems don't fill d_type
+            struct stat st;
+            if (stat(path, &st) != 0) continue;
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+
+        if (type == DT_DIR) { // If it's a directory, recurse
+            record_append(out, "S\t%s\n", entry->d_name);
+            scan_font_dir(index, path);
+        } else if (type == DT_REG) { // If it's a regular file
+            const char* ext = strrchr(entry->d_name, '.');
+            if (ext && strcmp(ext, ".ttf") == 0) {
+                // Extract a friendly name from the filename (e.g., "FiraCode-Regular")
+                char font_name[256];
+                size_t name_len = (size_t)(ext - entry->d_name);
+                if (name_len >= sizeof(font_name)) name_len = sizeof(font_name) - 1;
+                memcpy(font_name, entry->d_name, name_len);
+                font_name[name_len] = '\0';
+
+                FontInfo metrics = {0};
+                ByteBuffer coverage = {0};
+                if (!read_font_metrics(path, &metrics, &coverage) || !byte_buffer_append(&coverage, "", 1)) {
+                    byte_buffer_free(&coverage);
+                    continue; // Not a readable font; leave it out of the list
+                }
+                metrics.coverage = (const char *)coverage.data;
+                record_append(out, "F\t%s\t%s\t%d\t%d\t%d\t%d\t", font_name, entry->d_name,
+                                  metrics.ascent, metrics.descent, metrics.line_gap, metrics.units_per_em);
+                if (!byte_buffer_append(out, metrics.coverage, coverage.size - 1) || !byte_buffer_append(out, "\n", 1)) {
+                    out->failed = true;
+                }
+                add_font(index->catalog, font_name, path, &metrics);
+                byte_buffer_free(&coverage);
+            }
+        }
+    }
+    closedir(dir);
+}
+
+// Recursive function to collect .ttf font files, reusing the index for unchanged directories.
+// A directory's record is appended after its subdirectories' records, so every record
+// stays contiguous in the index file.
+static void scan_font_dir(FontIndex *index, const char *dir_path) {
+    struct stat st;
+    if (stat(dir_path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        return;
+    }
+    ByteBuffer record = {0};
+    record_append(&record, "D\t%lld\t%ld\t%s\n", (long long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec, dir_path);
+
+    const FontIndexDir *old = font_index_find_dir(index, dir_path);
+    if (old && old->mtime_sec == st.st_mtim.tv_sec && old->mtime_nsec == st.st_mtim.tv_nsec) {
+        replay_font_dir(index, old, &record);
+    } else {
+        read_font_dir(index, dir_path, &record);
+    }
+
+    if (record.failed || !byte_buffer_append(&index->out, record.data, record.size)) {
+        index->out.failed = true;
+    }
+    byte_buffer_free(&record);
+}
+
+// Function to discover the fonts under root, using and refreshing the persistent index.
+// With rescan set the old index is ignored and every directory is read again.
+void discover_fonts(FontCatalog *catalog, const char *root, bool rescan) {
+    if (catalog->discovered) return;
+    catalog->discovered = true;
+
+    char abs_root[PATH_MAX];
+    char index_path[PATH_MAX + 64];
+    bool use_index = realpath(root, abs_root) != NULL && font_index_path(abs_root, index_path, sizeof(index_path));
+
+    FontIndex index = { .catalog = catalog };
+    if (use_index && !rescan) {
+        font_index_load(&index, index_path, abs_root);
+    }
+    record_append(&index.out, "%s\nroot\t%s\n", FONT_INDEX_MAGIC, use_index ? abs_root : root);
+    scan_font_dir(&index, root);
+
+    // Write the refreshed index atomically so concurrent runs never see a partial file
+    if (use_index && (index.changed || index.dir_count == 0) && !index.out.failed) {
+        char tmp_path[PATH_MAX + 96];
+        snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", index_path, (long)getpid());
+        FILE *fp = fopen(tmp_path, "wb");
+        if (fp) {
+            bool ok = fwrite(index.out.data, 1, index.out.size, fp) == index.out.size;
+            ok = (fclose(fp) == 0) && ok;
+            if (!ok || rename(tmp_path, index_path) != 0) unlink(tmp_path);
+        }
+    }
+    log_message(LOG_DEBUG, "Font discovery: %d fonts, %d directories rescanned",
+                catalog->count, index.rescanned);
+
+    free(index.dirs);
+    free(index.text);
+    byte_buffer_free(&index.out);
+    build_font_name_table(catalog);
+}
+
+// Function to free all discovered font info, leaving an empty catalog
+void free_discovered_fonts(FontCatalog *catalog) {
+    string_pool_free(&catalog->strings);
+    free(catalog->fonts);
+    free(catalog->name_table);
+    memset(catalog, 0, sizeof(*catalog));
+}
+
+// --- Text Layout ---
+
+// Where every line of the input starts and how wide the widest one is, built in one pass
+// and shared by measuring and drawing
+typedef struct {
+    uint32_t *starts;   // line_count + 1 offsets; line i is [starts[i], starts[i + 1] - 1)
+    int line_count;
+    int max_width;      // Widest line in pixels, tabs expanded
+} LineIndex;
+
+// Function to measure one line in pixels exactly as draw_text will advance across it
+static int64_t measure_line(const GlyphCache *cache, const char *text, size_t length) {
+    int64_t x = 0;
+    size_t i = 0;
+    while (i < length) {
+        size_t run_end = i + utf8_ascii_prefix(text + i, length - i);
+        if (cache->mono_advance > 0) {
+            // Monospace grid: ASCII between tabs is just a column count
+            while (i < run_end) {
+                const char *tab = memchr(text + i, '\t', run_end - i);
+                size_t stop = tab ? (size_t)(tab - text) : run_end;
+                x += (int64_t)(stop - i) * cache->mono_advance;
+                i = stop;
+                if (tab) {
+                    x = tab_stop(cache, x, 0);
+                    i++;
+                }
+            }
+        } else {
+            for (; i < run_end; ++i) {
+                uint8_t c = (uint8_t)text[i];
+                x = c == '\t' ? tab_stop(cache, x, 0) : x + cache->ascii_advance[c];
+            }
+        }
+        if (i < length) {
+            int codepoint = utf8_decode(text, length, &i);
+            x += (int)(glyph_map_advance(glyph_map_lookup(cache->map, codepoint)) * cache->scale);
+        }
+    }
+    return x;
+}
+
+// Function to index the lines of code and measure the widest one. Returns false when out of
+// memory or when the input is 4 GB or larger.
+bool build_line_index(const char *code, size_t size, const GlyphCache *cache, LineIndex *out) {
+    memset(out, 0, sizeof(*out));
+    if (size >= UINT32_MAX) {
+        return false;
+    }
+    size_t capacity = 1024;
+    out->starts = malloc(capacity * sizeof(uint32_t));
+    if (!out->starts) return false;
+
+    int64_t max_width = 0;
+    size_t start = 0;
+    for (;;) {
+        if ((size_t)out->line_count + 2 > capacity) {
+            capacity *= 2;
+            uint32_t *starts = realloc(out->starts, capacity * sizeof(uint32_t));
+            if (!starts) {
+                free(out->starts);
+                out->starts = NULL;
+                return false;
+            }
+            out->starts = starts;
+        }
+        out->starts[out->line_count++] = (uint32_t)start;
+
+        const char *newline = memchr(code + start, '\n', size - start);
+        size_t end = newline ? (size_t)(newline - code) : size;
+        int64_t width = measure_line(cache, code + start, end - start);
+        if (width > max_width) max_width = width;
+        if (!newline) break;
+        start = end + 1;
+    }
+    out->starts[out->line_count] = (uint32_t)(size + 1); // As if the last line ended in a newline
+    out->max_width = max_width > INT_MAX ? INT_MAX : (int)max_width;
+    return true;
+}
+
+void line_index_free(LineIndex *lines) {
+    free(lines->starts);
+    memset(lines, 0, sizeof(*lines));
+}
+
+// Function to calculate the required image dimensions from the measured lines and the font
+void get_code_dimensions(const LineIndex *lines, const GlyphCache *cache, float line_spacing_multiplier, int padding, int* out_max_width, int* out_total_height) {
+    int ascent, descent, lineGap;
+    stbtt_GetFontVMetrics(cache->font, &ascent, &descent, &lineGap);
+    // Use the vertical metrics to get an accurate line height
+    float font_line_height_base = (ascent - descent + lineGap) * cache->scale;
+    float font_pixel_height = cache->pixel_height;
+
+    *out_max_width = lines->max_width > INT_MAX / 2 ? INT_MAX / 2 : lines->max_width;
+    *out_max_width += 2 * padding; // Add horizontal padding for code block
+
+    double total_height = lines->line_count * font_line_height_base * line_spacing_multiplier + 0.5;
+    *out_total_height = total_height > INT_MAX / 2 ? INT_MAX / 2 : (int)total_height; // Round up
+    *out_total_height += 2 * padding; // Add vertical padding for code block
+
+    // Ensure minimum dimensions (these should be generous enough for a small snippet)
+    if (*out_max_width < (int)(font_pixel_height * 10)) *out_max_width = (int)(font_pixel_height * 10); // Minimum 10 chars wide
+    if (*out_total_height < (int)(font_pixel_height * 3)) *out_total_height = (int)(font_pixel_height * 3); // Minimum 3 lines tall
+
+    log_message(LOG_DEBUG, "Lines: %d, Widest line: %d pixels%s", lines->line_count, lines->max_width, cache->mono_advance ? " (monospace)" : "");
+    log_message(LOG_DEBUG, "Calculated Image Dimensions (before user override): %dx%d", *out_max_width, *out_total_height);
+}
+
+
+// --- Deflate ---
+//
+// A small zlib-compatible compressor for PNG image data: LZ77 over a 32 KB window with hash
+// chains, then each block is sent with dynamic Huffman codes, fixed codes or stored raw,
+// whichever is smallest. Chunks are compressed independently and end with a sync flush (an
+// empty stored block), so their outputs can simply be concatenated into one deflate stream.
+
+#define DEFLATE_WINDOW_SIZE 32768
+#define DEFLATE_WINDOW_MASK (DEFLATE_WINDOW_SIZE - 1)
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_HASH_SIZE (1 << DEFLATE_HASH_BITS)
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_BLOCK_TOKENS (64 * 1024) // Symbols collected before a block is emitted
+#define DEFLATE_LITLEN_CODES 288
+#define DEFLATE_DIST_CODES 30
+#define DEFLATE_MAX_BITS 15
+
+// Search effort per compression level (1..9); level 0 only writes stored blocks
+static const struct {
+    int max_chain;   // Hash chain entries examined per position
+    int nice_length; // Stop searching once a match is this long
+    bool lazy;       // Check whether the next position has a longer match first
+} deflate_levels[10] = {
+    {0, 0, false},
+    {4, 16, false}, {8, 32, false}, {16, 64, false},
+    {16, 64, true}, {32, 128, true}, {128, 128, true},
+    {256, 258, true}, {1024, 258, true}, {4096, 258, true},
+};
+
+static const uint16_t deflate_length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t deflate_length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t deflate_dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t deflate_dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+// Order in which code length code lengths are sent (RFC 1951, 3.2.7)
+static const uint8_t deflate_codelen_order[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+static uint8_t deflate_length_code[DEFLATE_MAX_MATCH + 1]; // Match length -> length code index
+static uint8_t deflate_dist_code[512];                     // See deflate_dist_code_of()
+static uint32_t crc_table[256];
+static pthread_once_t codec_tables_once = PTHREAD_ONCE_INIT;
+
+static void init_codec_tables(void) {
+    for (int code = 0; code < 29; ++code) {
+        for (int len = deflate_length_base[code]; len < deflate_length_base[code] + (1 << deflate_length_extra[code]) && len <= DEFLATE_MAX_MATCH; ++len) {
+            deflate_length_code[len] = (uint8_t)code; // Code 28 overrides 27 for length 258
+        }
+    }
+    for (int code = 0; code < 30; ++code) {
+        for (int dist = deflate_dist_base[code]; dist < deflate_dist_base[code] + (1 << deflate_dist_extra[code]); ++dist) {
+            int d = dist - 1;
+            deflate_dist_code[d < 256 ? d : 256 + (d >> 7)] = (uint8_t)code;
+        }
+    }
+    for (uint32_t n = 0; n < 256; ++n) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; ++k) {
+            c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[n] = c;
+    }
+}
+
+static inline int deflate_dist_code_of(int dist) {
+    int d = dist - 1;
+    return deflate_dist_code[d < 256 ? d : 256 + (d >> 7)];
+}
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t size) {
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i) {
+        crc = crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#define ADLER_MOD 65521
+
+uint32_t adler32_update(uint32_t adler, const uint8_t *data, size_t size) {
+    uint32_t a = adler & 0xffff, b = adler >> 16;
+    while (size > 0) {
+        size_t block = size < 5552 ? size : 5552; // Largest block that cannot overflow 32 bits
+        size -= block;
+        while (block--) {
+            a += *data++;
+            b += a;
+        }
+        a %= ADLER_MOD;
+        b %= ADLER_MOD;
+    }
+    return (b << 16) | a;
+}
+
+// Function to combine the Adler-32 of two adjacent pieces of data (as zlib's adler32_combine)
+uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t len2) {
+    uint32_t rem = (uint32_t)(len2 % ADLER_MOD);
+    uint32_t sum1 = adler1 & 0xffff;
+    uint32_t sum2 = (uint32_t)(((uint64_t)rem * sum1) % ADLER_MOD);
+    sum1 += (adler2 & 0xffff) + ADLER_MOD - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + ADLER_MOD - rem;
+    if (sum1 >= ADLER_MOD) sum1 -= ADLER_MOD;
+    if (sum1 >= ADLER_MOD) sum1 -= ADLER_MOD;
+    if (sum2 >= ((uint32_t)ADLER_MOD << 1)) sum2 -= ((uint32_t)ADLER_MOD << 1);
+    if (sum2 >= ADLER_MOD) sum2 -= ADLER_MOD;
+    return sum1 | (sum2 << 16);
+}
+
+// LSB-first bit writer on top of a ByteBuffer
+typedef struct {
+    ByteBuffer *out;
+    uint64_t bits;
+    int count;
+} BitWriter;
+
+static inline void bits_put(BitWriter *w, uint32_t value, int count) {
+    w->bits |= (uint64_t)value << w->count;
+    w->count += count;
+    if (w->count >= 32) {
+        uint8_t bytes[4] = { (uint8_t)w->bits, (uint8_t)(w->bits >> 8), (uint8_t)(w->bits >> 16), (uint8_t)(w->bits >> 24) };
+        if (!byte_buffer_append(w->out, bytes, 4)) w->out->failed = true;
+        w->bits >>= 32;
+        w->count -= 32;
+    }
+}
+
+// Flush whole bytes, then pad the last partial byte with zero bits
+static void bits_align(BitWriter *w) {
+    while (w->count > 0) {
+        uint8_t byte = (uint8_t)w->bits;
+        if (!byte_buffer_append(w->out, &byte, 1)) w->out->failed = true;
+        w->bits >>= 8;
+        w->count = w->count > 8 ? w->count - 8 : 0;
+    }
+    w->bits = 0;
+}
+
+typedef struct {
+    uint16_t litlen; // Literal byte, or match length when dist != 0
+    uint16_t dist;
+} DeflateToken;
+
+// Per-thread compressor state, reused across chunks
+typedef struct {
+    int32_t head[DEFLATE_HASH_SIZE];
+    int32_t prev[DEFLATE_WINDOW_SIZE];
+    DeflateToken tokens[DEFLATE_BLOCK_TOKENS];
+    int token_count;
+    uint32_t litlen_freq[DEFLATE_LITLEN_CODES];
+    uint32_t dist_freq[DEFLATE_DIST_CODES];
+} DeflateState;
+
+// In-place minimum-redundancy code lengths (Moffat & Katajainen) for frequencies sorted ascending
+static void minimum_redundancy_lengths(int *a, int n) {
+    int root, leaf, next, avail, used, depth;
+    a[0] += a[1];
+    root = 0;
+    leaf = 2;
+    for (next = 1; next < n - 1; next++) {
+        if (leaf >= n || a[root] < a[leaf]) { a[next] = a[root]; a[root++] = next; }
+        else a[next] = a[leaf++];
+        if (leaf >= n || (root < next && a[root] < a[leaf])) { a[next] += a[root]; a[root++] = next; }
+        else a[next] += a[leaf++];
+    }
+    a[n - 2] = 0;
+    for (next = n - 3; next >= 0; next--) a[next] = a[a[next]] + 1;
+    avail = 1;
+    used = depth = 0;
+    root = n - 2;
+    next = n - 1;
+    while (avail > 0) {
+        while (root >= 0 && a[root] == depth) { used++; root--; }
+        while (avail > used) { a[next--] = depth; avail--; }
+        avail = 2 * used;
+        depth++;
+        used = 0;
+    }
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Function to build length-limited Huffman code lengths. Always yields a complete code of
+// at least two symbols, which every inflater accepts.
+static void huffman_lengths(const uint32_t *freq, int symbol_count, int max_bits, uint8_t *lengths) {
+    uint64_t sorted[DEFLATE_LITLEN_CODES];
+    int a[DEFLATE_LITLEN_CODES];
+    int n = 0;
+    memset(lengths, 0, symbol_count);
+    for (int i = 0; i < symbol_count; ++i) {
+        if (freq[i]) sorted[n++] = ((uint64_t)freq[i] << 16) | (uint64_t)i;
+    }
+    if (n < 2) { // Pad to two symbols
+        for (int i = 0; i < symbol_count && n < 2; ++i) {
+            if (!freq[i]) sorted[n++] = (uint64_t)i;
+        }
+    }
+    if (n < 2) return;
+    qsort(sorted, n, sizeof(uint64_t), compare_u64);
+    for (int i = 0; i < n; ++i) a[i] = (int)(sorted[i] >> 16) ? (int)(sorted[i] >> 16) : 1;
+    minimum_redundancy_lengths(a, n);
+
+    // Enforce max_bits by shortening deep codes and rebalancing the Kraft sum
+    int counts[33] = {0};
+    for (int i = 0; i < n; ++i) counts[a[i] < 32 ? a[i] : 32]++;
+    for (int i = max_bits + 1; i <= 32; ++i) {
+        counts[max_bits] += counts[i];
+        counts[i] = 0;
+    }
+    uint32_t total = 0;
+    for (int i = max_bits; i > 0; --i) total += (uint32_t)counts[i] << (max_bits - i);
+    while (total != (1u << max_bits)) {
+        counts[max_bits]--;
+        for (int i = max_bits - 1; i > 0; --i) {
+            if (counts[i]) {
+                counts[i]--;
+                counts[i + 1] += 2;
+                break;
+            }
+        }
+        total--;
+    }
+
+    // Least frequent symbols get the longest codes
+    int index = 0;
+    for (int len = max_bits; len > 0; --len) {
+        for (int k = counts[len]; k > 0; --k) {
+            lengths[sorted[index++] & 0xffff] = (uint8_t)len;
+        }
+    }
+}
+
+// Function to turn code lengths into bit-reversed canonical codes, ready for an LSB-first writer
+static void huffman_codes(const uint8_t *lengths, int symbol_count, uint16_t *codes) {
+    int bl_count[DEFLATE_MAX_BITS + 1] = {0};
+    int next_code[DEFLATE_MAX_BITS + 2] = {0};
+    for (int i = 0; i < symbol_count; ++i) bl_count[lengths[i]]++;
+    bl_count[0] = 0;
+    for (int bits = 1, code = 0; bits <= DEFLATE_MAX_BITS; ++bits) {
+        code = (code + bl_count[bits - 1]) << 1;
+        next_code[bits] = code;
+    }
+    for (int i = 0; i < symbol_count; ++i) {
+        int len = lengths[i];
+        if (!len) {
+            codes[i] = 0;
+            continue;
+        }
+        uint32_t code = (uint32_t)next_code[len]++, reversed = 0;
+        for (int b = 0; b < len; ++b) reversed |= ((code >> b) & 1) << (len - 1 - b);
+        codes[i] = (uint16_t)reversed;
+    }
+}
+
+static void fixed_huffman_lengths(uint8_t *litlen, uint8_t *dist) {
+    for (int i = 0; i < DEFLATE_LITLEN_CODES; ++i) litlen[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+    for (int i = 0; i < DEFLATE_DIST_CODES; ++i) dist[i] = 5;
+}
+
+// Run-length encode the literal/length and distance code lengths with symbols 16/17/18.
+// Each output entry is symbol | (repeat extra value << 8).
+static int rle_code_lengths(const uint8_t *lengths, int count, uint16_t *out, uint32_t *freq) {
+    int n = 0;
+    for (int i = 0; i < count;) {
+        uint8_t len = lengths[i];
+        int run = 1;
+        while (i + run < count && lengths[i + run] == len) run++;
+        if (len == 0 && run >= 3) {
+            int take = run > 138 ? 138 : run;
+            if (take >= 11) { out[n++] = (uint16_t)(18 | ((take - 11) << 8)); freq[18]++; }
+            else { out[n++] = (uint16_t)(17 | ((take - 3) << 8)); freq[17]++; }
+            i += take;
+        } else if (len != 0 && run >= 4) {
+            out[n++] = len; freq[len]++;
+            int take = run - 1 > 6 ? 6 : run - 1;
+            out[n++] = (uint16_t)(16 | ((take - 3) << 8)); freq[16]++;
+            i += 1 + take;
+        } else {
+            out[n++] = len; freq[len]++;
+            i++;
+        }
+    }
+    return n;
+}
+
+// Cost in bits of the block's symbols under the given code lengths (excluding headers)
+static uint64_t block_symbol_bits(const DeflateState *st, const uint8_t *litlen_len, const uint8_t *dist_len) {
+    uint64_t bits = 0;
+    for (int i = 0; i < DEFLATE_LITLEN_CODES; ++i) {
+        bits += (uint64_t)st->litlen_freq[i] * (litlen_len[i] + (i >= 257 && i < 286 ? deflate_length_extra[i - 257] : 0));
+    }
+    for (int i = 0; i < DEFLATE_DIST_CODES; ++i) {
+        bits += (uint64_t)st->dist_freq[i] * (dist_len[i] + deflate_dist_extra[i]);
+    }
+    return bits;
+}
+
+static void write_stored_blocks(BitWriter *w, const uint8_t *data, size_t size) {
+    do {
+        size_t len = size > 65535 ? 65535 : size;
+        bits_put(w, 0, 3); // BFINAL = 0, BTYPE = 00
+        bits_align(w);
+        uint8_t header[4] = { (uint8_t)len, (uint8_t)(len >> 8), (uint8_t)~len, (uint8_t)(~len >> 8) };
+        if (!byte_buffer_append(w->out, header, 4) || !byte_buffer_append(w->out, data, len)) w->out->failed = true;
+        data += len;
+        size -= len;
+    } while (size > 0);
+}
+
+// Function to emit the collected tokens as one block covering data[0..size)
+static void deflate_flush_block(DeflateState *st, BitWriter *w, const uint8_t *data, size_t size) {
+    st->litlen_freq[256]++; // End of block
+
+    uint8_t dyn_litlen[DEFLATE_LITLEN_CODES], dyn_dist[DEFLATE_DIST_CODES];
+    huffman_lengths(st->litlen_freq, 286, DEFLATE_MAX_BITS, dyn_litlen);
+    dyn_litlen[286] = dyn_litlen[287] = 0;
+    huffman_lengths(st->dist_freq, DEFLATE_DIST_CODES, DEFLATE_MAX_BITS, dyn_dist);
+
+    int hlit = 286, hdist = DEFLATE_DIST_CODES;
+    while (hlit > 257 && dyn_litlen[hlit - 1] == 0) hlit--;
+    while (hdist > 1 && dyn_dist[hdist - 1] == 0) hdist--;
+
+    uint8_t all_lengths[286 + DEFLATE_DIST_CODES];
+    memcpy(all_lengths, dyn_litlen, hlit);
+    memcpy(all_lengths + hlit, dyn_dist, hdist);
+    uint16_t rle[286 + DEFLATE_DIST_CODES];
+    uint32_t codelen_freq[19] = {0};
+    int rle_count = rle_code_lengths(all_lengths, hlit + hdist, rle, codelen_freq);
+    uint8_t codelen_len[19];
+    huffman_lengths(codelen_freq, 19, 7, codelen_len);
+    int hclen = 19;
+    while (hclen > 4 && codelen_len[deflate_codelen_order[hclen - 1]] == 0) hclen--;
+
+    uint64_t dynamic_bits = 3 + 14 + 3 * (uint64_t)hclen + block_symbol_bits(st, dyn_litlen, dyn_dist);
+    for (int i = 0; i < rle_count; ++i) {
+        int sym = rle[i] & 0xff;
+        dynamic_bits += codelen_len[sym] + (sym == 16 ? 2 : sym == 17 ? 3 : sym == 18 ? 7 : 0);
+    }
+    uint8_t fix_litlen[DEFLATE_LITLEN_CODES], fix_dist[DEFLATE_DIST_CODES];
+    fixed_huffman_lengths(fix_litlen, fix_dist);
+    uint64_t fixed_bits = 3 + block_symbol_bits(st, fix_litlen, fix_dist);
+    uint64_t stored_bits = (size / 65535 + 1) * 40 + (uint64_t)size * 8 + 7;
+
+    if (stored_bits < dynamic_bits && stored_bits < fixed_bits) {
+        write_stored_blocks(w, data, size);
+    } else {
+        const uint8_t *litlen_len = fix_litlen, *dist_len = fix_dist;
+        if (dynamic_bits < fixed_bits) {
+            litlen_len = dyn_litlen;
+            dist_len = dyn_dist;
+            bits_put(w, 2 << 1, 3); // BFINAL = 0, BTYPE = 10
+            bits_put(w, hlit - 257, 5);
+            bits_put(w, hdist - 1, 5);
+            bits_put(w, hclen - 4, 4);
+            for (int i = 0; i < hclen; ++i) bits_put(w, codelen_len[deflate_codelen_order[i]], 3);
+            uint16_t codelen_codes[19];
+            huffman_codes(codelen_len, 19, codelen_codes);
+            for (int i = 0; i < rle_count; ++i) {
+                int sym = rle[i] & 0xff, extra = rle[i] >> 8;
+                bits_put(w, codelen_codes[sym], codelen_len[sym]);
+                if (sym == 16) bits_put(w, extra, 2);
+                else if (sym == 17) bits_put(w, extra, 3);
+                else if (sym == 18) bits_put(w, extra, 7);
+            }
+        } else {
+            bits_put(w, 1 << 1, 3); // BFINAL = 0, BTYPE = 01
+        }
+
+        uint16_t litlen_codes[DEFLATE_LITLEN_CODES], dist_codes[DEFLATE_DIST_CODES];
+        huffman_codes(litlen_len, DEFLATE_LITLEN_CODES, litlen_codes);
+        huffman_codes(dist_len, DEFLATE_DIST_CODES, dist_codes);
+        for (int i = 0; i < st->token_count; ++i) {
+            DeflateToken t = st->tokens[i];
+            if (t.dist == 0) {
+                bits_put(w, litlen_codes[t.litlen], litlen_len[t.litlen]);
+                continue;
+            }
+            int lcode = deflate_length_code[t.litlen];
+            bits_put(w, litlen_codes[257 + lcode], litlen_len[257 + lcode]);
+            bits_put(w, t.litlen - deflate_length_base[lcode], deflate_length_extra[lcode]);
+            int dcode = deflate_dist_code_of(t.dist);
+            bits_put(w, dist_codes[dcode], dist_len[dcode]);
+            bits_put(w, t.dist - deflate_dist_base[dcode], deflate_dist_extra[dcode]);
+        }
+        bits_put(w, litlen_codes[256], litlen_len[256]);
+    }
+
+    st->token_count = 0;
+    memset(st->litlen_freq, 0, sizeof(st->litlen_freq));
+    memset(st->dist_freq, 0, sizeof(st->dist_freq));
+}
+
+static inline uint32_t deflate_hash(const uint8_t *p) {
+    uint32_t v = (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16;
+    return (v * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+static inline int deflate_match_length(const uint8_t *a, const uint8_t *b, int max) {
+    int n = 0;
+    while (n + 8 <= max) {
+        uint64_t x, y;
+        memcpy(&x, a + n, 8);
+        memcpy(&y, b + n, 8);
+        if (x != y) return n + (__builtin_ctzll(x ^ y) >> 3); // Little-endian byte order
+        n += 8;
+    }
+    while (n < max && a[n] == b[n]) n++;
+    return n;
+}
+
+static inline void deflate_insert(DeflateState *st, const uint8_t *data, int pos) {
+    uint32_t h = deflate_hash(data + pos);
+    st->prev[pos & DEFLATE_WINDOW_MASK] = st->head[h];
+    st->head[h] = pos;
+}
+
+static int deflate_longest_match(const DeflateState *st, const uint8_t *data, int pos, int max_len,
+                                 int max_chain, int nice_length, int *out_dist) {
+    int best = DEFLATE_MIN_MATCH - 1;
+    int limit = pos > DEFLATE_WINDOW_SIZE ? pos - DEFLATE_WINDOW_SIZE : 0;
+    int candidate = st->head[deflate_hash(data + pos)];
+    while (candidate >= limit && max_chain-- > 0) {
+        if (data[candidate + best] == data[pos + best]) {
+            int len = deflate_match_length(data + candidate, data + pos, max_len);
+            if (len > best) {
+                best = len;
+                *out_dist = pos - candidate;
+                if (len >= nice_length || len == max_len) break; // data[pos + max_len] may be past the end
+            }
+        }
+        int next = st->prev[candidate & DEFLATE_WINDOW_MASK];
+        if (next >= candidate) break; // Slot was reused by a newer position
+        candidate = next;
+    }
+    return best >= DEFLATE_MIN_MATCH ? best : 0;
+}
+
+static inline void deflate_literal(DeflateState *st, uint8_t byte) {
+    st->tokens[st->token_count++] = (DeflateToken){ byte, 0 };
+    st->litlen_freq[byte]++;
+}
+
+static inline void deflate_match(DeflateState *st, int len, int dist) {
+    st->tokens[st->token_count++] = (DeflateToken){ (uint16_t)len, (uint16_t)dist };
+    st->litlen_freq[257 + deflate_length_code[len]]++;
+    st->dist_freq[deflate_dist_code_of(dist)]++;
+}
+
+// Function to compress data as non-final deflate blocks followed by a sync flush, so the output
+// can be followed by more blocks. Appends to out; returns false if memory ran out.
+bool deflate_chunk(DeflateState *st, const uint8_t *data, size_t size, int level, ByteBuffer *out) {
+    pthread_once(&codec_tables_once, init_codec_tables);
+    BitWriter w = { .out = out };
+    if (level <= 0 || size == 0) {
+        if (size > 0) write_stored_blocks(&w, data, size);
+        return !out->failed;
+    }
+    if (level > 9) level = 9;
+    int max_chain = deflate_levels[level].max_chain;
+    int nice_length = deflate_levels[level].nice_length;
+    bool lazy = deflate_levels[level].lazy;
+
+    memset(st->head, 0xff, sizeof(st->head));
+    st->token_count = 0;
+    memset(st->litlen_freq, 0, sizeof(st->litlen_freq));
+    memset(st->dist_freq, 0, sizeof(st->dist_freq));
+
+    int n = (int)size;
+    int pos = 0, block_start = 0;
+    bool have_prev = false;
+    int prev_len = 0, prev_dist = 0;
+    while (pos < n) {
+        // Leave room for a match plus a literal before the block has to be emitted
+        if (st->token_count >= DEFLATE_BLOCK_TOKENS - 2 && !have_prev) {
+            deflate_flush_block(st, &w, data + block_start, pos - block_start);
+            block_start = pos;
+        }
+
+        int len = 0, dist = 0;
+        int max_len = n - pos < DEFLATE_MAX_MATCH ? n - pos : DEFLATE_MAX_MATCH;
+        if (max_len >= DEFLATE_MIN_MATCH) {
+            len = deflate_longest_match(st, data, pos, max_len, have_prev ? max_chain / 2 + 1 : max_chain, nice_length, &dist);
+            deflate_insert(st, data, pos);
+        }
+
+        if (have_prev) {
+            have_prev = false;
+            if (len > prev_len) {
+                deflate_literal(st, data[pos - 1]); // The match one byte later is better
+            } else {
+                deflate_match(st, prev_len, prev_dist);
+                int end = pos - 1 + prev_len;
+                for (int p = pos + 1; p < end && p + DEFLATE_MIN_MATCH <= n; ++p) deflate_insert(st, data, p);
+                pos = end;
+                continue;
+            }
+        }
+
+        if (len > 0) {
+            if (lazy && len < nice_length && pos + 1 < n) {
+                have_prev = true;
+                prev_len = len;
+                prev_dist = dist;
+                pos++;
+                continue;
+            }
+            deflate_match(st, len, dist);
+            for (int p = pos + 1; p < pos + len && p + DEFLATE_MIN_MATCH <= n; ++p) deflate_insert(st, data, p);
+            pos += len;
+        } else {
+            deflate_literal(st, data[pos]);
+            pos++;
+        }
+    }
+    if (have_prev) deflate_match(st, prev_len, prev_dist);
+    if (st->token_count > 0) deflate_flush_block(st, &w, data + block_start, n - block_start);
+
+    // Sync flush: an empty stored block brings the stream back to a byte boundary
+    bits_put(&w, 0, 3);
+    bits_align(&w);
+    static const uint8_t empty_stored[4] = { 0x00, 0x00, 0xff, 0xff };
+    if (!byte_buffer_append(out, empty_stored, 4)) out->failed = true;
+    return !out->failed;
+}
+
+// --- PNG Encoder ---
+//
+// Rows are streamed in with png_encoder_write_rows(). They are grouped into chunks of roughly
+// PNG_CHUNK_TARGET_BYTES, and each chunk is filtered and deflated independently (on a worker
+// pool when threads > 1, the way pigz splits its input). Finished chunks are written as IDAT
+// chunks in order as soon as they are ready, and their Adler-32s are combined for the trailer.
+
+#define PNG_CHUNK_TARGET_BYTES (256 * 1024)
+#define PNG_COLOR_RGB 2
+#define PNG_COLOR_PALETTE 3
+#define PNG_DEFAULT_LEVEL 6
+
+// Destination for encoded bytes
+typedef struct {
+    bool (*write)(void *context, const void *data, size_t size);
+    void *context;
+} ByteSink;
+
+static bool file_sink_write(void *context, const void *data, size_t size) {
+    return fwrite(data, 1, size, (FILE *)context) == size;
+}
+
+static bool buffer_sink_write(void *context, const void *data, size_t size) {
+    return byte_buffer_append((ByteBuffer *)context, data, size);
+}
+
+ByteSink file_sink(FILE *fp) { return (ByteSink){ file_sink_write, fp }; }
+ByteSink buffer_sink(ByteBuffer *buffer) { return (ByteSink){ buffer_sink_write, buffer }; }
+
+typedef struct {
+    int width;
+    int height;
+    int color_type;  // PNG_COLOR_RGB or PNG_COLOR_PALETTE
+    int bit_depth;   // 8 for RGB; 1, 2, 4 or 8 for palette images
+    int level;       // 0 = stored, 1 = fastest ... 9 = smallest
+    int threads;     // Compression threads; 1 compresses on the calling thread
+    const uint8_t *palette; // RGB triples for PNG_COLOR_PALETTE
+    int palette_size;
+} PngOptions;
+
+typedef enum { CHUNK_FREE, CHUNK_QUEUED, CHUNK_DONE } PngChunkState;
+
+typedef struct {
+    int row_count;
+    uint8_t *raw;        // Unfiltered rows
+    uint8_t *prev_row;   // Last unfiltered row of the previous chunk
+    bool has_prev_row;
+    uint8_t *filtered;   // Filter byte + filtered bytes for every row
+    size_t filtered_size;
+    uint32_t adler;      // Adler-32 of the filtered data alone
+    ByteBuffer compressed;
+    PngChunkState state;
+    bool failed;
+} PngChunk;
+
+typedef struct PngEncoder {
+    PngOptions options;
+    ByteSink sink;
+    size_t row_bytes;      // Bytes per unfiltered row
+    int bytes_per_pixel;   // Filter distance (at least 1)
+    int rows_per_chunk;
+    int rows_received;
+    bool failed;
+
+    PngChunk *chunks;      // Ring of chunk slots; sequence s lives in slot s % chunk_count
+    int chunk_count;
+    int next_fill;         // Sequence of the chunk currently being filled
+    int next_write;        // Sequence of the next chunk to write out
+    uint8_t *last_row;     // Last unfiltered row handed to the previous chunk
+    uint8_t *zero_row;     // Stands in for the row above the first one
+    bool has_last_row;
+    uint32_t adler;
+    uint64_t bytes_written;
+
+    DeflateState *inline_state; // Used when compressing on the calling thread
+    uint8_t *inline_scratch;
+    pthread_t *threads;
+    int thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+    int *queue;            // Sequence numbers waiting for a worker (ring buffer)
+    int queue_head;
+    int queue_count;
+    bool stopping;
+} PngEncoder;
+
+static void png_put_u32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24); p[1] = (uint8_t)(v >> 16); p[2] = (uint8_t)(v >> 8); p[3] = (uint8_t)v;
+}
+
+static void png_write(PngEncoder *enc, const void *data, size_t size) {
+    if (enc->failed) return;
+    if (!enc->sink.write(enc->sink.context, data, size)) {
+        enc->failed = true;
+        return;
+    }
+    enc->bytes_written += size;
+}
+
+static void png_write_chunk(PngEncoder *enc, const char *type, const uint8_t *data, size_t size) {
+    uint8_t header[8];
+    png_put_u32(header, (uint32_t)size);
+    memcpy(header + 4, type, 4);
+    uint32_t crc = crc32_update(crc32_update(0, header + 4, 4), data, size);
+    uint8_t trailer[4];
+    png_put_u32(trailer, crc);
+    png_write(enc, header, 8);
+    if (size) png_write(enc, data, size);
+    png_write(enc, trailer, 4);
+}
+
+// Paeth predictor, written without branches (p - a = b - c, p - b = a - c)
+static inline uint8_t paeth(int a, int b, int c) {
+    int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2 * c);
+    int ab = pb < pa ? b : a;
+    return (uint8_t)(pc < (pa < pb ? pa : pb) ? c : ab);
+}
+
+static uint64_t filter_cost(const uint8_t *data, size_t size) {
+    uint64_t cost = 0;
+    for (size_t i = 0; i < size; ++i) cost += (uint64_t)abs((int8_t)data[i]);
+    return cost;
+}
+
+// Function to filter one row, picking the filter with the smallest sum of absolute values
+// (the usual libpng heuristic) when adaptive is set. out receives the filter byte followed by
+// row_bytes bytes; scratch holds 4 rows, prev is a zero row for the first row of the image.
+static void png_filter_row(const uint8_t *row, const uint8_t *prev, size_t row_bytes, int bpp,
+                           bool adaptive, uint8_t *out, uint8_t *scratch) {
+    if (!adaptive) { // Stored output and palette indices: filters don't help
+        out[0] = 0;
+        memcpy(out + 1, row, row_bytes);
+        return;
+    }
+    if (memcmp(row, prev, row_bytes) == 0) { // Repeated row (e.g. background): Up is all zeros
+        out[0] = 2;
+        memset(out + 1, 0, row_bytes);
+        return;
+    }
+    size_t head = (size_t)bpp < row_bytes ? (size_t)bpp : row_bytes;
+    uint8_t *sub = scratch, *up = scratch + row_bytes, *avg = up + row_bytes, *pae = avg + row_bytes;
+    for (size_t i = 0; i < head; ++i) {
+        sub[i] = row[i];
+        up[i] = (uint8_t)(row[i] - prev[i]);
+        avg[i] = (uint8_t)(row[i] - (prev[i] >> 1));
+        pae[i] = (uint8_t)(row[i] - prev[i]);
+    }
+    // Separate loops so the compiler can vectorize the simple predictors
+    for (size_t i = head; i < row_bytes; ++i) sub[i] = (uint8_t)(row[i] - row[i - bpp]);
+    for (size_t i = head; i < row_bytes; ++i) up[i] = (uint8_t)(row[i] - prev[i]);
+    for (size_t i = head; i < row_bytes; ++i) avg[i] = (uint8_t)(row[i] - ((row[i - bpp] + prev[i]) >> 1));
+    for (size_t i = head; i < row_bytes; ++i) pae[i] = (uint8_t)(row[i] - paeth(row[i - bpp], prev[i], prev[i - bpp]));
+
+    const uint8_t *candidates[5] = { row, sub, up, avg, pae };
+    uint64_t best_cost = UINT64_MAX;
+    for (int filter = 0; filter < 5; ++filter) {
+        uint64_t cost = filter_cost(candidates[filter], row_bytes);
+        if (cost < best_cost) {
+            best_cost = cost;
+            out[0] = (uint8_t)filter;
+        }
+    }
+    memcpy(out + 1, candidates[out[0]], row_bytes);
+}
+
+// Function to filter and deflate row_count packed rows into out, prev being the unfiltered row
+// above the first one. filtered receives the filtered rows; scratch holds 4 rows.
+static bool png_deflate_rows(const PngOptions *options, size_t row_bytes, int bytes_per_pixel,
+                             const uint8_t *rows, int row_count, const uint8_t *prev,
+                             uint8_t *filtered, uint8_t *scratch, DeflateState *state,
+                             uint32_t *out_adler, ByteBuffer *out) {
+    size_t stride = row_bytes + 1;
+    bool adaptive = options->level > 0 && options->color_type != PNG_COLOR_PALETTE;
+    for (int r = 0; r < row_count; ++r) {
+        const uint8_t *row = rows + (size_t)r * row_bytes;
+        png_filter_row(row, r > 0 ? row - row_bytes : prev, row_bytes, bytes_per_pixel, adaptive,
+                       filtered + (size_t)r * stride, scratch);
+    }
+    size_t filtered_size = (size_t)row_count * stride;
+    *out_adler = adler32_update(1, filtered, filtered_size);
+    out->size = 0;
+    out->failed = false;
+    return deflate_chunk(state, filtered, filtered_size, options->level, out) && !out->failed;
+}
+
+static void png_compress_chunk(PngEncoder *enc, PngChunk *chunk, DeflateState *state, uint8_t *scratch) {
+    const uint8_t *prev = chunk->has_prev_row ? chunk->prev_row : enc->zero_row;
+    chunk->filtered_size = (size_t)chunk->row_count * (enc->row_bytes + 1);
+    chunk->failed = !png_deflate_rows(&enc->options, enc->row_bytes, enc->bytes_per_pixel,
+                                      chunk->raw, chunk->row_count, prev, chunk->filtered,
+                                      scratch, state, &chunk->adler, &chunk->compressed);
+}
+
+static void *png_worker_main(void *arg) {
+    PngEncoder *enc = arg;
+    DeflateState *state = malloc(sizeof(DeflateState));
+    uint8_t *scratch = malloc(enc->row_bytes * 4);
+
+    pthread_mutex_lock(&enc->lock);
+    for (;;) {
+        while (enc->queue_count == 0 && !enc->stopping) {
+            pthread_cond_wait(&enc->work_ready, &enc->lock);
+        }
+        if (enc->queue_count == 0) break;
+        int sequence = enc->queue[enc->queue_head];
+        enc->queue_head = (enc->queue_head + 1) % enc->chunk_count;
+        enc->queue_count--;
+        pthread_mutex_unlock(&enc->lock);
+
+        PngChunk *chunk = &enc->chunks[sequence % enc->chunk_count];
+        if (state && scratch) {
+            png_compress_chunk(enc, chunk, state, scratch);
+        } else {
+            chunk->failed = true;
+        }
+
+        pthread_mutex_lock(&enc->lock);
+        chunk->state = CHUNK_DONE;
+        pthread_cond_broadcast(&enc->work_done);
+    }
+    pthread_mutex_unlock(&enc->lock);
+
+    free(state);
+    free(scratch);
+    return NULL;
+}
+
+// Function to wait for the next chunk in sequence and write it out as an IDAT chunk
+static void png_write_next_chunk(PngEncoder *enc) {
+    PngChunk *chunk = &enc->chunks[enc->next_write % enc->chunk_count];
+    if (enc->thread_count > 0) {
+        pthread_mutex_lock(&enc->lock);
+        while (chunk->state != CHUNK_DONE) {
+            pthread_cond_wait(&enc->work_done, &enc->lock);
+        }
+        pthread_mutex_unlock(&enc->lock);
+    }
+
+    if (chunk->failed || chunk->compressed.failed) {
+        enc->failed = true;
+    } else {
+        png_write_chunk(enc, "IDAT", chunk->compressed.data, chunk->compressed.size);
+        enc->adler = adler32_combine(enc->adler, chunk->adler, chunk->filtered_size);
+    }
+    chunk->state = CHUNK_FREE;
+    chunk->row_count = 0;
+    enc->next_write++;
+}
+
+// Function to hand the chunk being filled to a worker (or compress it right away)
+static void png_submit_chunk(PngEncoder *enc) {
+    PngChunk *chunk = &enc->chunks[enc->next_fill % enc->chunk_count];
+    chunk->has_prev_row = enc->has_last_row;
+    if (enc->has_last_row) memcpy(chunk->prev_row, enc->last_row, enc->row_bytes);
+    memcpy(enc->last_row, chunk->raw + (size_t)(chunk->row_count - 1) * enc->row_bytes, enc->row_bytes);
+    enc->has_last_row = true;
+
+    if (enc->thread_count == 0) {
+        png_compress_chunk(enc, chunk, enc->inline_state, enc->inline_scratch);
+        chunk->state = CHUNK_DONE;
+        enc->next_fill++;
+        png_write_next_chunk(enc);
+        return;
+    }
+
+    pthread_mutex_lock(&enc->lock);
+    chunk->state = CHUNK_QUEUED;
+    enc->queue[(enc->queue_head + enc->queue_count) % enc->chunk_count] = enc->next_fill;
+    enc->queue_count++;
+    pthread_cond_signal(&enc->work_ready);
+    pthread_mutex_unlock(&enc->lock);
+    enc->next_fill++;
+
+    // Write whatever is already finished, without blocking
+    for (;;) {
+        PngChunk *next = &enc->chunks[enc->next_write % enc->chunk_count];
+        pthread_mutex_lock(&enc->lock);
+        bool ready = enc->next_write < enc->next_fill && next->state == CHUNK_DONE;
+        pthread_mutex_unlock(&enc->lock);
+        if (!ready) break;
+        png_write_next_chunk(enc);
+    }
+}
+
+static void png_encoder_free(PngEncoder *enc) {
+    if (!enc) return;
+    if (enc->threads) {
+        pthread_mutex_lock(&enc->lock);
+        enc->stopping = true;
+        pthread_cond_broadcast(&enc->work_ready);
+        pthread_mutex_unlock(&enc->lock);
+        for (int i = 0; i < enc->thread_count; ++i) pthread_join(enc->threads[i], NULL);
+        free(enc->threads);
+    }
+    pthread_mutex_destroy(&enc->lock);
+    pthread_cond_destroy(&enc->work_ready);
+    pthread_cond_destroy(&enc->work_done);
+    for (int i = 0; enc->chunks && i < enc->chunk_count; ++i) {
+        free(enc->chunks[i].raw);
+        free(enc->chunks[i].prev_row);
+        free(enc->chunks[i].filtered);
+        byte_buffer_free(&enc->chunks[i].compressed);
+    }
+    free(enc->chunks);
+    free(enc->queue);
+    free(enc->last_row);
+    free(enc->zero_row);
+    free(enc->inline_state);
+    free(enc->inline_scratch);
+    free(enc);
+}
+
+// Function to compute the bytes per row, filter distance and rows per chunk of an image
+static void png_row_layout(const PngOptions *options, size_t *row_bytes, int *bytes_per_pixel, int *rows_per_chunk) {
+    int channels = options->color_type == PNG_COLOR_RGB ? 3 : 1;
+    size_t bits_per_row = (size_t)options->width * channels * options->bit_depth;
+    *row_bytes = (bits_per_row + 7) / 8;
+    *bytes_per_pixel = (channels * options->bit_depth + 7) / 8;
+    size_t rows = PNG_CHUNK_TARGET_BYTES / *row_bytes;
+    *rows_per_chunk = rows < 1 ? 1 : rows > (size_t)options->height ? options->height : (int)rows;
+}
+
+// Function to write the signature, IHDR (and PLTE) and the zlib header
+static void png_write_header(PngEncoder *enc) {
+    const PngOptions *options = &enc->options;
+    static const uint8_t signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+    png_write(enc, signature, sizeof(signature));
+    uint8_t ihdr[13];
+    png_put_u32(ihdr, (uint32_t)options->width);
+    png_put_u32(ihdr + 4, (uint32_t)options->height);
+    ihdr[8] = (uint8_t)options->bit_depth;
+    ihdr[9] = (uint8_t)options->color_type;
+    ihdr[10] = 0; // Deflate
+    ihdr[11] = 0; // Adaptive filtering
+    ihdr[12] = 0; // No interlace
+    png_write_chunk(enc, "IHDR", ihdr, sizeof(ihdr));
+    if (options->color_type == PNG_COLOR_PALETTE) {
+        png_write_chunk(enc, "PLTE", options->palette, (size_t)options->palette_size * 3);
+    }
+
+    // zlib header: 32 KB window, FLEVEL hint matching the level
+    int level = options->level;
+    uint8_t zlib_header[2] = { 0x78, level <= 1 ? 0x01 : level <= 5 ? 0x5e : level == 6 ? 0x9c : 0xda };
+    png_write_chunk(enc, "IDAT", zlib_header, 2);
+}
+
+// Function to write the end of the stream: a final empty fixed-Huffman block, the Adler-32 of
+// all filtered data, and IEND
+static void png_write_trailer(PngEncoder *enc) {
+    uint8_t trailer[6] = { 0x03, 0x00 };
+    png_put_u32(trailer + 2, enc->adler);
+    png_write_chunk(enc, "IDAT", trailer, sizeof(trailer));
+    png_write_chunk(enc, "IEND", NULL, 0);
+}
+
+// Function to start a PNG stream: writes the signature and header, and sets up the chunk
+// slots and compression threads. Returns NULL on failure.
+PngEncoder *png_encoder_begin(const PngOptions *options, ByteSink sink) {
+    pthread_once(&codec_tables_once, init_codec_tables);
+    if (options->width <= 0 || options->height <= 0) return NULL;
+    if (options->color_type == PNG_COLOR_PALETTE && (options->palette_size < 1 || options->palette_size > 256)) return NULL;
+
+    PngEncoder *enc = calloc(1, sizeof(PngEncoder));
+    if (!enc) return NULL;
+    enc->options = *options;
+    enc->sink = sink;
+    enc->adler = 1;
+    pthread_mutex_init(&enc->lock, NULL);
+    pthread_cond_init(&enc->work_ready, NULL);
+    pthread_cond_init(&enc->work_done, NULL);
+
+    png_row_layout(options, &enc->row_bytes, &enc->bytes_per_pixel, &enc->rows_per_chunk);
+
+    int threads = options->threads > 1 ? options->threads : 0;
+    enc->chunk_count = threads > 0 ? threads * 2 : 1;
+    enc->chunks = calloc(enc->chunk_count, sizeof(PngChunk));
+    enc->queue = malloc(sizeof(int) * enc->chunk_count);
+    enc->last_row = malloc(enc->row_bytes);
+    enc->zero_row = calloc(1, enc->row_bytes);
+    bool ok = enc->chunks && enc->queue && enc->last_row && enc->zero_row;
+    for (int i = 0; ok && i < enc->chunk_count; ++i) {
+        PngChunk *chunk = &enc->chunks[i];
+        chunk->raw = malloc(enc->row_bytes * enc->rows_per_chunk);
+        chunk->prev_row = malloc(enc->row_bytes);
+        chunk->filtered = malloc((enc->row_bytes + 1) * enc->rows_per_chunk);
+        ok = chunk->raw && chunk->prev_row && chunk->filtered;
+    }
+    if (ok && threads == 0) {
+        enc->inline_state = malloc(sizeof(DeflateState));
+        enc->inline_scratch = malloc(enc->row_bytes * 4);
+        ok = enc->inline_state && enc->inline_scratch;
+    }
+    if (ok && threads > 0) {
+        enc->threads = malloc(sizeof(pthread_t) * threads);
+        ok = enc->threads != NULL;
+        for (; ok && enc->thread_count < threads; ++enc->thread_count) {
+            if (pthread_create(&enc->threads[enc->thread_count], NULL, png_worker_main, enc) != 0) break;
+        }
+        ok = ok && enc->thread_count > 0;
+    }
+    if (!ok) {
+        png_encoder_free(enc);
+        return NULL;
+    }
+
+    png_write_header(enc);
+    return enc;
+}
+
+// Function to append rows (already in the PNG's pixel format) to the stream
+bool png_encoder_write_rows(PngEncoder *enc, const uint8_t *rows, int row_count, size_t stride) {
+    for (int r = 0; r < row_count && !enc->failed; ++r) {
+        if (enc->rows_received >= enc->options.height) {
+            enc->failed = true;
+            break;
+        }
+        // The slot for this sequence must have been written out before it can be refilled
+        while (enc->next_write + enc->chunk_count <= enc->next_fill) {
+            png_write_next_chunk(enc);
+        }
+        PngChunk *chunk = &enc->chunks[enc->next_fill % enc->chunk_count];
+        memcpy(chunk->raw + (size_t)chunk->row_count * enc->row_bytes, rows + (size_t)r * stride, enc->row_bytes);
+        chunk->row_count++;
+        enc->rows_received++;
+        if (chunk->row_count == enc->rows_per_chunk) {
+            png_submit_chunk(enc);
+        }
+    }
+    return !enc->failed;
+}
+
+// Function to finish the stream (remaining chunks, zlib trailer, IEND) and free the encoder.
+// Returns false if anything failed; out_bytes receives the PNG size when not NULL.
+bool png_encoder_finish(PngEncoder *enc, uint64_t *out_bytes) {
+    if (!enc) return false;
+    if (!enc->failed && enc->rows_received != enc->options.height) enc->failed = true;
+
+    PngChunk *partial = &enc->chunks[enc->next_fill % enc->chunk_count];
+    if (!enc->failed && partial->row_count > 0 && partial->state == CHUNK_FREE) {
+        png_submit_chunk(enc);
+    }
+    while (enc->next_write < enc->next_fill) {
+        png_write_next_chunk(enc);
+    }
+
+    png_write_trailer(enc);
+
+    bool ok = !enc->failed;
+    if (out_bytes) *out_bytes = enc->bytes_written;
+    png_encoder_free(enc);
+    return ok;
+}
+
+// --- Incremental PNG ---
+//
+// A PNG kept in memory as the compressed chunks of a whole image buffer, for watch mode. After
+// some rows change, only the chunks holding them are compressed again, plus the next chunk,
+// whose first row is filtered against the last changed row. Chunks are cut exactly as
+// png_encoder_write_rows cuts them, so the file written is byte-for-byte the one the streaming
+// encoder would produce.
+
+typedef struct {
+    ByteBuffer compressed;
+    uint32_t adler;       // Adler-32 of the filtered data alone
+    size_t filtered_size;
+} PngStoredChunk;
+
+typedef struct {
+    PngOptions options;
+    size_t row_bytes;
+    int bytes_per_pixel;
+    int rows_per_chunk;
+    int chunk_count;
+    PngStoredChunk *chunks;
+    uint8_t *zero_row;    // Stands in for the row above the first one
+} PngImage;
+
+// One png_image_update call, shared by the threads compressing its chunks
+typedef struct {
+    PngImage *image;
+    const uint8_t *pixels;
+    int end_chunk;
+    atomic_int next_chunk;
+    atomic_bool failed;
+} PngImageUpdate;
+
+bool png_image_init(PngImage *image, const PngOptions *options) {
+    pthread_once(&codec_tables_once, init_codec_tables);
+    memset(image, 0, sizeof(*image));
+    if (options->width <= 0 || options->height <= 0) return false;
+    image->options = *options;
+    png_row_layout(options, &image->row_bytes, &image->bytes_per_pixel, &image->rows_per_chunk);
+    image->chunk_count = (options->height + image->rows_per_chunk - 1) / image->rows_per_chunk;
+    image->chunks = calloc(image->chunk_count, sizeof(PngStoredChunk));
+    image->zero_row = calloc(1, image->row_bytes);
+    return image->chunks && image->zero_row;
+}
+
+void png_image_free(PngImage *image) {
+    for (int i = 0; image->chunks && i < image->chunk_count; ++i) {
+        byte_buffer_free(&image->chunks[i].compressed);
+    }
+    free(image->chunks);
+    free(image->zero_row);
+    memset(image, 0, sizeof(*image));
+}
+
+static void *png_image_update_main(void *arg) {
+    PngImageUpdate *update = arg;
+    PngImage *image = update->image;
+    DeflateState *state = malloc(sizeof(DeflateState));
+    uint8_t *scratch = malloc(image->row_bytes * 4);
+    uint8_t *filtered = malloc((image->row_bytes + 1) * image->rows_per_chunk);
+    bool ok = state && scratch && filtered;
+    while (ok) {
+        int index = atomic_fetch_add(&update->next_chunk, 1);
+        if (index >= update->end_chunk) break;
+        int first_row = index * image->rows_per_chunk;
+        int rows = image->options.height - first_row < image->rows_per_chunk ? image->options.height - first_row : image->rows_per_chunk;
+        const uint8_t *raw = update->pixels + (size_t)first_row * image->row_bytes;
+        const uint8_t *prev = first_row > 0 ? raw - image->row_bytes : image->zero_row;
+        PngStoredChunk *chunk = &image->chunks[index];
+        chunk->filtered_size = (size_t)rows * (image->row_bytes + 1);
+        ok = png_deflate_rows(&image->options, image->row_bytes, image->bytes_per_pixel, raw, rows, prev,
+                              filtered, scratch, state, &chunk->adler, &chunk->compressed);
+    }
+    if (!ok) atomic_store(&update->failed, true);
+    free(state);
+    free(scratch);
+    free(filtered);
+    return NULL;
+}
+
+// Function to compress again the chunks affected by a change to rows [first_row, end_row) of
+// pixels, the whole image with rows packed row_bytes apart. Returns false on failure.
+bool png_image_update(PngImage *image, const uint8_t *pixels, int first_row, int end_row) {
+    if (first_row < 0) first_row = 0;
+    if (end_row > image->options.height) end_row = image->options.height;
+    if (first_row >= end_row) return true;
+
+    int first_chunk = first_row / image->rows_per_chunk;
+    int end_chunk = (end_row - 1) / image->rows_per_chunk + 1;
+    if (end_chunk < image->chunk_count && end_row % image->rows_per_chunk == 0) {
+        end_chunk++; // The next chunk's first row is filtered against the last changed row
+    }
+
+    PngImageUpdate update = { .image = image, .pixels = pixels, .end_chunk = end_chunk };
+    atomic_init(&update.next_chunk, first_chunk);
+    atomic_init(&update.failed, false);
+
+    int helpers = image->options.threads - 1;
+    if (helpers > end_chunk - first_chunk - 1) helpers = end_chunk - first_chunk - 1;
+    pthread_t *threads = helpers > 0 ? malloc(sizeof(pthread_t) * helpers) : NULL;
+    int started = 0;
+    for (; threads && started < helpers; ++started) {
+        if (pthread_create(&threads[started], NULL, png_image_update_main, &update) != 0) break;
+    }
+    png_image_update_main(&update); // The calling thread compresses chunks too
+    for (int i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    return !atomic_load(&update.failed);
+}
+
+// Function to write the image as a complete PNG file. Returns false if the sink failed;
+// out_bytes receives the PNG size when not NULL.
+bool png_image_write(const PngImage *image, ByteSink sink, uint64_t *out_bytes) {
+    // Only the sink and the counters of an encoder are needed to write chunks
+    PngEncoder writer = { .options = image->options, .sink = sink, .adler = 1 };
+    png_write_header(&writer);
+    for (int i = 0; i < image->chunk_count; ++i) {
+        const PngStoredChunk *chunk = &image->chunks[i];
+        png_write_chunk(&writer, "IDAT", chunk->compressed.data, chunk->compressed.size);
+        writer.adler = adler32_combine(writer.adler, chunk->adler, chunk->filtered_size);
+    }
+    png_write_trailer(&writer);
+    if (out_bytes) *out_bytes = writer.bytes_written;
+    return !writer.failed;
+}
+
+// --- Palette Output ---
+//
+// Images only contain the theme colors plus their antialiasing blends, so they usually fit
+// in a PNG palette. The builder keeps an exact color table until a 257th color shows up and
+// always fills a 5-5-5 histogram; with too many colors the palette is cut from the histogram
+// by median cut instead.
+
+#define PALETTE_MAX_COLORS 256
+#define PALETTE_HASH_SIZE 1024 // Power of two, comfortably above PALETTE_MAX_COLORS + 1
+#define PALETTE_BUCKETS 32768  // 5 bits per channel
+#define PALETTE_EMPTY 0xffffffffu
+
+typedef struct {
+    uint32_t count;
+    uint64_t r, g, b; // Channel sums of the pixels that fell in the bucket
+} PaletteBucket;
+
+typedef struct {
+    uint32_t keys[PALETTE_HASH_SIZE]; // 0xRRGGBB, or PALETTE_EMPTY
+    uint8_t values[PALETTE_HASH_SIZE];
+    int exact_count;                  // PALETTE_MAX_COLORS + 1 once the exact table overflowed
+    uint8_t exact_colors[PALETTE_MAX_COLORS * 3];
+    PaletteBucket *buckets;
+} PaletteBuilder;
+
+typedef struct {
+    uint8_t colors[PALETTE_MAX_COLORS * 3];
+    int count;
+    int bit_depth;
+    bool exact;
+    uint32_t keys[PALETTE_HASH_SIZE]; // Exact palettes: color -> index
+    uint8_t values[PALETTE_HASH_SIZE];
+    uint8_t *bucket_index;            // Quantized palettes: 5-5-5 bucket -> index
+} Palette;
+
+static inline uint32_t palette_hash(uint32_t color) {
+    return (color * 2654435761u) >> 22; // Top 10 bits: PALETTE_HASH_SIZE slots
+}
+
+static inline int palette_bucket_of(uint32_t color) {
+    return (int)(((color >> 9) & 0x7c00) | ((color >> 6) & 0x03e0) | ((color >> 3) & 0x001f));
+}
+
+bool palette_builder_init(PaletteBuilder *builder) {
+    memset(builder->keys, 0xff, sizeof(builder->keys));
+    builder->exact_count = 0;
+    builder->buckets = calloc(PALETTE_BUCKETS, sizeof(PaletteBucket));
+    return builder->buckets != NULL;
+}
+
+void palette_builder_free(PaletteBuilder *builder) {
+    free(builder->buckets);
+    builder->buckets = NULL;
+}
+
+// Function to count the colors of some RGB rows
+void palette_builder_add(PaletteBuilder *builder, const uint8_t *rows, int width, int row_count, size_t stride) {
+    for (int y = 0; y < row_count; ++y) {
+        const uint8_t *p = rows + (size_t)y * stride;
+        int x = 0;
+        while (x < width) {
+            uint32_t color = (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+            int run = 1; // Runs of one color are common (background, code block)
+            while (x + run < width && p[run * 3] == p[0] && p[run * 3 + 1] == p[1] && p[run * 3 + 2] == p[2]) run++;
+
+            PaletteBucket *bucket = &builder->buckets[palette_bucket_of(color)];
+            bucket->count += (uint32_t)run;
+            bucket->r += (uint64_t)p[0] * run;
+            bucket->g += (uint64_t)p[1] * run;
+            bucket->b += (uint64_t)p[2] * run;
+
+            if (builder->exact_count <= PALETTE_MAX_COLORS) {
+                uint32_t slot = palette_hash(color);
+                while (builder->keys[slot] != PALETTE_EMPTY && builder->keys[slot] != color) {
+                    slot = (slot + 1) & (PALETTE_HASH_SIZE - 1);
+                }
+                if (builder->keys[slot] == PALETTE_EMPTY) {
+                    if (builder->exact_count < PALETTE_MAX_COLORS) {
+                        builder->keys[slot] = color;
+                        builder->values[slot] = (uint8_t)builder->exact_count;
+                        memcpy(&builder->exact_colors[builder->exact_count * 3], p, 3);
+                    }
+                    builder->exact_count++;
+                }
+            }
+            p += run * 3;
+            x += run;
+        }
+    }
+}
+
+typedef struct {
+    int start, end;   // Range of the sorted bucket list
+    uint64_t weight;  // Pixels in the box
+    int channel;      // Channel with the widest range (as a bit shift: 0, 5 or 10)
+    uint64_t score;   // Split priority: weight times that range, 0 when it cannot be split
+} PaletteBox;
+
+static void palette_box_measure(PaletteBox *box, const PaletteBucket *buckets, const int *ids) {
+    int lo[3] = {31, 31, 31}, hi[3] = {0, 0, 0};
+    box->weight = 0;
+    for (int i = box->start; i < box->end; ++i) {
+        box->weight += buckets[ids[i]].count;
+        for (int c = 0; c < 3; ++c) {
+            int v = (ids[i] >> (c * 5)) & 31;
+            if (v < lo[c]) lo[c] = v;
+            if (v > hi[c]) hi[c] = v;
+        }
+    }
+    int channel = 0;
+    for (int c = 1; c < 3; ++c) {
+        if (hi[c] - lo[c] > hi[channel] - lo[channel]) channel = c;
+    }
+    box->channel = channel * 5;
+    box->score = box->end - box->start > 1 ? box->weight * (uint64_t)(hi[channel] - lo[channel] + 1) : 0;
+}
+
+// Function to sort bucket ids by one 5-bit channel (stable counting sort)
+static void sort_bucket_ids(int *ids, int count, int shift, int *scratch) {
+    int offsets[33] = {0};
+    for (int i = 0; i < count; ++i) offsets[((ids[i] >> shift) & 31) + 1]++;
+    for (int v = 1; v < 33; ++v) offsets[v] += offsets[v - 1];
+    for (int i = 0; i < count; ++i) scratch[offsets[(ids[i] >> shift) & 31]++] = ids[i];
+    memcpy(ids, scratch, sizeof(int) * count);
+}
+
+// Function to split the histogram into at most PALETTE_MAX_COLORS boxes (median cut)
+static int palette_median_cut(const PaletteBucket *buckets, int *ids, int id_count, PaletteBox *boxes, int *scratch) {
+    boxes[0] = (PaletteBox){ .start = 0, .end = id_count };
+    palette_box_measure(&boxes[0], buckets, ids);
+    int box_count = 1;
+
+    while (box_count < PALETTE_MAX_COLORS) {
+        int pick = 0;
+        for (int i = 1; i < box_count; ++i) {
+            if (boxes[i].score > boxes[pick].score) pick = i;
+        }
+        PaletteBox *box = &boxes[pick];
+        if (box->score == 0) break;
+
+        // Split along the widest channel at the weighted median
+        sort_bucket_ids(ids + box->start, box->end - box->start, box->channel, scratch);
+        uint64_t half = box->weight / 2, running = 0;
+        int split = box->start + 1;
+        for (int i = box->start; i < box->end - 1; ++i) {
+            running += buckets[ids[i]].count;
+            split = i + 1;
+            if (running >= half) break;
+        }
+        boxes[box_count] = (PaletteBox){ .start = split, .end = box->end };
+        box->end = split;
+        palette_box_measure(box, buckets, ids);
+        palette_box_measure(&boxes[box_count], buckets, ids);
+        box_count++;
+    }
+    return box_count;
+}
+
+static int palette_bit_depth(int count) {
+    return count <= 2 ? 1 : count <= 4 ? 2 : count <= 16 ? 4 : 8;
+}
+
+// Function to finish a palette: the exact colors when there are few enough, otherwise a
+// median-cut palette whose entries are the average color of each box
+bool palette_finish(PaletteBuilder *builder, Palette *palette) {
+    memset(palette, 0, sizeof(*palette));
+    if (builder->exact_count <= PALETTE_MAX_COLORS) {
+        palette->exact = true;
+        palette->count = builder->exact_count > 0 ? builder->exact_count : 1;
+        memcpy(palette->colors, builder->exact_colors, (size_t)builder->exact_count * 3);
+        memcpy(palette->keys, builder->keys, sizeof(palette->keys));
+        memcpy(palette->values, builder->values, sizeof(palette->values));
+        palette->bit_depth = palette_bit_depth(palette->count);
+        return true;
+    }
+
+    int *ids = malloc(sizeof(int) * PALETTE_BUCKETS * 2); // Second half is sort scratch
+    PaletteBox *boxes = malloc(sizeof(PaletteBox) * PALETTE_MAX_COLORS);
+    palette->bucket_index = malloc(PALETTE_BUCKETS);
+    if (!ids || !boxes || !palette->bucket_index) {
+        free(ids);
+        free(boxes);
+        free(palette->bucket_index);
+        palette->bucket_index = NULL;
+        return false;
+    }
+    int id_count = 0;
+    for (int i = 0; i < PALETTE_BUCKETS; ++i) {
+        if (builder->buckets[i].count) ids[id_count++] = i;
+    }
+    palette->count = palette_median_cut(builder->buckets, ids, id_count, boxes, ids + PALETTE_BUCKETS);
+    for (int b = 0; b < palette->count; ++b) {
+        uint64_t n = 0, r = 0, g = 0, bl = 0;
+        for (int i = boxes[b].start; i < boxes[b].end; ++i) {
+            const PaletteBucket *bucket = &builder->buckets[ids[i]];
+            n += bucket->count;
+            r += bucket->r;
+            g += bucket->g;
+            bl += bucket->b;
+        }
+        palette->colors[b * 3] = (uint8_t)((r + n / 2) / n);
+        palette->colors[b * 3 + 1] = (uint8_t)((g + n / 2) / n);
+        palette->colors[b * 3 + 2] = (uint8_t)((bl + n / 2) / n);
+    }
+    // Map every bucket to the palette color nearest its average (or its center when unused),
+    // which is closer than the box it was cut into for buckets near a box edge
+    for (int i = 0; i < PALETTE_BUCKETS; ++i) {
+        const PaletteBucket *bucket = &builder->buckets[i];
+        int r = ((i >> 10) & 31) * 8 + 4, g = ((i >> 5) & 31) * 8 + 4, b = (i & 31) * 8 + 4;
+        if (bucket->count) {
+            r = (int)(bucket->r / bucket->count);
+            g = (int)(bucket->g / bucket->count);
+            b = (int)(bucket->b / bucket->count);
+        }
+        int best = 0, best_distance = INT_MAX;
+        for (int k = 0; k < palette->count; ++k) {
+            int dr = r - palette->colors[k * 3], dg = g - palette->colors[k * 3 + 1], db = b - palette->colors[k * 3 + 2];
+            int distance = dr * dr + dg * dg + db * db;
+            if (distance < best_distance) {
+                best_distance = distance;
+                best = k;
+            }
+        }
+        palette->bucket_index[i] = (uint8_t)best;
+    }
+    palette->bit_depth = palette_bit_depth(palette->count);
+    free(ids);
+    free(boxes);
+    return true;
+}
+
+void palette_free(Palette *palette) {
+    free(palette->bucket_index);
+    palette->bucket_index = NULL;
+}
+
+static inline int palette_index_of(const Palette *palette, uint32_t color) {
+    if (!palette->exact) return palette->bucket_index[palette_bucket_of(color)];
+    uint32_t slot = palette_hash(color);
+    while (palette->keys[slot] != color) {
+        if (palette->keys[slot] == PALETTE_EMPTY) return 0; // Not seen while building
+        slot = (slot + 1) & (PALETTE_HASH_SIZE - 1);
+    }
+    return palette->values[slot];
+}
+
+// Function to convert one RGB row into packed palette indices (MSB first, as PNG wants)
+void palette_map_row(const Palette *palette, const uint8_t *rgb, int width, uint8_t *out) {
+    int depth = palette->bit_depth;
+    if (depth < 8) memset(out, 0, ((size_t)width * depth + 7) / 8);
+    uint32_t last_color = PALETTE_EMPTY;
+    int index = 0;
+    for (int x = 0; x < width; ++x, rgb += 3) {
+        uint32_t color = (uint32_t)rgb[0] << 16 | (uint32_t)rgb[1] << 8 | rgb[2];
+        if (color != last_color) {
+            index = palette_index_of(palette, color);
+            last_color = color;
+        }
+        if (depth == 8) {
+            out[x] = (uint8_t)index;
+        } else {
+            int bit = x * depth;
+            out[bit >> 3] |= (uint8_t)(index << (8 - depth - (bit & 7)));
+        }
+    }
+}
+
+// --- Raw and QOI Output ---
+//
+// For piping into another program, decoding a PNG again is wasted work on both sides. Raw
+// output is the RGB rows themselves (PPM adds a one-line header with the size), written band
+// by band straight from the band buffer. QOI (https://qoiformat.org) is lossless like PNG
+// but encodes in a single pass over the pixels, with no state beyond the previous pixel, the
+// current run and a 64-entry table of recent colors, so it also streams band by band.
+
+typedef enum {
+    OUTPUT_AUTO, // From the output path's extension; PNG when it has none of the others
+    OUTPUT_PNG,
+    OUTPUT_PPM,
+    OUTPUT_RAW,
+    OUTPUT_QOI,
+} OutputFormat;
+
+static const char *const output_format_names[] = { "auto", "png", "ppm", "raw", "qoi" };
+
+// Function to name a format in messages
+static inline const char *output_format_label(OutputFormat format) {
+    static const char *const labels[] = { "PNG", "PNG", "PPM", "raw", "QOI" };
+    return labels[format];
+}
+
+// Function to find a format by name ("png", "ppm", "raw" or "qoi"). Returns OUTPUT_AUTO if unknown.
+OutputFormat output_format_from_name(const char *name) {
+    for (int i = OUTPUT_PNG; i <= OUTPUT_QOI; ++i) {
+        if (strcasecmp(name, output_format_names[i]) == 0) return (OutputFormat)i;
+    }
+    if (strcasecmp(name, "pnm") == 0) return OUTPUT_PPM;
+    if (strcasecmp(name, "rgb") == 0) return OUTPUT_RAW;
+    return OUTPUT_AUTO;
+}
+
+// Function to pick the format for an output path by its extension
+OutputFormat output_format_for_path(const char *path) {
+    const char *base = path ? strrchr(path, '/') : NULL;
+    const char *dot = path ? strrchr(base ? base : path, '.') : NULL;
+    OutputFormat format = dot ? output_format_from_name(dot + 1) : OUTPUT_AUTO;
+    return format != OUTPUT_AUTO ? format : OUTPUT_PNG;
+}
+
+// "-" as an output path means standard output
+static inline bool is_stdout_path(const char *path) {
+    return path && strcmp(path, "-") == 0;
+}
+
+// Function to write the header of a binary PPM (P6) image, which the raw rows follow.
+// Returns the header's size, or 0 if it could not be written.
+size_t ppm_write_header(ByteSink sink, int width, int height) {
+    char header[64];
+    int length = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", width, height);
+    return sink.write(sink.context, header, (size_t)length) ? (size_t)length : 0;
+}
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xc0
+#define QOI_OP_RGB 0xfe
+#define QOI_MAX_RUN 62
+#define QOI_HEADER_SIZE 14
+
+typedef struct {
+    ByteSink sink;
+    uint8_t index[64][4];  // RGBA; alpha is always 255 here, so the zeroed entries never match
+    uint8_t prev[3];
+    int run;
+    uint8_t *out;          // Encoded bytes of one band
+    size_t out_capacity;
+    uint64_t bytes_written;
+    bool failed;
+} QoiEncoder;
+
+// Function to start a QOI image of width x height RGB pixels, writing its header to sink
+bool qoi_encoder_begin(QoiEncoder *qoi, int width, int height, ByteSink sink) {
+    *qoi = (QoiEncoder){ .sink = sink };
+    uint8_t header[QOI_HEADER_SIZE] = { 'q', 'o', 'i', 'f' };
+    png_put_u32(header + 4, (uint32_t)width);
+    png_put_u32(header + 8, (uint32_t)height);
+    header[12] = CHANNELS;
+    header[13] = 0; // sRGB
+    qoi->bytes_written = QOI_HEADER_SIZE;
+    qoi->failed = !sink.write(sink.context, header, QOI_HEADER_SIZE);
+    return !qoi->failed;
+}
+
+// Function to encode count packed RGB pixels, continuing the image. Runs carry over calls.
+bool qoi_encoder_write_pixels(QoiEncoder *qoi, const uint8_t *rgb, size_t count) {
+    if (qoi->failed) return false;
+    size_t needed = count * 4 + 1; // QOI_OP_RGB for every pixel, plus a pending run
+    if (needed > qoi->out_capacity) {
+        uint8_t *out = realloc(qoi->out, needed);
+        if (!out) {
+            qoi->failed = true;
+            return false;
+        }
+        qoi->out = out;
+        qoi->out_capacity = needed;
+    }
+    uint8_t *o = qoi->out;
+    uint8_t pr = qoi->prev[0], pg = qoi->prev[1], pb = qoi->prev[2];
+    int run = qoi->run;
+    for (size_t i = 0; i < count; ++i, rgb += 3) {
+        uint8_t r = rgb[0], g = rgb[1], b = rgb[2];
+        if (r == pr && g == pg && b == pb) {
+            if (++run == QOI_MAX_RUN) {
+                *o++ = QOI_OP_RUN | (QOI_MAX_RUN - 1);
+                run = 0;
+            }
+            continue;
+        }
+        if (run > 0) {
+            *o++ = (uint8_t)(QOI_OP_RUN | (run - 1));
+            run = 0;
+        }
+        int slot = (r * 3 + g * 5 + b * 7 + 255 * 11) % 64;
+        uint8_t *entry = qoi->index[slot];
+        if (entry[0] == r && entry[1] == g && entry[2] == b && entry[3] == 255) {
+            *o++ = (uint8_t)(QOI_OP_INDEX | slot);
+        } else {
+            entry[0] = r; entry[1] = g; entry[2] = b; entry[3] = 255;
+            int dr = (int8_t)(r - pr), dg = (int8_t)(g - pg), db = (int8_t)(b - pb);
+            int dr_dg = dr - dg, db_dg = db - dg;
+            if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                *o++ = (uint8_t)(QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+            } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+                *o++ = (uint8_t)(QOI_OP_LUMA | (dg + 32));
+                *o++ = (uint8_t)((dr_dg + 8) << 4 | (db_dg + 8));
+            } else {
+                *o++ = QOI_OP_RGB;
+                *o++ = r;
+                *o++ = g;
+                *o++ = b;
+            }
+        }
+        pr = r; pg = g; pb = b;
+    }
+    qoi->prev[0] = pr; qoi->prev[1] = pg; qoi->prev[2] = pb;
+    qoi->run = run;
+    size_t size = (size_t)(o - qoi->out);
+    qoi->bytes_written += size;
+    qoi->failed = size > 0 && !qoi->sink.write(qoi->sink.context, qoi->out, size);
+    return !qoi->failed;
+}
+
+// Function to end the image (pending run and end marker) and free the encoder. Returns false
+// if anything failed to encode or write.
+bool qoi_encoder_finish(QoiEncoder *qoi, uint64_t *out_bytes) {
+    uint8_t tail[9];
+    size_t size = 0;
+    if (qoi->run > 0) tail[size++] = (uint8_t)(QOI_OP_RUN | (qoi->run - 1));
+    static const uint8_t end_marker[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    memcpy(tail + size, end_marker, sizeof(end_marker));
+    size += sizeof(end_marker);
+    bool ok = !qoi->failed && qoi->sink.write(qoi->sink.context, tail, size);
+    qoi->bytes_written += size;
+    if (out_bytes) *out_bytes = qoi->bytes_written;
+    free(qoi->out);
+    qoi->out = NULL;
+    return ok;
+}
+
+// --- Syntax Highlighting ---
+//
+// One linear pass over the code splits it into token spans. Each language is a LanguageSpec
+// table (comment and string delimiters, keywords); from it a byte class table and a keyword
+// hash are built once, and the scanner is a small state machine driven by those classes.
+// Comments and strings are skipped with a 16-byte SIMD search for the bytes that can end them.
+// State carries across lines, so block comments and multi-line strings come out right.
+
+typedef enum {
+    TOKEN_DEFAULT,
+    TOKEN_COMMENT,
+    TOKEN_KEYWORD,
+    TOKEN_FUNCTION,
+    TOKEN_STRING,
+    TOKEN_LITERAL,
+    TOKEN_KIND_COUNT
+} TokenKind;
+
+// A run of code in one color. It starts at `start` and ends where the next span starts,
+// so spans cover the whole buffer without gaps. The last span is followed by a sentinel
+// starting at UINT32_MAX.
+typedef struct {
+    uint32_t start;
+    uint8_t kind; // TokenKind
+} TokenSpan;
+
+typedef struct {
+    TokenSpan *spans;
+    size_t count;
+    size_t capacity;
+} TokenSpans;
+
+typedef struct {
+    const char *name;
+    const char *extensions;       // Space-separated, without the dot
+    const char *line_comment;     // NULL when the language has none
+    const char *block_open;       // NULL when the language has none
+    const char *block_close;
+    const char *quotes;           // Bytes that open a string
+    const char *multiline_quotes; // Quotes whose strings may span lines
+    bool triple_quotes;           // Python-style """ and ''' strings
+    bool preprocessor;            // '#' directives at the start of a line (C family)
+    bool lifetimes;               // ' only opens a literal when it closes nearby (Rust)
+    const char *keywords;         // Space-separated
+    const char *literals;         // Space-separated words colored as literals
+} LanguageSpec;
+
+#define C_KEYWORDS "auto break case char const continue default do double else enum extern float for goto if " \
+    "inline int long register restrict return short signed sizeof static struct switch typedef union unsigned " \
+    "void volatile while _Bool bool size_t ssize_t int8_t int16_t int32_t int64_t uint8_t uint16_t uint32_t uint64_t"
+
+static const LanguageSpec languages[] = {
+    { "c", "c h", "//", "/*", "*/", "\"'", "", false, true, false,
+      C_KEYWORDS, "NULL true false" },
+    { "cpp", "cpp cc cxx hpp hh hxx", "//", "/*", "*/", "\"'", "", false, true, false,
+      C_KEYWORDS " class namespace template typename public private protected virtual override final new delete "
+      "this using try catch throw operator friend constexpr explicit noexcept mutable decltype static_cast "
+      "dynamic_cast reinterpret_cast const_cast", "nullptr NULL true false" },
+    { "python", "py pyw", "#", NULL, NULL, "\"'", "", true, false, false,
+      "and as assert async await break class continue def del elif else except finally for from global if "
+      "import in is lambda nonlocal not or pass raise return try while with yield self", "True False None" },
+    { "javascript", "js mjs cjs jsx ts tsx", "//", "/*", "*/", "\"'`", "`", false, false, false,
+      "break case catch class const continue debugger default delete do else export extends finally for "
+      "function if import in instanceof let new return super switch this throw try typeof var void while with "
+      "yield async await of static get set interface type enum implements", "true false null undefined NaN Infinity" },
+    { "rust", "rs", "//", "/*", "*/", "\"'", "\"", false, false, true,
+      "as async await break const continue crate dyn else enum extern fn for if impl in let loop match mod move "
+      "mut pub ref return self Self static struct super trait type unsafe use where while i8 i16 i32 i64 i128 "
+      "isize u8 u16 u32 u64 u128 usize f32 f64 bool char str String Vec Option Result Box", "true false None Some Ok Err" },
+    { "go", "go", "//", "/*", "*/", "\"'`", "`", false, false, false,
+      "break case chan const continue default defer else fallthrough for func go goto if import interface map "
+      "package range return select struct switch type var int int8 int16 int32 int64 uint uint8 uint16 uint32 "
+      "uint64 uintptr float32 float64 string bool byte rune error", "true false nil iota" },
+    { "shell", "sh bash zsh", "#", NULL, NULL, "\"'", "\"'", false, false, false,
+      "if then else elif fi case esac for while until do done in function return local export readonly "
+      "shift exit echo source", "true false" },
+    { "text", "txt", NULL, NULL, NULL, "", "", false, false, false, "", "" },
+};
+#define LANGUAGE_COUNT (int)(sizeof(languages) / sizeof(languages[0]))
+
+// Byte classes driving the scanner
+enum {
+    CLASS_OTHER,
+    CLASS_SPACE,
+    CLASS_NEWLINE,
+    CLASS_IDENT,   // Starts or continues an identifier (including UTF-8 bytes)
+    CLASS_DIGIT,
+    CLASS_QUOTE,
+    CLASS_COMMENT, // First byte of a line or block comment delimiter
+    CLASS_HASH     // Preprocessor directive, when it is the first thing on a line
+};
+
+#define KEYWORD_TABLE_SIZE 256 // Power of two, well above the longest keyword list
+
+typedef struct {
+    const char *word; // Points into the LanguageSpec strings
+    uint8_t length;
+    uint8_t kind;
+} KeywordEntry;
+
+typedef struct {
+    const LanguageSpec *spec;
+    uint8_t byte_class[256];
+    bool multiline[256];
+    KeywordEntry keywords[KEYWORD_TABLE_SIZE];
+} Highlighter;
+
+static Highlighter highlighters[LANGUAGE_COUNT];
+static pthread_once_t highlighters_once = PTHREAD_ONCE_INIT;
+
+static inline uint32_t keyword_hash(const char *word, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; ++i) {
+        hash = (hash ^ (uint8_t)word[i]) * 16777619u;
+    }
+    return hash & (KEYWORD_TABLE_SIZE - 1);
+}
+
+static void add_keywords(Highlighter *hl, const char *list, TokenKind kind) {
+    const char *p = list;
+    while (*p) {
+        while (*p == ' ') p++;
+        const char *word = p;
+        while (*p && *p != ' ') p++;
+        size_t length = (size_t)(p - word);
+        if (length == 0) break;
+        uint32_t slot = keyword_hash(word, length);
+        while (hl->keywords[slot].word) {
+            slot = (slot + 1) & (KEYWORD_TABLE_SIZE - 1);
+        }
+        hl->keywords[slot] = (KeywordEntry){ word, (uint8_t)length, (uint8_t)kind };
+    }
+}
+
+static void init_highlighters(void) {
+    for (int l = 0; l < LANGUAGE_COUNT; ++l) {
+        Highlighter *hl = &highlighters[l];
+        const LanguageSpec *spec = &languages[l];
+        memset(hl, 0, sizeof(*hl));
+        hl->spec = spec;
+        for (int c = 0; c < 256; ++c) {
+            if (c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c >= 0x80) hl->byte_class[c] = CLASS_IDENT;
+            else if (c >= '0' && c <= '9') hl->byte_class[c] = CLASS_DIGIT;
+            else if (c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v') hl->byte_class[c] = CLASS_SPACE;
+        }
+        hl->byte_class['\n'] = CLASS_NEWLINE;
+        if (spec->preprocessor) hl->byte_class['#'] = CLASS_HASH;
+        if (spec->line_comment) hl->byte_class[(uint8_t)spec->line_comment[0]] = CLASS_COMMENT;
+        if (spec->block_open) hl->byte_class[(uint8_t)spec->block_open[0]] = CLASS_COMMENT;
+        for (const char *q = spec->quotes; *q; ++q) hl->byte_class[(uint8_t)*q] = CLASS_QUOTE;
+        for (const char *q = spec->multiline_quotes; *q; ++q) hl->multiline[(uint8_t)*q] = true;
+        add_keywords(hl, spec->keywords, TOKEN_KEYWORD);
+        add_keywords(hl, spec->literals, TOKEN_LITERAL);
+    }
+}
+
+// Function to find a language by name (e.g. "python"); NULL if unknown
+const LanguageSpec *find_language(const char *name) {
+    for (int l = 0; l < LANGUAGE_COUNT; ++l) {
+        if (strcmp(languages[l].name, name) == 0) return &languages[l];
+    }
+    return NULL;
+}
+
+// Function to pick a language from a file name's extension; plain text when unknown
+const LanguageSpec *language_for_path(const char *path) {
+    const char *dot = path ? strrchr(path, '.') : NULL;
+    const char *slash = path ? strrchr(path, '/') : NULL;
+    if (dot && (!slash || dot > slash)) {
+        size_t length = strlen(dot + 1);
+        for (int l = 0; l < LANGUAGE_COUNT; ++l) {
+            const char *ext = languages[l].extensions;
+            while (*ext) {
+                size_t n = strcspn(ext, " ");
+                if (n == length && strncasecmp(ext, dot + 1, n) == 0) return &languages[l];
+                ext += n;
+                while (*ext == ' ') ext++;
+            }
+        }
+    }
+    return find_language("text");
+}
+
+// Function to find the first byte in [p, end) equal to a, b or c; returns end when there is none
+static const char *scan_for_any(const char *p, const char *end, char a, char b, char c) {
+#if defined(__SSE2__)
+    const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b), vc = _mm_set1_epi8(c);
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, va), _mm_cmpeq_epi8(chunk, vb)), _mm_cmpeq_epi8(chunk, vc));
+        int mask = _mm_movemask_epi8(hits);
+        if (mask) return p + __builtin_ctz((unsigned)mask);
+        p += 16;
+    }
+#endif
+    while (p < end && *p != a && *p != b && *p != c) p++;
+    return p;
+}
+
+static bool push_span(TokenSpans *out, size_t start, TokenKind kind) {
+    if (out->count > 0) {
+        TokenSpan *last = &out->spans[out->count - 1];
+        if (last->kind == kind) return true; // Extends the previous span
+        if (last->start == start) {          // Previous span turned out empty
+            last->kind = (uint8_t)kind;
+            if (out->count > 1 && out->spans[out->count - 2].kind == kind) out->count--;
+            return true;
+        }
+    }
+    if (out->count + 2 > out->capacity) { // The new span plus the sentinel
+        size_t capacity = out->capacity ? out->capacity * 2 : 1024;
+        TokenSpan *spans = realloc(out->spans, capacity * sizeof(TokenSpan));
+        if (!spans) return false;
+        out->spans = spans;
+        out->capacity = capacity;
+    }
+    out->spans[out->count++] = (TokenSpan){ (uint32_t)start, (uint8_t)kind };
+    return true;
+}
+
+static inline bool starts_with(const char *p, const char *end, const char *prefix) {
+    size_t n = strlen(prefix);
+    return (size_t)(end - p) >= n && memcmp(p, prefix, n) == 0;
+}
+
+// Function to split code into token spans in one pass. Returns false when out of memory.
+bool highlight_code(const LanguageSpec *language, const char *code, size_t size, TokenSpans *out) {
+    pthread_once(&highlighters_once, init_highlighters);
+    const Highlighter *hl = &highlighters[language - languages];
+    const LanguageSpec *spec = hl->spec;
+    out->count = 0;
+    if (size >= UINT32_MAX) {
+        return false; // Offsets are 32-bit
+    }
+
+    const char *p = code, *end = code + size;
+    bool line_start = true; // Only whitespace so far on this line
+    bool ok = push_span(out, 0, TOKEN_DEFAULT);
+    if (!spec->keywords[0] && !spec->quotes[0]) {
+        p = end; // Plain text: one span, no number coloring
+    }
+    while (ok && p < end) {
+        const char *token = p;
+        switch (hl->byte_class[(uint8_t)*p]) {
+        case CLASS_SPACE: // Whitespace never starts a span of its own
+            p++;
+            continue;
+        case CLASS_NEWLINE:
+            p++;
+            line_start = true;
+            continue;
+        case CLASS_IDENT: {
+            while (p < end && hl->byte_class[(uint8_t)*p] >= CLASS_IDENT && hl->byte_class[(uint8_t)*p] <= CLASS_DIGIT) p++;
+            size_t length = (size_t)(p - token);
+            TokenKind kind = TOKEN_DEFAULT;
+            for (uint32_t slot = keyword_hash(token, length); hl->keywords[slot].word; slot = (slot + 1) & (KEYWORD_TABLE_SIZE - 1)) {
+                if (hl->keywords[slot].length == length && memcmp(hl->keywords[slot].word, token, length) == 0) {
+                    kind = (TokenKind)hl->keywords[slot].kind;
+                    break;
+                }
+            }
+            if (kind == TOKEN_DEFAULT) {
+                const char *next = p;
+                while (next < end && (*next == ' ' || *next == '\t')) next++;
+                if (next < end && *next == '(') kind = TOKEN_FUNCTION;
+            }
+            ok = push_span(out, token - code, kind);
+            break;
+        }
+        case CLASS_DIGIT:
+            while (p < end && (hl->byte_class[(uint8_t)*p] == CLASS_IDENT || hl->byte_class[(uint8_t)*p] == CLASS_DIGIT || *p == '.')) p++;
+            ok = push_span(out, token - code, TOKEN_LITERAL);
+            break;
+        case CLASS_QUOTE: {
+            char quote = *p;
+            if (spec->lifetimes && quote == '\'') { // 'a' is a char, 'a alone is a lifetime
+                const char *close = p + 1 < end && p[1] == '\\' ? p + 3 : p + 2;
+                while (close < end && close < p + 6 && *close != '\'' && *close != '\n') close++;
+                if (close >= end || *close != '\'') {
+                    p++;
+                    ok = push_span(out, token - code, TOKEN_DEFAULT);
+                    break;
+                }
+            }
+            ok = push_span(out, token - code, TOKEN_STRING);
+            if (spec->triple_quotes && end - p >= 3 && p[1] == quote && p[2] == quote) {
+                p += 3;
+                for (;;) { // Until three closing quotes, across lines
+                    p = scan_for_any(p, end, quote, '\\', quote);
+                    if (p >= end) break;
+                    if (*p == '\\') { p += 2; continue; }
+                    if (end - p >= 3 && p[1] == quote && p[2] == quote) { p += 3; break; }
+                    p++;
+                }
+                break;
+            }
+            p++;
+            bool multiline = hl->multiline[(uint8_t)quote];
+            for (;;) {
+                p = scan_for_any(p, end, quote, '\\', '\n');
+                if (p >= end) break;
+                if (*p == '\\') { p += 2; continue; }
+                if (*p == '\n' && multiline) { p++; continue; }
+                if (*p == quote) p++;
+                break; // Closing quote, or the end of a single-line string
+            }
+            break;
+        }
+        case CLASS_COMMENT:
+            if (spec->line_comment && starts_with(p, end, spec->line_comment)) {
+                ok = push_span(out, token - code, TOKEN_COMMENT);
+                p = scan_for_any(p, end, '\n', '\n', '\n');
+                break;
+            }
+            if (spec->block_open && starts_with(p, end, spec->block_open)) {
+                ok = push_span(out, token - code, TOKEN_COMMENT);
+                p += strlen(spec->block_open);
+                for (;;) {
+                    p = scan_for_any(p, end, spec->block_close[0], spec->block_close[0], spec->block_close[0]);
+                    if (p >= end) break;
+                    if (starts_with(p, end, spec->block_close)) { p += strlen(spec->block_close); break; }
+                    p++;
+                }
+                break;
+            }
+            p++; // Just an operator
+            ok = push_span(out, token - code, TOKEN_DEFAULT);
+            break;
+        case CLASS_HASH:
+            p++;
+            if (line_start) { // '#' plus the directive name
+                while (p < end && (*p == ' ' || *p == '\t')) p++;
+                while (p < end && hl->byte_class[(uint8_t)*p] == CLASS_IDENT) p++;
+                ok = push_span(out, token - code, TOKEN_KEYWORD);
+            } else {
+                ok = push_span(out, token - code, TOKEN_DEFAULT);
+            }
+            break;
+        default:
+            p++;
+            ok = push_span(out, token - code, TOKEN_DEFAULT);
+            break;
+        }
+        line_start = false;
+    }
+    if (ok) { // push_span always leaves room for this
+        out->spans[out->count] = (TokenSpan){ UINT32_MAX, TOKEN_DEFAULT };
+    }
+    return ok;
+}
+
+void token_spans_free(TokenSpans *spans) {
+    free(spans->spans);
+    memset(spans, 0, sizeof(*spans));
+}
+
+// --- Glyph Files ---
+//
+// Rasterized glyphs are also kept on disk, one file per (font file contents, pixel height,
+// glyph source) in the glyphs/ folder of the tool's cache directory. A file is mapped
+// read-only and glyph caches point straight into the mapping, so processes rendering with the
+// same font share its pages and a warm run never rasterizes an outline. Glyphs a file lacks are
+// rasterized as before and collected; after a render that added any, the file is written again
+// with them, merged with whatever other processes saved in the meantime, under a temporary name
+// that is renamed into place. Fallback glyphs have no stable index and are never stored.
+//
+// Layout, in native byte order: a GlyphFileHeader, one GlyphFileEntry per glyph of the font
+// (indexed by glyph index), then the coverage bitmaps.
+
+#define GLYPH_FILE_MAGIC "CTIGLYF1"
+#define GLYPH_FILE_VERSION 1 // Bump whenever rasterized or SDF-resampled glyphs change
+#define GLYPH_FILE_BYTE_ORDER 0x01020304u
+
+typedef struct {
+    char magic[8];
+    uint32_t version;        // GLYPH_FILE_VERSION of the writer
+    uint32_t reserved;
+    uint64_t font_hash;      // Hash of the font file's contents
+    float pixel_height;
+    uint32_t sdf;
+    uint32_t glyph_count;    // Entries that follow
+    uint32_t byte_order;     // GLYPH_FILE_BYTE_ORDER as the writer stored it
+} GlyphFileHeader;
+
+typedef struct {
+    uint32_t offset;         // Bitmap position from the start of the file
+    uint16_t width, height;
+    int16_t x_offset, y_offset;
+    uint32_t stored;         // Nonzero once the glyph has been rasterized
+} GlyphFileEntry;
+
+struct GlyphFile {
+    struct GlyphFile *next;
+    char path[PATH_MAX];
+    uint64_t font_hash;
+    float pixel_height;
+    bool sdf;
+    int glyph_count;
+    const uint8_t *map;      // The file as it was when first used, or NULL
+    size_t map_size;
+    pthread_mutex_t lock;    // Guards the glyphs below
+    GlyphFileEntry *added;   // Glyphs rasterized in this process, by glyph index (offset unused)
+    uint8_t **added_bitmaps;
+    int unsaved;             // Added glyphs the file on disk may not have yet
+};
+
+// Glyph files of one font, opened as glyph caches ask for them
+typedef struct {
+    bool enabled;
+    const uint8_t *font_data;
+    size_t font_size;
+    int glyph_count;
+    uint64_t font_hash;      // Computed on first use
+    bool hashed;
+    pthread_mutex_t lock;    // Guards files and the hash
+    GlyphFile *files;
+} GlyphFileSet;
+
+static uint64_t hash_bytes64(const void *data, size_t size, uint64_t seed);
+static bool write_file_atomic(const char *path, const void *data, size_t size);
+
+void glyph_file_set_init(GlyphFileSet *set, bool enabled, const uint8_t *font_data, size_t font_size, int glyph_count) {
+    memset(set, 0, sizeof(*set));
+    set->enabled = enabled;
+    set->font_data = font_data;
+    set->font_size = font_size;
+    set->glyph_count = glyph_count;
+    pthread_mutex_init(&set->lock, NULL);
+}
+
+// Function to map the glyph file at file's path, checking it was written by this build for the
+// same font, size and glyph source. Returns NULL if there is no such file.
+static const uint8_t *glyph_file_map(const GlyphFile *file, size_t *out_size) {
+    int fd = open(file->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    struct stat st;
+    size_t entries_end = sizeof(GlyphFileHeader) + sizeof(GlyphFileEntry) * (size_t)file->glyph_count;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (uint64_t)st.st_size >= entries_end) {
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) return NULL;
+
+    const GlyphFileHeader *header = data;
+    if (memcmp(header->magic, GLYPH_FILE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->byte_order != GLYPH_FILE_BYTE_ORDER ||
+        header->version != GLYPH_FILE_VERSION ||
+        header->font_hash != file->font_hash || header->pixel_height != file->pixel_height ||
+        header->sdf != (uint32_t)file->sdf || header->glyph_count != (uint32_t)file->glyph_count) {
+        munmap(data, (size_t)st.st_size);
+        return NULL;
+    }
+    *out_size = (size_t)st.st_size;
+    return data;
+}
+
+// Function to read one glyph of a mapped glyph file. Returns false if the file lacks it.
+static bool glyph_file_entry(const uint8_t *map, size_t map_size, int glyph_index,
+                             GlyphFileEntry *entry, const uint8_t **bitmap) {
+    if (!map) return false;
+    memcpy(entry, map + sizeof(GlyphFileHeader) + sizeof(GlyphFileEntry) * (size_t)glyph_index, sizeof(*entry));
+    size_t size = (size_t)entry->width * entry->height;
+    if (!entry->stored || entry->offset > map_size || size > map_size - entry->offset) return false;
+    *bitmap = size ? map + entry->offset : NULL;
+    return true;
+}
+
+// Function to find the glyph file of a font for a size and glyph source, mapping it on first
+// use. Returns NULL when glyph files are off or there is no cache directory.
+GlyphFile *glyph_file_open(GlyphFileSet *set, float pixel_height, bool sdf) {
+    if (!set->enabled) return NULL;
+    pthread_mutex_lock(&set->lock);
+    GlyphFile *file = set->files;
+    while (file && !(file->pixel_height == pixel_height && file->sdf == sdf)) {
+        file = file->next;
+    }
+    char dir[1024];
+    if (!file && cache_directory(dir, sizeof(dir)) && (file = calloc(1, sizeof(GlyphFile)))) {
+        if (!set->hashed) {
+            set->font_hash = hash_bytes64(set->font_data, set->font_size, 0);
+            set->hashed = true;
+        }
+        uint32_t height_bits;
+        memcpy(&height_bits, &pixel_height, sizeof(height_bits));
+        size_t length = strlen(dir);
+        snprintf(dir + length, sizeof(dir) - length, "/glyphs");
+        mkdir(dir, 0755);
+        snprintf(file->path, sizeof(file->path), "%s/%016llx-%08x%s.glyphs", dir,
+                 (unsigned long long)set->font_hash, height_bits, sdf ? "-sdf" : "");
+        file->font_hash = set->font_hash;
+        file->pixel_height = pixel_height;
+        file->sdf = sdf;
+        file->glyph_count = set->glyph_count;
+        file->map = glyph_file_map(file, &file->map_size);
+        pthread_mutex_init(&file->lock, NULL);
+        file->next = set->files;
+        set->files = file;
+        log_message(LOG_DEBUG, "Glyph file: %s (%s)", file->path, file->map ? "mapped" : "new");
+    }
+    pthread_mutex_unlock(&set->lock);
+    return file;
+}
+
+// Function to look a glyph up in a glyph file, or among the glyphs added to it since it was
+// mapped. Fills in the bitmap and its placement; returns false if the glyph is not there.
+bool glyph_file_find(GlyphFile *file, int glyph_index, CachedGlyph *glyph) {
+    if (glyph_index >= file->glyph_count) return false;
+    GlyphFileEntry entry;
+    const uint8_t *bitmap = NULL;
+    bool found = glyph_file_entry(file->map, file->map_size, glyph_index, &entry, &bitmap);
+    if (!found) {
+        pthread_mutex_lock(&file->lock);
+        found = file->added && file->added[glyph_index].stored;
+        if (found) {
+            entry = file->added[glyph_index];
+            bitmap = file->added_bitmaps[glyph_index];
+        }
+        pthread_mutex_unlock(&file->lock);
+    }
+    if (found) {
+        glyph->width = entry.width;
+        glyph->height = entry.height;
+        glyph->x_offset = entry.x_offset;
+        glyph->y_offset = entry.y_offset;
+        glyph->bitmap = bitmap;
+    }
+    return found;
+}
+
+// Function to add a freshly rasterized glyph to a glyph file, to be written by the next save
+void glyph_file_add(GlyphFile *file, const CachedGlyph *glyph) {
+    if (glyph->glyph_index >= file->glyph_count || glyph->width > UINT16_MAX || glyph->height > UINT16_MAX ||
+        glyph->x_offset < INT16_MIN || glyph->x_offset > INT16_MAX ||
+        glyph->y_offset < INT16_MIN || glyph->y_offset > INT16_MAX) {
+        return;
+    }
+    pthread_mutex_lock(&file->lock);
+    if (!file->added) {
+        file->added = calloc(file->glyph_count, sizeof(GlyphFileEntry));
+        file->added_bitmaps = calloc(file->glyph_count, sizeof(uint8_t *));
+    }
+    size_t size = (size_t)glyph->width * glyph->height;
+    uint8_t *bitmap = size && file->added_bitmaps ? malloc(size) : NULL;
+    if (file->added && file->added_bitmaps && (bitmap || !size) && !file->added[glyph->glyph_index].stored) {
+        if (size) memcpy(bitmap, glyph->bitmap, size);
+        file->added[glyph->glyph_index] = (GlyphFileEntry){
+            .width = (uint16_t)glyph->width, .height = (uint16_t)glyph->height,
+            .x_offset = (int16_t)glyph->x_offset, .y_offset = (int16_t)glyph->y_offset, .stored = 1,
+        };
+        file->added_bitmaps[glyph->glyph_index] = bitmap;
+        file->unsaved++;
+    } else {
+        free(bitmap);
+    }
+    pthread_mutex_unlock(&file->lock);
+}
+
+// Function to write a glyph file with every glyph it has on disk now, had when mapped, or was
+// given since. Called with file->lock held.
+static bool glyph_file_write(GlyphFile *file) {
+    size_t latest_size = 0;
+    const uint8_t *latest = glyph_file_map(file, &latest_size); // Saved by other processes since
+    size_t entries_size = sizeof(GlyphFileEntry) * (size_t)file->glyph_count;
+    GlyphFileEntry *entries = calloc(file->glyph_count ? file->glyph_count : 1, sizeof(GlyphFileEntry));
+    ByteBuffer out = {0};
+    GlyphFileHeader header = {
+        .version = GLYPH_FILE_VERSION, .font_hash = file->font_hash,
+        .pixel_height = file->pixel_height, .sdf = file->sdf,
+        .glyph_count = (uint32_t)file->glyph_count, .byte_order = GLYPH_FILE_BYTE_ORDER,
+    };
+    memcpy(header.magic, GLYPH_FILE_MAGIC, sizeof(header.magic));
+    bool ok = entries && byte_buffer_append(&out, &header, sizeof(header)) &&
+              byte_buffer_append(&out, entries, entries_size);
+
+    int stored = 0;
+    for (int g = 0; ok && g < file->glyph_count; ++g) {
+        GlyphFileEntry entry;
+        const uint8_t *bitmap = NULL;
+        if (!glyph_file_entry(latest, latest_size, g, &entry, &bitmap) &&
+            !glyph_file_entry(file->map, file->map_size, g, &entry, &bitmap)) {
+            if (!file->added || !file->added[g].stored) continue;
+            entry = file->added[g];
+            bitmap = file->added_bitmaps[g];
+        }
+        entry.offset = (uint32_t)out.size;
+        ok = out.size <= UINT32_MAX && byte_buffer_append(&out, bitmap, (size_t)entry.width * entry.height);
+        entries[g] = entry;
+        stored++;
+    }
+    if (ok) {
+        memcpy(out.data + sizeof(header), entries, entries_size);
+        ok = write_file_atomic(file->path, out.data, out.size);
+    }
+    if (ok) {
+        log_message(LOG_DEBUG, "Glyph file: saved %d glyphs to %s", stored, file->path);
+    }
+    if (latest) munmap((void *)latest, latest_size);
+    byte_buffer_free(&out);
+    free(entries);
+    return ok;
+}
+
+// Function to write every glyph file of a font that was given new glyphs
+void glyph_files_save(GlyphFileSet *set) {
+    pthread_mutex_lock(&set->lock);
+    for (GlyphFile *file = set->files; file; file = file->next) {
+        pthread_mutex_lock(&file->lock);
+        if (file->unsaved > 0 && !glyph_file_write(file)) {
+            log_message(LOG_WARN, "Could not save glyph file %s", file->path);
+        }
+        file->unsaved = 0; // Not retried after every render; the next new glyph tries again
+        pthread_mutex_unlock(&file->lock);
+    }
+    pthread_mutex_unlock(&set->lock);
+}
+
+void glyph_files_free(GlyphFileSet *set) {
+    GlyphFile *file = set->files;
+    while (file) {
+        GlyphFile *next = file->next;
+        if (file->map) munmap((void *)file->map, file->map_size);
+        for (int g = 0; file->added_bitmaps && g < file->glyph_count; ++g) {
+            free(file->added_bitmaps[g]);
+        }
+        free(file->added);
+        free(file->added_bitmaps);
+        pthread_mutex_destroy(&file->lock);
+        free(file);
+        file = next;
+    }
+    pthread_mutex_destroy(&set->lock);
+    memset(set, 0, sizeof(*set));
+}
+
+// --- Font Loading ---
+
+// A font file read and parsed once, then shared read-only by every render that uses it
+typedef struct LoadedFont {
+    char *path;
+    unsigned char *buffer;   // The font file, mapped read-only when possible
+    size_t buffer_size;
+    bool mapped;
+    stbtt_fontinfo info;
+    GlyphMap glyph_map;
+    SdfAtlas sdf;            // Distance fields for --sdf renders, built glyph by glyph
+    GlyphFileSet glyph_files;
+    struct LoadedFont *next;
+} LoadedFont;
+
+// Every font loaded so far
+typedef struct {
+    LoadedFont *head;
+    pthread_mutex_t lock;
+    FontFallback *fallback;  // Chain every loaded font falls back to, or NULL
+    bool glyph_files;        // Keep rasterized glyphs in glyph files between runs
+} LoadedFontList;
+
+// Function to find a discovered font's path by its friendly name (NULL if unknown)
+const char *find_font_path(const FontCatalog *catalog, const char *name) {
+    const FontInfo *font = find_font(catalog, name);
+    return font ? font->path : NULL;
+}
+
+// Function to map a font file read-only, so every process using the font shares one copy of
+// it. Falls back to reading the file into memory when it cannot be mapped.
+static unsigned char *map_font_file(const char *path, size_t *out_size, bool *out_mapped) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    *out_mapped = data != MAP_FAILED;
+    if (*out_mapped) {
+        *out_size = (size_t)st.st_size;
+        return data;
+    }
+    return (unsigned char *)load_file(path, out_size);
+}
+
+// Function to release a font file from map_font_file
+static void unmap_font_file(unsigned char *buffer, size_t size, bool mapped) {
+    if (mapped) {
+        munmap(buffer, size);
+    } else {
+        free(buffer);
+    }
+}
+
+// Function to return the parsed font for a path, reading it on first use.
+// Safe to call from several threads; each font file is read only once.
+LoadedFont *load_font(LoadedFontList *list, const char *path) {
+    pthread_mutex_lock(&list->lock);
+    for (LoadedFont *font = list->head; font; font = font->next) {
+        if (strcmp(font->path, path) == 0) {
+            pthread_mutex_unlock(&list->lock);
+            return font;
+        }
+    }
+
+    LoadedFont *font = calloc(1, sizeof(LoadedFont));
+    if (!font) {
+        fprintf(stderr, "Failed to allocate font memory!\n");
+        pthread_mutex_unlock(&list->lock);
+        return NULL;
+    }
+    font->buffer = map_font_file(path, &font->buffer_size, &font->mapped);
+    if (!font->buffer) {
+        fprintf(stderr, "Error: Could not open font file '%s'.\n", path);
+        free(font);
+        pthread_mutex_unlock(&list->lock);
+        return NULL;
+    }
+    if (!stbtt_InitFont(&font->info, font->buffer, 0)) {
+        fprintf(stderr, "Failed to initialize font from '%s'!\n", path);
+        unmap_font_file(font->buffer, font->buffer_size, font->mapped);
+        free(font);
+        pthread_mutex_unlock(&list->lock);
+        return NULL;
+    }
+    glyph_map_init(&font->glyph_map, &font->info, list->fallback);
+    sdf_atlas_init(&font->sdf, &font->info);
+    glyph_file_set_init(&font->glyph_files, list->glyph_files, font->buffer, font->buffer_size, font->info.numGlyphs);
+    font->path = strdup(path);
+    font->next = list->head;
+    list->head = font;
+    pthread_mutex_unlock(&list->lock);
+    return font;
+}
+
+// Function to free every loaded font
+void free_loaded_fonts(LoadedFontList *list) {
+    LoadedFont *font = list->head;
+    while (font) {
+        LoadedFont *next = font->next;
+        glyph_map_free(&font->glyph_map);
+        sdf_atlas_free(&font->sdf);
+        glyph_files_free(&font->glyph_files);
+        free(font->path);
+        unmap_font_file(font->buffer, font->buffer_size, font->mapped);
+        free(font);
+        font = next;
+    }
+    list->head = NULL;
+}
+
+// Function to save the glyphs every loaded font's glyph files were given during a render
+void save_glyph_files(LoadedFontList *list) {
+    pthread_mutex_lock(&list->lock);
+    for (LoadedFont *font = list->head; font; font = font->next) {
+        glyph_files_save(&font->glyph_files);
+    }
+    pthread_mutex_unlock(&list->lock);
+}
+
+// --- Font Fallback ---
+//
+// Codepoints the selected font lacks are drawn with the first font of the fallback chain that
+// covers them. The chain is every discovered font in order unless --fallback names the fonts.
+// Deciding whether a font covers a codepoint only needs the coverage ranges from the font
+// index, so a fallback font's file is read the first time it is actually needed, and fonts
+// that are never needed are never read.
+
+typedef struct {
+    const FontInfo *info;
+    FontCoverage coverage;  // Built from info->coverage on first use
+    bool parsed;
+    LoadedFont *font;       // Read on first use
+    bool failed;            // Unreadable; skipped from then on
+} FallbackFont;
+
+struct FontFallback {
+    FallbackFont *fonts;
+    int count;
+    LoadedFontList *loaded; // Where fallback fonts are loaded
+    pthread_mutex_t lock;   // Guards the lazy state of fonts
+    char *spec;             // The list the chain was made from, for cache keys
+};
+
+// Function to set up a fallback chain from a comma-separated list of font names. NULL or "*"
+// means every discovered font, "none" an empty chain. Returns false on an unknown font name.
+bool font_fallback_init(FontFallback *fallback, const FontCatalog *catalog, LoadedFontList *loaded, const char *list) {
+    memset(fallback, 0, sizeof(*fallback));
+    pthread_mutex_init(&fallback->lock, NULL);
+    fallback->loaded = loaded;
+    fallback->spec = strdup(list ? list : "*");
+    bool every = !list || strcmp(list, "*") == 0;
+    int capacity = every ? catalog->count : 1;
+    for (const char *c = list; !every && c && *c; ++c) capacity += *c == ',';
+    fallback->fonts = calloc(capacity > 0 ? capacity : 1, sizeof(FallbackFont));
+    if (!fallback->fonts || !fallback->spec) {
+        fprintf(stderr, "Error: Failed to allocate font fallback memory.\n");
+        return false;
+    }
+    if (every) {
+        for (int i = 0; i < catalog->count; ++i) fallback->fonts[fallback->count++].info = &catalog->fonts[i];
+        return true;
+    }
+    if (strcmp(list, "none") == 0) return true;
+
+    for (const char *name = list; *name;) {
+        size_t length = strcspn(name, ",");
+        char font_name[256];
+        snprintf(font_name, sizeof(font_name), "%.*s", (int)length, name);
+        const FontInfo *info = find_font(catalog, font_name);
+        if (!info) {
+            fprintf(stderr, "Error: Fallback font '%s' not found.\n", font_name);
+            return false;
+        }
+        fallback->fonts[fallback->count++].info = info;
+        name += length + (name[length] == ',');
+    }
+    return true;
+}
+
+void font_fallback_free(FontFallback *fallback) {
+    for (int i = 0; i < fallback->count; ++i) {
+        font_coverage_free(&fallback->fonts[i].coverage);
+    }
+    free(fallback->fonts);
+    free(fallback->spec);
+    pthread_mutex_destroy(&fallback->lock);
+    memset(fallback, 0, sizeof(*fallback));
+}
+
+// Function to find the first font of the chain, other than primary, with a glyph for
+// codepoint. Returns false if no font has one.
+bool font_fallback_find(FontFallback *fallback, const stbtt_fontinfo *primary, int codepoint, FallbackGlyph *out) {
+    pthread_mutex_lock(&fallback->lock);
+    bool found = false;
+    for (int i = 0; i < fallback->count && !found; ++i) {
+        FallbackFont *entry = &fallback->fonts[i];
+        if (entry->failed) continue;
+        if (!entry->parsed) {
+            entry->parsed = true;
+            if (!font_coverage_parse(&entry->coverage, entry->info->coverage)) font_coverage_free(&entry->coverage);
+        }
+        if (!font_coverage_has(&entry->coverage, codepoint)) continue;
+        if (!entry->font) {
+            entry->font = load_font(fallback->loaded, entry->info->path);
+            if (!entry->font) {
+                entry->failed = true;
+                continue;
+            }
+            log_message(LOG_DEBUG, "Fallback font: %s (for U+%04X)", entry->info->name, codepoint);
+        }
+        if (&entry->font->info == primary) continue;
+        int glyph = stbtt_FindGlyphIndex(&entry->font->info, codepoint);
+        if (glyph == 0) continue;
+
+        // Match the fonts' ascent-to-descent height, the span a pixel height is scaled to
+        int ascent, descent, primary_ascent, primary_descent;
+        stbtt_GetFontVMetrics(&entry->font->info, &ascent, &descent, NULL);
+        stbtt_GetFontVMetrics(primary, &primary_ascent, &primary_descent, NULL);
+        out->font = &entry->font->info;
+        out->glyph_index = glyph;
+        out->scale_ratio = ascent > descent ? (float)(primary_ascent - primary_descent) / (float)(ascent - descent) : 1.0f;
+        found = true;
+    }
+    pthread_mutex_unlock(&fallback->lock);
+    return found;
+}
+
+// --- Statistics ---
+//
+// Every render adds its phase timings and work counters to its worker's RenderStats, and
+// --stats prints the totals when the run ends. Timings are wall time on the rendering thread,
+// so for batches they add up the time of every image.
+
+typedef enum {
+    STATS_OFF,
+    STATS_TEXT,
+    STATS_JSON,
+} StatsFormat;
+
+typedef struct {
+    int images;
+    int cache_hits;           // Images copied from the output cache instead of rendered
+    double font_load_seconds;
+    double layout_seconds;    // Line index, dimensions, highlighting and background rows
+    double fill_seconds;
+    double raster_seconds;
+    double encode_seconds;    // Palette building and mapping, PNG compression and writing
+    uint64_t glyphs_drawn;
+    uint64_t pixels_blended;
+    uint64_t bytes_written;
+} RenderStats;
+
+void render_stats_add(RenderStats *total, const RenderStats *part) {
+    total->images += part->images;
+    total->cache_hits += part->cache_hits;
+    total->font_load_seconds += part->font_load_seconds;
+    total->layout_seconds += part->layout_seconds;
+    total->fill_seconds += part->fill_seconds;
+    total->raster_seconds += part->raster_seconds;
+    total->encode_seconds += part->encode_seconds;
+    total->glyphs_drawn += part->glyphs_drawn;
+    total->pixels_blended += part->pixels_blended;
+    total->bytes_written += part->bytes_written;
+}
+
+// Function to read the peak resident set size of the process in kilobytes
+static long peak_rss_kb(void) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024; // Bytes on macOS
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+// Function to print run statistics to stderr as a table or as one JSON object
+void print_stats(const RenderStats *stats, double discovery_seconds, double total_seconds, StatsFormat format) {
+    long rss = peak_rss_kb();
+    if (format == STATS_JSON) {
+        fprintf(stderr, "{\"images\":%d,\"cache_hits\":%d,\"discovery_ms\":%.3f,\"font_load_ms\":%.3f,\"layout_ms\":%.3f,"
+                "\"fill_ms\":%.3f,\"raster_ms\":%.3f,\"encode_ms\":%.3f,\"total_ms\":%.3f,"
+                "\"glyphs_drawn\":%llu,\"pixels_blended\":%llu,\"bytes_written\":%llu,\"scratch_peak_bytes\":%zu,"
+                "\"peak_rss_kb\":%ld}\n",
+                stats->images, stats->cache_hits, discovery_seconds * 1000.0, stats->font_load_seconds * 1000.0,
+                stats->layout_seconds * 1000.0, stats->fill_seconds * 1000.0, stats->raster_seconds * 1000.0,
+                stats->encode_seconds * 1000.0, total_seconds * 1000.0,
+                (unsigned long long)stats->glyphs_drawn, (unsigned long long)stats->pixels_blended,
+                (unsigned long long)stats->bytes_written, scratch_peak(), rss);
+        return;
+    }
+    fprintf(stderr, "Statistics (%d image%s, %d from the cache):\n", stats->images, stats->images == 1 ? "" : "s", stats->cache_hits);
+    fprintf(stderr, "  Font discovery  %10.3f ms\n", discovery_seconds * 1000.0);
+    fprintf(stderr, "  Font loading    %10.3f ms\n", stats->font_load_seconds * 1000.0);
+    fprintf(stderr, "  Layout          %10.3f ms\n", stats->layout_seconds * 1000.0);
+    fprintf(stderr, "  Fill            %10.3f ms\n", stats->fill_seconds * 1000.0);
+    fprintf(stderr, "  Rasterization   %10.3f ms\n", stats->raster_seconds * 1000.0);
+    fprintf(stderr, "  Encoding        %10.3f ms\n", stats->encode_seconds * 1000.0);
+    fprintf(stderr, "  Total           %10.3f ms\n", total_seconds * 1000.0);
+    fprintf(stderr, "  Glyphs drawn    %10llu\n", (unsigned long long)stats->glyphs_drawn);
+    fprintf(stderr, "  Pixels blended  %10llu\n", (unsigned long long)stats->pixels_blended);
+    fprintf(stderr, "  Bytes written   %10llu\n", (unsigned long long)stats->bytes_written);
+    fprintf(stderr, "  Scratch peak    %10.1f KB\n", scratch_peak() / 1024.0);
+    fprintf(stderr, "  Peak RSS        %10ld KB\n", rss);
+}
+
+// --- Rendering ---
+//
+// Images are drawn in horizontal bands of about RENDER_BAND_BYTES into one reused buffer, and
+// each finished band is streamed to the PNG encoder, so memory depends on the image width
+// rather than the length of the input.
+
+#define RENDER_BAND_BYTES (4 * 1024 * 1024)
+#define RENDER_MAX_WIDTH (1 << 20)
+#define RENDER_LINE_SPACING 1.5f // Line height as a multiple of the font's
+#define RENDER_PADDING 20        // Around the code block, and inside it around the text
+#define OUTPUT_CACHE_KEY_SIZE 33 // 128-bit key in hex, with the terminator
+#define RENDER_MAX_SCALES 16     // Outputs of one --scales render
+
+typedef CtiTheme Theme; // Colors of an image, as "#RRGGBB"
+
+static const Theme default_theme = {
+    .background = "#1a1a1a",      // Dark background
+    .code_background = "#0d0d0d", // Even darker for code block
+    .text = "#f8f8f2",            // Foreground (Dracula: #F8F8F2)
+    .comment = "#6272a4",         // Comment (Dracula: #6272A4)
+    .keyword = "#ff79c6",         // Keyword (Dracula: #FF79C6)
+    .function = "#50fa7b",        // Function (Dracula: #50FA7B)
+    .string = "#f1fa8c",          // String (Dracula: #F1FA8C)
+    .literal = "#ffb86c",         // Literal/Number (Dracula: #FFB86C)
+};
+
+typedef struct OutputCache OutputCache;
+typedef struct RenderContext RenderContext;
+
+// Everything needed to turn one input file into one image
+typedef struct {
+    const char *input_path;
+    const char *output_path; // "-" writes to standard output
+    ByteBuffer *output_buffer; // When set, the image is appended here instead of written to output_path
+    const ByteSink *output_sink; // When set, the image is streamed here (and never cached)
+    OutputFormat format;     // OUTPUT_AUTO picks one from output_path
+    const char *font_name;   // NULL selects the first discovered font
+    const char *language;    // Highlighting language; NULL picks one from input_path
+    float font_pixel_height;
+    int width;               // 0 means calculated from content
+    int height;              // 0 means calculated from content
+    int png_level;           // Deflate level 0-9
+    int png_threads;         // PNG compression threads; 1 compresses on the rendering thread
+    int raster_threads;      // Threads drawing each band; 1 draws on the rendering thread
+    bool palette;            // Write an indexed-color PNG
+    bool sdf;                // Resample glyphs from the font's distance fields
+    float scale;             // Pixel density: multiplies font size, padding and -w/-h (0 means 1)
+    OutputCache *cache;      // When set, identical renders are served from this cache
+} RenderJob;
+
+static inline OutputFormat job_format(const RenderJob *job) {
+    return job->format != OUTPUT_AUTO ? job->format : output_format_for_path(job->output_path);
+}
+
+static inline float job_scale(const RenderJob *job) {
+    return job->scale > 0 ? job->scale : 1.0f;
+}
+
+// Function to get the font size a job is drawn at, in output pixels
+static inline float job_pixel_height(const RenderJob *job) {
+    return job->font_pixel_height * job_scale(job);
+}
+
+typedef struct RasterPool RasterPool;
+
+// State owned by one rendering thread. Glyph caches stay warm across jobs,
+// so a worker only rasterizes each (font, size, glyph) once.
+typedef struct {
+    GlyphCache **caches;
+    int cache_count;
+    int cache_capacity;
+    RasterPool *raster;      // Helper threads for drawing bands, started on first use
+    RenderStats stats;       // Totals of every render on this worker
+    RenderContext *context;  // Fonts and theme the worker renders with
+} RenderWorker;
+
+// Everything renders share: the font catalog, the fonts loaded from it and the theme, plus
+// idle workers whose glyph caches stay warm between library calls
+struct RenderContext {
+    FontCatalog fonts;
+    LoadedFontList loaded;
+    FontFallback fallback;       // For every font in loaded
+    Theme theme;
+    char theme_colors[8][8];     // Copies of the colors theme points to
+    pthread_mutex_t workers_lock;
+    RenderWorker **idle_workers;
+    int idle_count;
+    int idle_capacity;
+};
+
+// Function to find the font file a job asks for: its named font, or else the first one
+// discovered. Returns NULL if there is none.
+const char *context_font_path(const RenderContext *context, const char *font_name) {
+    if (font_name) return find_font_path(&context->fonts, font_name);
+    return context->fonts.count > 0 ? context->fonts.fonts[0].path : NULL;
+}
+
+void raster_pool_free(RasterPool *pool);
+void raster_pool_cache_stats(const RasterPool *pool, unsigned long *hits, unsigned long *misses);
+
+// Function to find the worker's glyph cache for a font, size and glyph source, creating it if needed
+GlyphCache *worker_glyph_cache(RenderWorker *worker, LoadedFont *font, float pixel_height, bool sdf) {
+    SdfAtlas *atlas = sdf ? &font->sdf : NULL;
+    for (int i = 0; i < worker->cache_count; ++i) {
+        GlyphCache *cache = worker->caches[i];
+        if (cache->font == &font->info && cache->pixel_height == pixel_height && cache->sdf == atlas) {
+            return cache;
+        }
+    }
+
+    if (worker->cache_count >= worker->cache_capacity) {
+        int capacity = worker->cache_capacity == 0 ? 4 : worker->cache_capacity * 2;
+        GlyphCache **caches = realloc(worker->caches, sizeof(GlyphCache *) * capacity);
+        if (!caches) return NULL;
+        worker->caches = caches;
+        worker->cache_capacity = capacity;
+    }
+    GlyphCache *cache = malloc(sizeof(GlyphCache));
+    if (!cache || !glyph_cache_init(cache, &font->glyph_map, pixel_height)) {
+        free(cache);
+        return NULL;
+    }
+    cache->sdf = atlas;
+    cache->file = glyph_file_open(&font->glyph_files, pixel_height, sdf);
+    worker->caches[worker->cache_count++] = cache;
+    return cache;
+}
+
+// Function to sum the glyph cache counters of a worker
+void worker_cache_stats(const RenderWorker *worker, unsigned long *hits, unsigned long *misses) {
+    for (int i = 0; i < worker->cache_count; ++i) {
+        *hits += worker->caches[i]->hits;
+        *misses += worker->caches[i]->misses;
+    }
+    if (worker->raster) {
+        raster_pool_cache_stats(worker->raster, hits, misses);
+    }
+}
+
+void worker_free(RenderWorker *worker) {
+    for (int i = 0; i < worker->cache_count; ++i) {
+        glyph_cache_free(worker->caches[i]);
+        free(worker->caches[i]);
+    }
+    free(worker->caches);
+    raster_pool_free(worker->raster);
+    memset(worker, 0, sizeof(*worker));
+}
+
+// Everything needed to draw any band of an image, computed once per render
+typedef struct {
+    const char *code;
+    const LineIndex *lines;
+    LoadedFont *font;
+    GlyphCache *cache;   // Belongs to the rendering thread; helper threads use their own
+    int width, height;
+    int code_block_y, code_block_height;
+    int text_x;          // Pen x of every line
+    int first_line_y;    // Top of the first line
+    int line_step;       // Distance between the tops of consecutive lines
+    int ink_top;         // Rows a line's glyphs can reach, relative to the line's top
+    int ink_bottom;
+    int ink_left;        // Leftmost column a glyph can reach, relative to the pen
+    const TokenSpan *spans;  // Highlighting of code, in order
+    size_t span_count;       // Not counting the sentinel
+    uint8_t token_colors[TOKEN_KIND_COUNT][CHANNELS];
+    const uint8_t *bg_row;   // Prefilled background rows used for the fill
+    const uint8_t *code_row;
+} RenderLayout;
+
+// Function to find the first line whose ink reaches row y or below
+static int first_line_reaching(const RenderLayout *layout, int y) {
+    int distance = y - layout->first_line_y - layout->ink_bottom;
+    if (distance < 0 || layout->line_step <= 0) {
+        return 0;
+    }
+    int index = distance / layout->line_step + 1;
+    return index < layout->lines->line_count ? index : layout->lines->line_count;
+}
+
+// Function to find the token span containing a byte offset
+static size_t find_span(const TokenSpan *spans, size_t count, uint32_t offset) {
+    size_t low = 0, high = count;
+    while (high - low > 1) {
+        size_t mid = low + (high - low) / 2;
+        if (spans[mid].start <= offset) low = mid;
+        else high = mid;
+    }
+    return low;
+}
+
+// Function to draw one band: fill the background rows, then every line reaching the band.
+// Lines straddling a band edge are drawn into both bands, clipped to each, so every pixel
+// sees the same blends in the same order as when drawing the whole image at once.
+static void render_band(const RenderLayout *layout, Canvas *band) {
+    double start = now_seconds();
+    size_t row_bytes = (size_t)band->width * CHANNELS;
+    for (int r = 0; r < band->rows; ++r) {
+        int y = band->y0 + r;
+        bool in_code_block = y >= layout->code_block_y && y < layout->code_block_y + layout->code_block_height;
+        memcpy(band->pixels + (size_t)r * row_bytes, in_code_block ? layout->code_row : layout->bg_row, row_bytes);
+    }
+    double filled = now_seconds();
+    band->stats.fill_seconds += filled - start;
+
+    const LineIndex *lines = layout->lines;
+    int first = first_line_reaching(layout, band->y0);
+    if (first >= lines->line_count) {
+        return;
+    }
+    size_t span = find_span(layout->spans, layout->span_count, lines->starts[first]);
+
+    int band_end = band->y0 + band->rows;
+    for (int index = first; index < lines->line_count; ++index) {
+        int line_y = layout->first_line_y + index * layout->line_step;
+        if (line_y + layout->ink_top >= band_end) {
+            break;
+        }
+        uint32_t line_offset = lines->starts[index];
+        size_t line_len = lines->starts[index + 1] - 1 - line_offset;
+        const char *line = layout->code + line_offset;
+
+        // Draw the line one token span at a time, straight from the input
+        while (layout->spans[span + 1].start <= line_offset) span++;
+        int x = layout->text_x;
+        for (size_t pos = 0; pos < line_len;) {
+            if (x + layout->ink_left >= band->width) {
+                break; // Nothing further right can reach the image
+            }
+            size_t span_end = layout->spans[span + 1].start - line_offset;
+            size_t segment_end = span_end < line_len ? span_end : line_len;
+            const uint8_t *color = layout->token_colors[layout->spans[span].kind];
+            x = draw_text(band, x, layout->text_x, line_y, line + pos, segment_end - pos, layout->cache, color[0], color[1], color[2]);
+            pos = segment_end;
+            if (pos == span_end) span++;
+        }
+    }
+    band->stats.raster_seconds += now_seconds() - filled;
+}
+
+// --- Parallel Rasterization ---
+//
+// A band is cut into strips of rows that helper threads claim from a shared counter, so
+// busy threads simply take fewer strips. Strips are drawn with render_band like any other
+// band, which keeps the output byte-for-byte identical to drawing on one thread. Each helper
+// keeps its own glyph caches, warm across bands and jobs.
+
+#define RASTER_STRIP_ROWS 16 // Smallest strip handed to a thread
+#define RASTER_STRIP_LINES 2 // Strips also span at least this many lines, so few lines are drawn twice
+
+struct RasterPool {
+    pthread_t *threads;
+    RenderWorker *workers;      // Glyph caches of each helper thread
+    int thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+    unsigned long generation;   // Bumped for every band handed out
+    int busy;                   // Helpers still working on the current band
+    bool stopping;
+
+    // The band being drawn; helpers add their work to band.stats when done
+    const RenderLayout *layout;
+    Canvas band;
+    int strip_rows;
+    int strip_count;
+    atomic_int next_strip;
+};
+
+typedef struct {
+    RasterPool *pool;
+    int index;
+} RasterThread;
+
+// Function to draw strips of the pool's current band until none are left, adding up the work
+static void raster_draw_strips(RasterPool *pool, const RenderLayout *layout, DrawStats *stats) {
+    const Canvas *band = &pool->band;
+    size_t row_bytes = (size_t)band->width * CHANNELS;
+    for (;;) {
+        int strip = atomic_fetch_add(&pool->next_strip, 1);
+        if (strip >= pool->strip_count) break;
+        int first_row = strip * pool->strip_rows;
+        int rows = band->rows - first_row < pool->strip_rows ? band->rows - first_row : pool->strip_rows;
+        Canvas part = { .pixels = band->pixels + (size_t)first_row * row_bytes, .width = band->width,
+                        .y0 = band->y0 + first_row, .rows = rows };
+        render_band(layout, &part);
+        draw_stats_add(stats, &part.stats);
+    }
+}
+
+static void *raster_thread_main(void *arg) {
+    RasterThread *self = arg;
+    RasterPool *pool = self->pool;
+    RenderWorker *worker = &pool->workers[self->index];
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->generation == seen && !pool->stopping) {
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        }
+        if (pool->stopping) break;
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        // Same layout, but drawn through this thread's own glyph cache
+        RenderLayout layout = *pool->layout;
+        layout.cache = worker_glyph_cache(worker, layout.font, layout.cache->pixel_height, layout.cache->sdf != NULL);
+        DrawStats stats = {0};
+        if (layout.cache) {
+            raster_draw_strips(pool, &layout, &stats);
+        }
+        scratch_end_render(); // Each band is a render of its own on helper threads
+
+        pthread_mutex_lock(&pool->lock);
+        draw_stats_add(&pool->band.stats, &stats);
+        if (--pool->busy == 0) {
+            pthread_cond_signal(&pool->work_done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    free(self);
+    return NULL;
+}
+
+// Function to start thread_count helper threads. Returns NULL on failure.
+RasterPool *raster_pool_create(int thread_count) {
+    RasterPool *pool = calloc(1, sizeof(RasterPool));
+    if (!pool) return NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->work_done, NULL);
+    pool->threads = malloc(sizeof(pthread_t) * thread_count);
+    pool->workers = calloc(thread_count, sizeof(RenderWorker));
+    bool ok = pool->threads && pool->workers;
+    for (; ok && pool->thread_count < thread_count; ++pool->thread_count) {
+        RasterThread *self = malloc(sizeof(RasterThread));
+        if (!self) break;
+        *self = (RasterThread){ pool, pool->thread_count };
+        if (pthread_create(&pool->threads[pool->thread_count], NULL, raster_thread_main, self) != 0) {
+            free(self);
+            break;
+        }
+    }
+    if (!ok || pool->thread_count == 0) {
+        raster_pool_free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+// Function to stop the helper threads and free their glyph caches
+void raster_pool_free(RasterPool *pool) {
+    if (!pool) return;
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->thread_count; ++i) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    for (int i = 0; pool->workers && i < pool->thread_count; ++i) {
+        worker_free(&pool->workers[i]);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_cond_destroy(&pool->work_done);
+    free(pool->threads);
+    free(pool->workers);
+    free(pool);
+}
+
+// Function to add up the glyph cache counters of the helper threads
+void raster_pool_cache_stats(const RasterPool *pool, unsigned long *hits, unsigned long *misses) {
+    for (int i = 0; i < pool->thread_count; ++i) {
+        worker_cache_stats(&pool->workers[i], hits, misses);
+    }
+}
+
+// Function to draw one band with the helper threads, the calling thread taking strips too
+static void raster_pool_draw(RasterPool *pool, const RenderLayout *layout, Canvas *band) {
+    int threads = pool->thread_count + 1;
+    int strip_rows = (band->rows + threads * 4 - 1) / (threads * 4); // About four strips per thread
+    if (strip_rows < RASTER_STRIP_LINES * layout->line_step) strip_rows = RASTER_STRIP_LINES * layout->line_step;
+    if (strip_rows < RASTER_STRIP_ROWS) strip_rows = RASTER_STRIP_ROWS;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->layout = layout;
+    pool->band = *band;
+    pool->strip_rows = strip_rows;
+    pool->strip_count = (band->rows + strip_rows - 1) / strip_rows;
+    atomic_store(&pool->next_strip, 0);
+    pool->busy = pool->thread_count;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    DrawStats stats = {0};
+    raster_draw_strips(pool, layout, &stats);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy > 0) {
+        pthread_cond_wait(&pool->work_done, &pool->lock);
+    }
+    draw_stats_add(&band->stats, &pool->band.stats);
+    pthread_mutex_unlock(&pool->lock);
+    draw_stats_add(&band->stats, &stats);
+}
+
+// Where finished bands go: counted into a palette, written as they are (raw and PPM), or
+// encoded (mapped to palette indices first for indexed output)
+typedef struct {
+    PaletteBuilder *builder;
+    const ByteSink *raw_sink;
+    QoiEncoder *qoi;
+    PngEncoder *encoder;
+    const Palette *palette;
+    uint8_t *index_rows;     // Packed palette indices for one band
+    size_t index_row_bytes;
+} BandOutput;
+
+static bool output_band(BandOutput *out, const Canvas *band) {
+    size_t stride = (size_t)band->width * CHANNELS;
+    if (out->builder) {
+        palette_builder_add(out->builder, band->pixels, band->width, band->rows, stride);
+        return true;
+    }
+    if (out->raw_sink) {
+        // The whole band in one write, straight from the band buffer (stdio passes writes
+        // larger than its buffer directly to the file)
+        return out->raw_sink->write(out->raw_sink->context, band->pixels, stride * band->rows);
+    }
+    if (out->qoi) {
+        return qoi_encoder_write_pixels(out->qoi, band->pixels, (size_t)band->width * band->rows);
+    }
+    if (out->palette) {
+        for (int r = 0; r < band->rows; ++r) {
+            palette_map_row(out->palette, band->pixels + (size_t)r * stride, band->width,
+                            out->index_rows + (size_t)r * out->index_row_bytes);
+        }
+        return png_encoder_write_rows(out->encoder, out->index_rows, band->rows, out->index_row_bytes);
+    }
+    return png_encoder_write_rows(out->encoder, band->pixels, band->rows, stride);
+}
+
+// Function to draw a band, with the raster pool when there is one, and add the work to stats.
+// With several threads, the wall time of drawing is split between fill and rasterization in
+// proportion to the threads' time in each.
+static void draw_band(const RenderLayout *layout, RasterPool *raster, Canvas *band, RenderStats *stats) {
+    double start = now_seconds();
+    if (raster) {
+        raster_pool_draw(raster, layout, band);
+    } else {
+        render_band(layout, band);
+    }
+    double elapsed = now_seconds() - start;
+
+    double busy = band->stats.fill_seconds + band->stats.raster_seconds;
+    double fill_share = busy > 0 ? band->stats.fill_seconds / busy : 0.0;
+    stats->fill_seconds += elapsed * fill_share;
+    stats->raster_seconds += elapsed * (1.0 - fill_share);
+    stats->glyphs_drawn += band->stats.glyphs;
+    stats->pixels_blended += band->stats.pixels;
+}
+
+// Function to render the image top to bottom, reusing one band buffer of band_rows rows.
+// With a raster pool, each band is drawn by several threads.
+static bool render_image(const RenderLayout *layout, RasterPool *raster, uint8_t *band_pixels, int band_rows,
+                         BandOutput *out, RenderStats *stats) {
+    for (int y0 = 0; y0 < layout->height; y0 += band_rows) {
+        Canvas band = { .pixels = band_pixels, .width = layout->width, .y0 = y0,
+                        .rows = layout->height - y0 < band_rows ? layout->height - y0 : band_rows };
+        draw_band(layout, raster, &band, stats);
+        double start = now_seconds();
+        bool ok = output_band(out, &band);
+        stats->encode_seconds += now_seconds() - start;
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Everything an image is drawn from. The layout points into the other fields and into the
+// code it was made for, so a plan must stay in place while it is used.
+typedef struct {
+    RenderLayout layout;
+    LineIndex lines;
+    TokenSpans spans;
+    const LanguageSpec *language;
+    uint8_t *bg_row;     // Plain background row, followed by the row with the code block across it
+} RenderPlan;
+
+// Function to size the image of a job: measured from its lines unless the job overrides it
+static void render_image_size(const RenderJob *job, const LineIndex *lines, const GlyphCache *cache,
+                              int *out_width, int *out_height) {
+    float scale = job_scale(job);
+    int calculated_img_width, calculated_img_height;
+    get_code_dimensions(lines, cache, RENDER_LINE_SPACING, (int)(RENDER_PADDING * scale), &calculated_img_width, &calculated_img_height);
+
+    // Use user-provided dimensions if available, otherwise use calculated ones
+    int img_width = (job->width > 0) ? (int)(job->width * scale) : calculated_img_width;
+    int img_height = (job->height > 0) ? (int)(job->height * scale) : calculated_img_height;
+
+    // Ensure minimums if calculated dimensions are too small or user provides tiny ones
+    if (img_width < (int)(200 * scale)) img_width = (int)(200 * scale);
+    if (img_height < (int)(100 * scale)) img_height = (int)(100 * scale);
+    *out_width = img_width;
+    *out_height = img_height;
+}
+
+void render_plan_free(RenderPlan *plan) {
+    free(plan->bg_row);
+    token_spans_free(&plan->spans);
+    line_index_free(&plan->lines);
+    memset(plan, 0, sizeof(*plan));
+}
+
+// Function to load the font, lay out and highlight code_size bytes of code, and build the
+// background rows. Returns 0 on success; times are added to stats.
+int render_plan_init(RenderPlan *plan, const char *code_content, size_t code_size,
+                     const RenderJob *job, RenderWorker *worker, RenderStats *stats) {
+    memset(plan, 0, sizeof(*plan));
+    double phase_start = now_seconds();
+
+    // --- 1. Font Loading Setup (needed for dimension calculation and drawing) ---
+    RenderContext *context = worker->context;
+    const char *font_to_load_path = context_font_path(context, job->font_name); // Defaults to the first discovered font
+    if (!font_to_load_path) {
+        if (job->font_name == NULL) {
+            fprintf(stderr, "Error: No fonts found in 'Fonts/' directory. Cannot proceed without a font.\n");
+        } else {
+            fprintf(stderr, "Error: Specified font '%s' not found.\n", job->font_name);
+        }
+        return 1;
+    }
+
+    LoadedFont *font = load_font(&context->loaded, font_to_load_path);
+    if (!font) {
+        return 1;
+    }
+    GlyphCache *glyph_cache = worker_glyph_cache(worker, font, job_pixel_height(job), job->sdf);
+    if (!glyph_cache) {
+        fprintf(stderr, "Failed to allocate glyph cache memory!\n");
+        return 1;
+    }
+    float scale = glyph_cache->scale;
+    double phase_end = now_seconds();
+    stats->font_load_seconds += phase_end - phase_start;
+    phase_start = phase_end;
+
+    // --- Determine Image Dimensions ---
+    // One pass indexes the lines and measures them; drawing reuses the index
+    if (!build_line_index(code_content, code_size, glyph_cache, &plan->lines)) {
+        fprintf(stderr, "Error: Could not index the input (out of memory or larger than 4 GB).\n");
+        return 1;
+    }
+    int img_width, img_height;
+    render_image_size(job, &plan->lines, glyph_cache, &img_width, &img_height);
+
+    if (img_width > RENDER_MAX_WIDTH) {
+        fprintf(stderr, "Error: Image width %d exceeds the maximum of %d pixels.\n", img_width, RENDER_MAX_WIDTH);
+        render_plan_free(plan);
+        return 1;
+    }
+
+
+    // --- 2. Define Colors (Dracula-like theme for this example) ---
+    uint8_t bg_r, bg_g, bg_b;
+    uint8_t code_bg_r, code_bg_g, code_bg_b;
+    uint8_t default_text_r, default_text_g, default_text_b;
+    uint8_t comment_r, comment_g, comment_b;
+    uint8_t keyword_r, keyword_g, keyword_b;
+    uint8_t function_r, function_g, function_b;
+    uint8_t string_r, string_g, string_b;
+    uint8_t literal_r, literal_g, literal_b;
+
+    const Theme *theme = &context->theme;
+    hex_to_rgb(theme->background, &bg_r, &bg_g, &bg_b);
+    hex_to_rgb(theme->code_background, &code_bg_r, &code_bg_g, &code_bg_b);
+    hex_to_rgb(theme->text, &default_text_r, &default_text_g, &default_text_b);
+    hex_to_rgb(theme->comment, &comment_r, &comment_g, &comment_b);
+    hex_to_rgb(theme->keyword, &keyword_r, &keyword_g, &keyword_b);
+    hex_to_rgb(theme->function, &function_r, &function_g, &function_b);
+    hex_to_rgb(theme->string, &string_r, &string_g, &string_b);
+    hex_to_rgb(theme->literal, &literal_r, &literal_g, &literal_b);
+
+    // Split the code into colored token spans once, before any band is drawn
+    plan->language = job->language ? find_language(job->language) : language_for_path(job->input_path);
+    if (!plan->language) {
+        fprintf(stderr, "Error: Unknown language '%s'.\n", job->language);
+        render_plan_free(plan);
+        return 1;
+    }
+    if (!highlight_code(plan->language, code_content, code_size, &plan->spans)) {
+        fprintf(stderr, "Error: Could not highlight the input (out of memory or larger than 4 GB).\n");
+        render_plan_free(plan);
+        return 1;
+    }
+
+
+    // --- 3. Background Rows ---
+    // Every row is either plain background or background with the code block across it,
+    // so both are built once and copied into each band.
+    int padding = (int)(RENDER_PADDING * job_scale(job));
+    int code_block_x = padding;
+    int code_block_y = padding;
+    int code_block_width = img_width - 2 * padding;
+    int code_block_height = img_height - 2 * padding;
+
+    size_t row_bytes = (size_t)img_width * CHANNELS;
+    uint8_t *bg_row = malloc(row_bytes * 2);
+    if (!bg_row) {
+        fprintf(stderr, "Failed to allocate pixel buffer memory!\n");
+        render_plan_free(plan);
+        return 1;
+    }
+    plan->bg_row = bg_row;
+    uint8_t *code_row = bg_row + row_bytes;
+    for (int x = 0; x < img_width; ++x) {
+        bool in_code_block = x >= code_block_x && x < code_block_x + code_block_width;
+        bg_row[x * CHANNELS + 0] = bg_r;
+        bg_row[x * CHANNELS + 1] = bg_g;
+        bg_row[x * CHANNELS + 2] = bg_b;
+        code_row[x * CHANNELS + 0] = in_code_block ? code_bg_r : bg_r;
+        code_row[x * CHANNELS + 1] = in_code_block ? code_bg_g : bg_g;
+        code_row[x * CHANNELS + 2] = in_code_block ? code_bg_b : bg_b;
+    }
+
+    // --- 4. Line Layout ---
+    // Recalculate true line height for drawing, using ascent/descent directly
+    int ascent_draw, descent_draw, lineGap_draw;
+    stbtt_GetFontVMetrics(&font->info, &ascent_draw, &descent_draw, &lineGap_draw);
+    float actual_font_line_height = (ascent_draw - descent_draw + lineGap_draw) * scale * RENDER_LINE_SPACING;
+
+    // The font bounding box bounds every glyph bitmap (one pixel of slack for rounding)
+    int box_x0, box_y0, box_x1, box_y1;
+    stbtt_GetFontBoundingBox(&font->info, &box_x0, &box_y0, &box_x1, &box_y1);
+
+    plan->layout = (RenderLayout){
+        .code = code_content,
+        .lines = &plan->lines,
+        .font = font,
+        .cache = glyph_cache,
+        .width = img_width,
+        .height = img_height,
+        .code_block_y = code_block_y,
+        .code_block_height = code_block_height,
+        .text_x = code_block_x + (int)(10 * job_scale(job)),
+        .first_line_y = code_block_y + (int)(job_pixel_height(job) * 0.25), // Small offset for first line from top padding
+        .line_step = (int)actual_font_line_height,
+        .ink_top = glyph_cache->baseline + (int)floorf(-box_y1 * scale) - 1,
+        .ink_bottom = glyph_cache->baseline + (int)ceilf(-box_y0 * scale) + 1,
+        .ink_left = (int)floorf(box_x0 * scale) - 1,
+        .spans = plan->spans.spans,
+        .span_count = plan->spans.count,
+        .token_colors = {
+            [TOKEN_DEFAULT] = { default_text_r, default_text_g, default_text_b },
+            [TOKEN_COMMENT] = { comment_r, comment_g, comment_b },
+            [TOKEN_KEYWORD] = { keyword_r, keyword_g, keyword_b },
+            [TOKEN_FUNCTION] = { function_r, function_g, function_b },
+            [TOKEN_STRING] = { string_r, string_g, string_b },
+            [TOKEN_LITERAL] = { literal_r, literal_g, literal_b },
+        },
+        .bg_row = bg_row,
+        .code_row = code_row,
+    };
+    stats->layout_seconds += now_seconds() - phase_start;
+    return 0;
+}
+
+// Function to get the worker's helper threads for drawing with raster_threads threads,
+// starting them if needed. Returns NULL when drawing stays on the calling thread.
+static RasterPool *worker_raster_pool(RenderWorker *worker, int raster_threads) {
+    if (raster_threads <= 1) {
+        return NULL;
+    }
+    if (worker->raster && worker->raster->thread_count != raster_threads - 1) {
+        raster_pool_free(worker->raster);
+        worker->raster = NULL;
+    }
+    if (!worker->raster) {
+        worker->raster = raster_pool_create(raster_threads - 1); // The rendering thread draws too
+        if (!worker->raster) {
+            log_message(LOG_WARN, "Could not start drawing threads; drawing on one thread");
+        }
+    }
+    return worker->raster;
+}
+
+// Function to choose the band height for drawing a layout, and the raster pool drawing it (NULL
+// for the calling thread alone)
+static int render_band_rows(const RenderJob *job, const RenderLayout *layout, RenderWorker *worker,
+                            RasterPool **out_raster) {
+    size_t row_bytes = (size_t)layout->width * CHANNELS;
+    int band_rows = (int)(RENDER_BAND_BYTES / row_bytes);
+    if (band_rows < 1) band_rows = 1;
+
+    // Drawing in parallel needs a few strips per thread in every band; the band may grow to
+    // RENDER_BAND_BYTES per thread to get them
+    *out_raster = NULL;
+    int raster_threads = job->raster_threads;
+    if (raster_threads > 1 && layout->height >= 2 * RASTER_STRIP_ROWS) {
+        int strip_rows = (int)(job_pixel_height(job) * 2 * RASTER_STRIP_LINES); // Lines are about 2x the font size
+        if (strip_rows < RASTER_STRIP_ROWS) strip_rows = RASTER_STRIP_ROWS;
+        int wanted_rows = raster_threads * 4 * strip_rows;
+        int max_rows = (int)((RENDER_BAND_BYTES * (size_t)raster_threads) / row_bytes);
+        if (band_rows < wanted_rows) band_rows = wanted_rows < max_rows ? wanted_rows : max_rows;
+        if (band_rows < 1) band_rows = 1;
+        *out_raster = worker_raster_pool(worker, raster_threads); // Drawing falls back to one thread if the pool could not start
+    }
+    return band_rows < layout->height ? band_rows : layout->height;
+}
+
+// Function to draw code_size bytes of code into pixels, which must hold the whole image of
+// width x height packed rows. Returns 0 on success.
+int render_pixels(const char *code_content, size_t code_size, const RenderJob *job, RenderWorker *worker,
+                  uint8_t *pixels, int width, int height) {
+    RenderStats stats = {0};
+    RenderPlan plan;
+    if (render_plan_init(&plan, code_content, code_size, job, worker, &stats) != 0) {
+        return 1;
+    }
+    const RenderLayout *layout = &plan.layout;
+    if (layout->width != width || layout->height != height) {
+        fprintf(stderr, "Error: Pixel buffer is %dx%d, but the image is %dx%d.\n", width, height, layout->width, layout->height);
+        render_plan_free(&plan);
+        return 1;
+    }
+    RasterPool *raster;
+    int band_rows = render_band_rows(job, layout, worker, &raster);
+    size_t row_bytes = (size_t)width * CHANNELS;
+    for (int y0 = 0; y0 < height; y0 += band_rows) {
+        Canvas band = { .pixels = pixels + (size_t)y0 * row_bytes, .width = width, .y0 = y0,
+                        .rows = height - y0 < band_rows ? height - y0 : band_rows };
+        draw_band(layout, raster, &band, &stats);
+    }
+    render_plan_free(&plan);
+    scratch_end_render();
+    save_glyph_files(&worker->context->loaded);
+    stats.images = 1;
+    render_stats_add(&worker->stats, &stats);
+    return 0;
+}
+
+bool output_cache_key(const RenderContext *context, const RenderJob *job, const char *code, size_t code_size, char *key);
+bool output_cache_fetch(OutputCache *cache, const RenderJob *job, const char *key, uint64_t *out_bytes);
+void output_cache_store(OutputCache *cache, const char *key, const char *path, const uint8_t *image, size_t size);
+
+// Function to render code_size bytes of code into a PNG file, buffer or sink. Returns 0 on success.
+int render_code(const char *code_content, size_t code_size, const RenderJob *job, RenderWorker *worker) {
+    RenderStats stats = {0};
+    size_t buffer_start = job->output_buffer ? job->output_buffer->size : 0;
+
+    // A cached image skips loading the font and drawing altogether
+    char cache_key[OUTPUT_CACHE_KEY_SIZE];
+    bool to_stdout = !job->output_sink && !job->output_buffer && is_stdout_path(job->output_path);
+    bool cacheable = job->cache && !job->output_sink && output_cache_key(worker->context, job, code_content, code_size, cache_key);
+    if (cacheable && output_cache_fetch(job->cache, job, cache_key, &stats.bytes_written)) {
+        stats.images = 1;
+        stats.cache_hits = 1;
+        render_stats_add(&worker->stats, &stats);
+        return 0;
+    }
+
+    RenderPlan plan;
+    if (render_plan_init(&plan, code_content, code_size, job, worker, &stats) != 0) {
+        return 1;
+    }
+    const RenderLayout *layout = &plan.layout;
+    int img_width = layout->width;
+    int img_height = layout->height;
+
+    size_t row_bytes = (size_t)img_width * CHANNELS;
+    RasterPool *raster;
+    int band_rows = render_band_rows(job, layout, worker, &raster);
+
+    uint8_t *band_pixels = malloc(row_bytes * band_rows);
+    if (!band_pixels) {
+        fprintf(stderr, "Failed to allocate pixel buffer memory!\n");
+        render_plan_free(&plan);
+        return 1;
+    }
+
+
+    // --- 5. Render and Encode Band by Band ---
+    OutputFormat format = job_format(job);
+    FILE *out_file = NULL;
+    ByteSink sink;
+    if (job->output_sink) {
+        sink = *job->output_sink;
+    } else if (job->output_buffer) {
+        sink = buffer_sink(job->output_buffer);
+    } else if (to_stdout) {
+        sink = file_sink(stdout);
+    } else {
+        out_file = fopen(job->output_path, "wb");
+        if (!out_file) {
+            fprintf(stderr, "Failed to write %s file '%s'!\n", output_format_label(format), job->output_path);
+            free(band_pixels);
+            render_plan_free(&plan);
+            return 1;
+        }
+        sink = file_sink(out_file);
+    }
+
+    bool ok = true;
+    double phase_start;
+    Palette palette;
+    BandOutput output = {0};
+    PngOptions options = { .width = img_width, .height = img_height, .color_type = PNG_COLOR_RGB,
+                           .bit_depth = 8, .level = job->png_level, .threads = job->png_threads };
+    if (job->palette && format == OUTPUT_PNG) {
+        // First pass only counts colors, so the palette is known before any row is written
+        PaletteBuilder builder;
+        ok = palette_builder_init(&builder);
+        BandOutput counting = { .builder = &builder };
+        ok = ok && render_image(layout, raster, band_pixels, band_rows, &counting, &stats);
+        phase_start = now_seconds();
+        ok = ok && palette_finish(&builder, &palette);
+        palette_builder_free(&builder);
+        if (ok) {
+            options.color_type = PNG_COLOR_PALETTE;
+            options.bit_depth = palette.bit_depth;
+            options.palette = palette.colors;
+            options.palette_size = palette.count;
+            output.palette = &palette;
+            output.index_row_bytes = ((size_t)img_width * palette.bit_depth + 7) / 8;
+            output.index_rows = malloc(output.index_row_bytes * band_rows);
+            ok = output.index_rows != NULL;
+        }
+        stats.encode_seconds += now_seconds() - phase_start;
+    }
+    if (ok && format == OUTPUT_QOI) {
+        QoiEncoder qoi;
+        output.qoi = &qoi;
+        ok = qoi_encoder_begin(&qoi, img_width, img_height, sink) &&
+             render_image(layout, raster, band_pixels, band_rows, &output, &stats);
+        ok = qoi_encoder_finish(&qoi, &stats.bytes_written) && ok;
+    } else if (ok && (format == OUTPUT_PPM || format == OUTPUT_RAW)) {
+        size_t header_size = format == OUTPUT_PPM ? ppm_write_header(sink, img_width, img_height) : 0;
+        output.raw_sink = &sink;
+        ok = (format == OUTPUT_RAW || header_size > 0) &&
+             render_image(layout, raster, band_pixels, band_rows, &output, &stats);
+        stats.bytes_written = header_size + row_bytes * img_height;
+        if (format == OUTPUT_RAW) {
+            log_message(LOG_INFO, "Raw image is %dx%d RGB, %zu bytes per row.", img_width, img_height, row_bytes);
+        }
+    } else if (ok) {
+        output.encoder = png_encoder_begin(&options, sink);
+        ok = output.encoder && render_image(layout, raster, band_pixels, band_rows, &output, &stats);
+        phase_start = now_seconds();
+        ok = png_encoder_finish(output.encoder, &stats.bytes_written) && ok;
+        stats.encode_seconds += now_seconds() - phase_start;
+    }
+    if (output.palette) {
+        palette_free(&palette);
+    }
+    free(output.index_rows);
+    free(band_pixels);
+    render_plan_free(&plan);
+
+    int result = 0;
+    if (out_file && fclose(out_file) != 0) ok = false;
+    if (to_stdout && fflush(stdout) != 0) ok = false;
+    if (!ok) {
+        if (out_file) {
+            fprintf(stderr, "Failed to write %s file '%s'!\n", output_format_label(format), job->output_path);
+            remove(job->output_path);
+        } else if (to_stdout) {
+            fprintf(stderr, "Failed to write %s image to standard output!\n", output_format_label(format));
+        } else {
+            fprintf(stderr, "Failed to encode %s image!\n", output_format_label(format));
+        }
+        result = 1;
+    } else {
+        stats.images = 1;
+        if (cacheable && job->output_buffer) {
+            output_cache_store(job->cache, cache_key, NULL, job->output_buffer->data + buffer_start,
+                               job->output_buffer->size - buffer_start);
+        } else if (cacheable && !to_stdout) {
+            output_cache_store(job->cache, cache_key, job->output_path, NULL, 0);
+        }
+    }
+    scratch_end_render();
+    save_glyph_files(&worker->context->loaded);
+    render_stats_add(&worker->stats, &stats);
+    return result;
+}
+
+// Function to load a job's input file and render it. Returns 0 on success.
+int render_job(const RenderJob *job, RenderWorker *worker, size_t *out_input_size) {
+    size_t code_content_size = 0;
+    char *code_content = load_file(job->input_path, &code_content_size);
+    if (!code_content) {
+        fprintf(stderr, "Error: Could not read input file '%s'.\n", job->input_path);
+        return 1;
+    }
+    if (out_input_size) *out_input_size = code_content_size;
+
+    int result = render_code(code_content, code_content_size, job, worker);
+    free(code_content);
+    return result;
+}
+
+// --- Output Cache ---
+//
+// With --cache, finished PNGs are kept in a directory, named by a 128-bit hash of everything
+// that decides their bytes: the input, the resolved font file and its modification time, font
+// size, size overrides, language, PNG options, theme and the cache version. A render whose
+// key is present copies the stored file instead of loading the font or drawing anything.
+// Entries and outputs are written under a temporary name and renamed into place, so processes
+// sharing the directory never see partial files. Hits refresh an entry's modification time;
+// once the directory grows past its size cap, the least recently used entries are deleted.
+
+#define OUTPUT_CACHE_DEFAULT_MB 256
+#define OUTPUT_CACHE_VERSION 1   // Bump whenever the same options can render different bytes
+#define OUTPUT_CACHE_SUFFIX ".img" // Entries can be PNG, QOI, PPM or raw; the format is in the key
+#define OUTPUT_CACHE_LOW_WATER 0.9               // Eviction stops at this fraction of the cap
+
+struct OutputCache {
+    char dir[PATH_MAX];
+    uint64_t max_bytes;
+    pthread_mutex_t lock;
+    uint64_t known_bytes;    // Directory size at the last scan, plus what this process stored since
+    bool scanned;
+};
+
+// A file of the cache directory, for eviction
+typedef struct {
+    char name[OUTPUT_CACHE_KEY_SIZE + sizeof(OUTPUT_CACHE_SUFFIX) - 1];
+    uint64_t size;
+    struct timespec mtime;
+} OutputCacheEntry;
+
+static atomic_uint temp_file_counter;
+
+#define HASH_PRIME1 0x9e3779b185ebca87ull
+#define HASH_PRIME2 0xc2b2ae3d27d4eb4full
+
+static inline uint64_t hash_round(uint64_t lane, uint64_t value) {
+    lane += value * HASH_PRIME2;
+    lane = (lane << 31) | (lane >> 33);
+    return lane * HASH_PRIME1;
+}
+
+static inline uint64_t hash_finish(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    return h ^ (h >> 33);
+}
+
+// Function to hash bytes into 64 bits, 32 bytes per step in four independent lanes
+static uint64_t hash_bytes64(const void *data, size_t size, uint64_t seed) {
+    const uint8_t *p = data;
+    uint64_t lanes[4] = { seed + HASH_PRIME1 + HASH_PRIME2, seed + HASH_PRIME2, seed, seed - HASH_PRIME1 };
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        for (int lane = 0; lane < 4; ++lane) {
+            uint64_t value;
+            memcpy(&value, p + i + lane * 8, 8);
+            lanes[lane] = hash_round(lanes[lane], value);
+        }
+    }
+    uint64_t h = size;
+    for (int lane = 0; lane < 4; ++lane) {
+        h = hash_finish(h ^ lanes[lane]);
+    }
+    for (; i + 8 <= size; i += 8) {
+        uint64_t value;
+        memcpy(&value, p + i, 8);
+        h = hash_round(h, value);
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, p + i, size - i);
+    return hash_finish(hash_round(h, tail ^ (size - i)));
+}
+
+// Function to write a whole file under a temporary name, then rename it over path
+static bool write_file_atomic(const char *path, const void *data, size_t size) {
+    char temp_path[PATH_MAX + 64];
+    snprintf(temp_path, sizeof(temp_path), "%s.%ld.%u.tmp", path, (long)getpid(), atomic_fetch_add(&temp_file_counter, 1));
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    bool ok = write_all(fd, data, size);
+    ok = (close(fd) == 0) && ok;
+    if (!ok || rename(temp_path, path) != 0) {
+        unlink(temp_path);
+        return false;
+    }
+    return true;
+}
+
+// Function to open the cache in dir, or in the tool's cache directory when dir is NULL
+bool output_cache_open(OutputCache *cache, const char *dir, uint64_t max_bytes) {
+    memset(cache, 0, sizeof(*cache));
+    if (dir) {
+        snprintf(cache->dir, sizeof(cache->dir), "%s", dir);
+    } else {
+        char base[1024];
+        if (!cache_directory(base, sizeof(base))) return false;
+        snprintf(cache->dir, sizeof(cache->dir), "%s/renders", base);
+    }
+    if (mkdir(cache->dir, 0755) != 0 && errno != EEXIST) return false;
+    cache->max_bytes = max_bytes;
+    pthread_mutex_init(&cache->lock, NULL);
+    return true;
+}
+
+void output_cache_close(OutputCache *cache) {
+    pthread_mutex_destroy(&cache->lock);
+}
+
+// Function to compute the key of rendering code_size bytes of code with a job into key
+// (OUTPUT_CACHE_KEY_SIZE bytes). Returns false when the font cannot be found.
+bool output_cache_key(const RenderContext *context, const RenderJob *job, const char *code, size_t code_size, char *key) {
+    const char *font_path = context_font_path(context, job->font_name);
+    struct stat font_stat;
+    if (!font_path || stat(font_path, &font_stat) != 0) {
+        return false;
+    }
+    const LanguageSpec *language = job->language ? find_language(job->language) : language_for_path(job->input_path);
+    const Theme *theme = &context->theme;
+
+    char params[PATH_MAX + 1024];
+    int length = snprintf(params, sizeof(params),
+                          "%d\n%s %lld.%09ld %lld\n%.4f %.4f %d %d %d %d %d %d\n%s\n%s %s %s %s %s %s %s %s\n%s\n",
+                          OUTPUT_CACHE_VERSION, font_path, (long long)font_stat.st_mtim.tv_sec,
+                          (long)font_stat.st_mtim.tv_nsec, (long long)font_stat.st_size,
+                          job->font_pixel_height, job_scale(job), job->width, job->height, job->png_level,
+                          job->palette, job->sdf, job_format(job),
+                          language ? language->name : "",
+                          theme->background, theme->code_background, theme->text, theme->comment,
+                          theme->keyword, theme->function, theme->string, theme->literal,
+                          context->fallback.spec ? context->fallback.spec : "");
+    if (length < 0 || (size_t)length >= sizeof(params)) {
+        return false;
+    }
+    uint64_t seed = hash_bytes64(params, (size_t)length, 0);
+    snprintf(key, OUTPUT_CACHE_KEY_SIZE, "%016llx%016llx",
+             (unsigned long long)hash_bytes64(code, code_size, seed),
+             (unsigned long long)hash_bytes64(code, code_size, ~seed));
+    return true;
+}
+
+// Function to copy the entry for key to the job's output. Returns false on a miss.
+bool output_cache_fetch(OutputCache *cache, const RenderJob *job, const char *key, uint64_t *out_bytes) {
+    char path[PATH_MAX + 64];
+    snprintf(path, sizeof(path), "%s/%s" OUTPUT_CACHE_SUFFIX, cache->dir, key);
+    size_t size = 0;
+    char *image = load_file(path, &size);
+    if (!image) {
+        return false;
+    }
+    bool ok = job->output_buffer                 ? byte_buffer_append(job->output_buffer, image, size)
+              : is_stdout_path(job->output_path) ? fwrite(image, 1, size, stdout) == size && fflush(stdout) == 0
+                                                 : write_file_atomic(job->output_path, image, size);
+    free(image);
+    if (ok) {
+        utimensat(AT_FDCWD, path, NULL, 0); // Most recently used now
+        *out_bytes = size;
+        log_message(LOG_DEBUG, "Output cache hit: %s", key);
+    }
+    return ok;
+}
+
+static int compare_entries_by_mtime(const void *a, const void *b) {
+    const OutputCacheEntry *x = a, *y = b;
+    if (x->mtime.tv_sec != y->mtime.tv_sec) return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+    if (x->mtime.tv_nsec != y->mtime.tv_nsec) return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 : 1;
+    return 0;
+}
+
+// Function to measure the cache directory and, if it is over the cap, delete the least
+// recently used entries. Only one process evicts at a time; the others skip it.
+static void output_cache_evict(OutputCache *cache) {
+    char lock_path[PATH_MAX + 16];
+    snprintf(lock_path, sizeof(lock_path), "%s/.lock", cache->dir);
+    int lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock_fd < 0) return;
+    if (flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+        close(lock_fd);
+        return;
+    }
+
+    OutputCacheEntry *entries = NULL;
+    size_t count = 0, capacity = 0;
+    uint64_t total = 0;
+    DIR *dir = opendir(cache->dir);
+    struct dirent *item;
+    while (dir && (item = readdir(dir)) != NULL) {
+        size_t length = strlen(item->d_name);
+        size_t suffix_length = strlen(OUTPUT_CACHE_SUFFIX);
+        if (length != OUTPUT_CACHE_KEY_SIZE - 1 + suffix_length ||
+            strcmp(item->d_name + length - suffix_length, OUTPUT_CACHE_SUFFIX) != 0) continue;
+        struct stat st;
+        if (fstatat(dirfd(dir), item->d_name, &st, 0) != 0) continue; // Evicted by someone else meanwhile
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            OutputCacheEntry *grown = realloc(entries, sizeof(OutputCacheEntry) * capacity);
+            if (!grown) break;
+            entries = grown;
+        }
+        OutputCacheEntry *entry = &entries[count++];
+        memcpy(entry->name, item->d_name, length + 1);
+        entry->size = (uint64_t)st.st_size;
+        entry->mtime = st.st_mtim;
+        total += entry->size;
+    }
+    if (dir) closedir(dir);
+
+    if (total > cache->max_bytes) {
+        qsort(entries, count, sizeof(OutputCacheEntry), compare_entries_by_mtime);
+        uint64_t target = (uint64_t)(cache->max_bytes * OUTPUT_CACHE_LOW_WATER);
+        size_t evicted = 0;
+        for (size_t i = 0; i < count && total > target; ++i, ++evicted) {
+            char path[PATH_MAX + 64];
+            snprintf(path, sizeof(path), "%s/%s", cache->dir, entries[i].name);
+            unlink(path);
+            total -= entries[i].size;
+        }
+        log_message(LOG_DEBUG, "Output cache: evicted %zu entries", evicted);
+    }
+    cache->known_bytes = total;
+    free(entries);
+    flock(lock_fd, LOCK_UN);
+    close(lock_fd);
+}
+
+// Function to store a finished image under key: the file at path, or size bytes of image
+void output_cache_store(OutputCache *cache, const char *key, const char *path, const uint8_t *image, size_t size) {
+    char entry_path[PATH_MAX + 64];
+    snprintf(entry_path, sizeof(entry_path), "%s/%s" OUTPUT_CACHE_SUFFIX, cache->dir, key);
+    char *file = NULL;
+    if (path) {
+        file = load_file(path, &size);
+        image = (const uint8_t *)file;
+    }
+    bool ok = image && write_file_atomic(entry_path, image, size);
+    free(file);
+    if (!ok) {
+        log_message(LOG_WARN, "Could not store '%s' in the output cache", entry_path);
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    cache->known_bytes += size;
+    if (!cache->scanned || cache->known_bytes > cache->max_bytes) {
+        output_cache_evict(cache);
+        cache->scanned = true;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// --- Batch Mode ---
+
+typedef struct {
+    RenderContext *context;
+    RenderJob *jobs;
+    int job_count;
+    atomic_int next_job;    // Index of the next job to hand out
+    atomic_int failed;
+    atomic_size_t input_bytes;
+    atomic_ulong cache_hits;
+    atomic_ulong cache_misses;
+    pthread_mutex_t stats_lock;
+    RenderStats stats;      // Totals of all workers, added when each one finishes
+} BatchQueue;
+
+// Worker thread: pull jobs off the shared queue until it is empty
+static void *batch_worker_main(void *arg) {
+    BatchQueue *queue = arg;
+    RenderWorker worker = { .context = queue->context };
+
+    for (;;) {
+        int index = atomic_fetch_add(&queue->next_job, 1);
+        if (index >= queue->job_count) break;
+
+        const RenderJob *job = &queue->jobs[index];
+        size_t input_size = 0;
+        double start = now_seconds();
+        int result = render_job(job, &worker, &input_size);
+        double elapsed_ms = (now_seconds() - start) * 1000.0;
+
+        if (result == 0) {
+            printf("[%d/%d] ok      %s -> %s (%.1f ms)\n", index + 1, queue->job_count, job->input_path, job->output_path, elapsed_ms);
+            atomic_fetch_add(&queue->input_bytes, input_size);
+        } else {
+            printf("[%d/%d] FAILED  %s -> %s\n", index + 1, queue->job_count, job->input_path, job->output_path);
+            atomic_fetch_add(&queue->failed, 1);
+        }
+    }
+
+    unsigned long hits = 0, misses = 0;
+    worker_cache_stats(&worker, &hits, &misses);
+    atomic_fetch_add(&queue->cache_hits, hits);
+    atomic_fetch_add(&queue->cache_misses, misses);
+    pthread_mutex_lock(&queue->stats_lock);
+    render_stats_add(&queue->stats, &worker.stats);
+    pthread_mutex_unlock(&queue->stats_lock);
+    worker_free(&worker);
+    return NULL;
+}
+
+// Function to render every job on a pool of worker threads. Returns the number of failures.
+// The statistics of all renders are added to *stats when it is not NULL.
+int run_batch(RenderContext *context, RenderJob *jobs, int job_count, int thread_count, RenderStats *stats) {
+    BatchQueue queue = { .context = context, .jobs = jobs, .job_count = job_count };
+    pthread_mutex_init(&queue.stats_lock, NULL);
+    atomic_init(&queue.next_job, 0);
+    atomic_init(&queue.failed, 0);
+    atomic_init(&queue.input_bytes, 0);
+    atomic_init(&queue.cache_hits, 0);
+    atomic_init(&queue.cache_misses, 0);
+
+    if (thread_count > job_count) thread_count = job_count;
+    if (thread_count < 1) thread_count = 1;
+
+    double start = now_seconds();
+    pthread_t *threads = malloc(sizeof(pthread_t) * thread_count);
+    int started = 0;
+    if (threads) {
+        for (; started < thread_count; ++started) {
+            if (pthread_create(&threads[started], NULL, batch_worker_main, &queue) != 0) break;
+        }
+    }
+    if (started == 0) {
+        batch_worker_main(&queue); // Fall back to rendering on this thread
+    }
+    for (int i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    double elapsed = now_seconds() - start;
+
+    int failed = atomic_load(&queue.failed);
+    size_t input_bytes = atomic_load(&queue.input_bytes);
+    printf("Rendered %d/%d images in %.2f s with %d threads (%.1f images/s, %.2f MB/s of source)\n",
+           job_count - failed, job_count, elapsed, started > 0 ? started : 1,
+           elapsed > 0 ? (job_count - failed) / elapsed : 0.0,
+           elapsed > 0 ? input_bytes / elapsed / (1024.0 * 1024.0) : 0.0);
+    log_message(LOG_DEBUG, "Glyph cache: %lu hits, %lu misses",
+                atomic_load(&queue.cache_hits), atomic_load(&queue.cache_misses));
+    if (stats) {
+        render_stats_add(stats, &queue.stats);
+    }
+    pthread_mutex_destroy(&queue.stats_lock);
+    return failed;
+}
+
+// Function to append a job to a growable array
+static bool push_job(RenderJob **jobs, int *count, int *capacity, RenderJob job) {
+    if (*count >= *capacity) {
+        int new_capacity = *capacity == 0 ? 16 : *capacity * 2;
+        RenderJob *grown = realloc(*jobs, sizeof(RenderJob) * new_capacity);
+        if (!grown) return false;
+        *jobs = grown;
+        *capacity = new_capacity;
+    }
+    (*jobs)[(*count)++] = job;
+    return true;
+}
+
+// Function to parse a batch manifest. Each non-empty line that does not start with '#' is
+//   INPUT OUTPUT [FONT [SIZE]]
+// separated by whitespace; missing or "-" fields fall back to the command-line defaults.
+// The returned jobs point into *out_text, which the caller frees after the batch.
+RenderJob *load_manifest(const char *path, const RenderJob *defaults, int *out_count, char **out_text) {
+    char *text = load_file(path, NULL);
+    if (!text) {
+        fprintf(stderr, "Error: Could not read manifest '%s'.\n", path);
+        return NULL;
+    }
+
+    RenderJob *jobs = NULL;
+    int count = 0, capacity = 0;
+    int line_number = 0;
+    char *save_line = NULL;
+    for (char *line = strtok_r(text, "\n", &save_line); line; line = strtok_r(NULL, "\n", &save_line)) {
+        line_number++;
+        char *fields[4] = {0};
+        int field_count = 0;
+        char *save_field = NULL;
+        for (char *field = strtok_r(line, " \t\r", &save_field); field && field_count < 4;
+             field = strtok_r(NULL, " \t\r", &save_field)) {
+            fields[field_count++] = field;
+        }
+        if (field_count == 0 || fields[0][0] == '#') continue;
+        if (field_count < 2) {
+            fprintf(stderr, "Error: %s:%d: expected 'INPUT OUTPUT [FONT [SIZE]]'.\n", path, line_number);
+            free(jobs);
+            free(text);
+            return NULL;
+        }
+
+        RenderJob job = *defaults;
+        job.input_path = fields[0];
+        job.output_path = fields[1];
+        if (is_stdout_path(job.output_path)) {
+            fprintf(stderr, "Error: %s:%d: batch outputs must be files, not '-'.\n", path, line_number);
+            free(jobs);
+            free(text);
+            return NULL;
+        }
+        if (fields[2] && strcmp(fields[2], "-") != 0) job.font_name = fields[2];
+        if (fields[3] && strcmp(fields[3], "-") != 0) {
+            job.font_pixel_height = atof(fields[3]);
+            if (job.font_pixel_height <= 0) {
+                fprintf(stderr, "Error: %s:%d: font size must be positive.\n", path, line_number);
+                free(jobs);
+                free(text);
+                return NULL;
+            }
+        }
+        if (!push_job(&jobs, &count, &capacity, job)) {
+            fprintf(stderr, "Memory allocation failed for batch jobs!\n");
+            free(jobs);
+            free(text);
+            return NULL;
+        }
+    }
+
+    *out_count = count;
+    *out_text = text;
+    return jobs;
+}
+
+// Function to derive an output path for an input in multi-file mode: the input path with
+// "." and extension appended, placed in output_dir when one is given. Caller frees the result.
+char *batch_output_path(const char *input_path, const char *output_dir, const char *extension) {
+    const char *base = input_path;
+    if (output_dir) {
+        const char *slash = strrchr(input_path, '/');
+        if (slash) base = slash + 1;
+    }
+    size_t size = strlen(base) + strlen(extension) + 2 + (output_dir ? strlen(output_dir) + 1 : 0);
+    char *path = malloc(size);
+    if (!path) return NULL;
+    if (output_dir) {
+        snprintf(path, size, "%s/%s.%s", output_dir, base, extension);
+    } else {
+        snprintf(path, size, "%s.%s", base, extension);
+    }
+    return path;
+}
+
+// Function to name the copy of an output at another scale: "out.png" at 2 becomes "out@2x.png".
+// Scale 1 keeps the path. Returns a malloc'd string, or NULL if out of memory.
+char *scaled_output_path(const char *path, float scale) {
+    if (scale == 1.0f) return strdup(path);
+    const char *base = strrchr(path, '/');
+    const char *dot = strrchr(base ? base : path, '.');
+    size_t stem = dot ? (size_t)(dot - path) : strlen(path);
+    size_t size = strlen(path) + 32;
+    char *scaled = malloc(size);
+    if (!scaled) return NULL;
+    snprintf(scaled, size, "%.*s@%gx%s", (int)stem, path, scale, dot ? dot : "");
+    return scaled;
+}
+
+bool is_directory(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static inline int default_thread_count(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+// --- Watch Mode ---
+//
+// `--watch` renders the input, then renders it again every time it is saved. The whole image
+// stays in memory between saves: pixels, line index, token spans and compressed PNG chunks.
+// The new text is compared with the old one line by line, and only the rows reached by
+// changed lines, or by lines whose highlighting changed, are drawn and compressed again. The
+// layout is only redone from scratch when the image size changes.
+
+#define WATCH_SETTLE_MS 20 // Quiet time after an event before reading the file, so saves are read whole
+
+typedef struct {
+    const RenderJob *job;
+    RenderWorker *worker;
+    char *code;          // Text of the current image
+    size_t code_size;
+    RenderPlan plan;     // Points into code
+    uint8_t *pixels;     // The whole image
+    PngImage png;
+    bool ready;          // Whether plan, pixels and png hold the image of code
+} WatchState;
+
+static volatile sig_atomic_t watch_stop_requested = 0;
+
+static void watch_signal_handler(int signum) {
+    (void)signum;
+    watch_stop_requested = 1;
+}
+
+static void watch_reset(WatchState *watch) {
+    if (watch->ready) {
+        render_plan_free(&watch->plan);
+        png_image_free(&watch->png);
+    }
+    free(watch->pixels);
+    watch->pixels = NULL;
+    watch->ready = false;
+}
+
+// Function to draw rows [first_row, end_row) of the image and compress their PNG chunks again
+static bool watch_redraw_rows(WatchState *watch, int first_row, int end_row, RenderStats *stats) {
+    const RenderLayout *layout = &watch->plan.layout;
+    if (first_row < 0) first_row = 0;
+    if (end_row > layout->height) end_row = layout->height;
+    if (first_row >= end_row) return true;
+
+    size_t row_bytes = (size_t)layout->width * CHANNELS;
+    Canvas rows = { .pixels = watch->pixels + (size_t)first_row * row_bytes, .width = layout->width,
+                    .y0 = first_row, .rows = end_row - first_row };
+    RasterPool *raster = rows.rows >= 2 * RASTER_STRIP_ROWS ? worker_raster_pool(watch->worker, watch->job->raster_threads) : NULL;
+    draw_band(layout, raster, &rows, stats);
+
+    double start = now_seconds();
+    bool ok = png_image_update(&watch->png, watch->pixels, first_row, end_row);
+    stats->encode_seconds += now_seconds() - start;
+    return ok;
+}
+
+// Function to lay out and draw the whole image of code, which the state takes over
+static bool watch_render_all(WatchState *watch, char *code, size_t code_size, RenderStats *stats) {
+    watch_reset(watch);
+    free(watch->code);
+    watch->code = code;
+    watch->code_size = code_size;
+    if (render_plan_init(&watch->plan, code, code_size, watch->job, watch->worker, stats) != 0) {
+        return false;
+    }
+    const RenderLayout *layout = &watch->plan.layout;
+    PngOptions options = { .width = layout->width, .height = layout->height, .color_type = PNG_COLOR_RGB,
+                           .bit_depth = 8, .level = watch->job->png_level, .threads = watch->job->png_threads };
+    watch->pixels = malloc((size_t)layout->width * CHANNELS * layout->height);
+    if (!watch->pixels || !png_image_init(&watch->png, &options)) {
+        fprintf(stderr, "Failed to allocate pixel buffer memory!\n");
+        png_image_free(&watch->png);
+        render_plan_free(&watch->plan);
+        return false;
+    }
+    watch->ready = true;
+    if (!watch_redraw_rows(watch, 0, layout->height, stats)) {
+        watch_reset(watch);
+        return false;
+    }
+    return true;
+}
+
+static inline bool same_line(const char *a, const LineIndex *a_lines, int a_index,
+                             const char *b, const LineIndex *b_lines, int b_index) {
+    uint32_t a_start = a_lines->starts[a_index], a_length = a_lines->starts[a_index + 1] - a_start;
+    uint32_t b_start = b_lines->starts[b_index], b_length = b_lines->starts[b_index + 1] - b_start;
+    return a_length == b_length && memcmp(a + a_start, b + b_start, a_length) == 0;
+}
+
+// Function to find the line containing a byte offset
+static int line_of_offset(const LineIndex *lines, uint32_t offset) {
+    int low = 0, high = lines->line_count;
+    while (high - low > 1) {
+        int mid = low + (high - low) / 2;
+        if (lines->starts[mid] <= offset) low = mid;
+        else high = mid;
+    }
+    return low;
+}
+
+// Function to compare the token kinds of length bytes starting at old_start in the old spans
+// and new_start in the new ones. Returns false if they all match; otherwise the first and last
+// differing bytes, relative to the start.
+static bool spans_differ(const TokenSpan *old_spans, size_t old_count, uint32_t old_start,
+                         const TokenSpan *new_spans, size_t new_count, uint32_t new_start,
+                         uint32_t length, uint32_t *first, uint32_t *last) {
+    size_t a = find_span(old_spans, old_count, old_start);
+    size_t b = find_span(new_spans, new_count, new_start);
+    bool differ = false;
+    for (uint32_t pos = 0; pos < length;) {
+        uint64_t a_end = (uint64_t)old_spans[a + 1].start - old_start;
+        uint64_t b_end = (uint64_t)new_spans[b + 1].start - new_start;
+        uint64_t end = a_end < b_end ? a_end : b_end;
+        if (end > length) end = length;
+        if (old_spans[a].kind != new_spans[b].kind) {
+            if (!differ) *first = pos;
+            *last = (uint32_t)end - 1;
+            differ = true;
+        }
+        pos = (uint32_t)end;
+        if (pos == a_end) a++;
+        if (pos == b_end) b++;
+    }
+    return differ;
+}
+
+// Function to bring the image up to date with a new version of the text, which the state takes
+// over. Only rows reached by lines that changed are drawn again; *out_rows receives their count.
+static bool watch_update(WatchState *watch, char *code, size_t code_size, RenderStats *stats, int *out_rows) {
+    RenderPlan *plan = &watch->plan;
+    if (!watch->ready) {
+        *out_rows = -1;
+        return watch_render_all(watch, code, code_size, stats);
+    }
+
+    double start = now_seconds();
+    LineIndex lines;
+    if (!build_line_index(code, code_size, plan->layout.cache, &lines)) {
+        fprintf(stderr, "Error: Could not index the input (out of memory or larger than 4 GB).\n");
+        free(code);
+        return false;
+    }
+    int width, height;
+    render_image_size(watch->job, &lines, plan->layout.cache, &width, &height);
+    if (width != plan->layout.width || height != plan->layout.height) {
+        line_index_free(&lines);
+        *out_rows = -1;
+        return watch_render_all(watch, code, code_size, stats);
+    }
+    TokenSpans spans = {0};
+    if (!highlight_code(plan->language, code, code_size, &spans)) {
+        fprintf(stderr, "Error: Could not highlight the input (out of memory or larger than 4 GB).\n");
+        token_spans_free(&spans);
+        line_index_free(&lines);
+        free(code);
+        return false;
+    }
+
+    // Lines [first, new_end) replaced the old lines [first, old_end); the rest is the same text
+    const LineIndex *old_lines = &plan->lines;
+    int common = old_lines->line_count < lines.line_count ? old_lines->line_count : lines.line_count;
+    int first = 0;
+    while (first < common && same_line(watch->code, old_lines, first, code, &lines, first)) first++;
+    int suffix = 0;
+    while (suffix < common - first &&
+           same_line(watch->code, old_lines, old_lines->line_count - 1 - suffix, code, &lines, lines.line_count - 1 - suffix)) {
+        suffix++;
+    }
+    int old_end = old_lines->line_count - suffix;
+    int new_end = lines.line_count - suffix;
+
+    // Unchanged lines are drawn again too where their highlighting changed, e.g. after an
+    // edit opened or closed a block comment
+    int dirty_first = first, dirty_end = new_end;
+    uint32_t diff_first, diff_last;
+    uint32_t prefix_size = lines.starts[first] < code_size ? lines.starts[first] : (uint32_t)code_size;
+    if (spans_differ(plan->spans.spans, plan->spans.count, 0, spans.spans, spans.count, 0,
+                     prefix_size, &diff_first, &diff_last)) {
+        int line = line_of_offset(&lines, diff_first);
+        if (dirty_first > line) dirty_first = line;
+        line = line_of_offset(&lines, diff_last);
+        if (dirty_end < line + 1) dirty_end = line + 1;
+    }
+    uint32_t old_suffix_start = old_lines->starts[old_end];
+    uint32_t new_suffix_start = lines.starts[new_end];
+    if (suffix > 0 &&
+        spans_differ(plan->spans.spans, plan->spans.count, old_suffix_start, spans.spans, spans.count, new_suffix_start,
+                     (uint32_t)code_size - new_suffix_start, &diff_first, &diff_last)) {
+        int line = line_of_offset(&lines, new_suffix_start + diff_first);
+        if (dirty_first > line) dirty_first = line;
+        line = line_of_offset(&lines, new_suffix_start + diff_last);
+        if (dirty_end < line + 1) dirty_end = line + 1;
+    }
+    if (old_end != new_end) {
+        dirty_end = lines.line_count > old_lines->line_count ? lines.line_count : old_lines->line_count; // Everything below moved
+    }
+
+    // Switch the plan over to the new text
+    line_index_free(&plan->lines);
+    token_spans_free(&plan->spans);
+    free(watch->code);
+    plan->lines = lines;
+    plan->spans = spans;
+    watch->code = code;
+    watch->code_size = code_size;
+    plan->layout.code = code;
+    plan->layout.spans = spans.spans;
+    plan->layout.span_count = spans.count;
+    stats->layout_seconds += now_seconds() - start;
+
+    *out_rows = 0;
+    if (dirty_first >= dirty_end) {
+        return true;
+    }
+    const RenderLayout *layout = &plan->layout;
+    int first_row = layout->first_line_y + dirty_first * layout->line_step + layout->ink_top;
+    int end_row = old_end != new_end ? layout->height
+                                     : layout->first_line_y + (dirty_end - 1) * layout->line_step + layout->ink_bottom + 1;
+    if (first_row < 0) first_row = 0;
+    if (end_row > layout->height) end_row = layout->height;
+    *out_rows = end_row > first_row ? end_row - first_row : 0;
+    return watch_redraw_rows(watch, first_row, end_row, stats);
+}
+
+// Function to write the image to the job's output path. A temporary file is renamed over it,
+// so viewers never see a half-written PNG.
+static bool watch_write(WatchState *watch, RenderStats *stats) {
+    double start = now_seconds();
+    const char *path = watch->job->output_path;
+    size_t temp_size = strlen(path) + 5;
+    char *temp_path = malloc(temp_size);
+    if (!temp_path) return false;
+    snprintf(temp_path, temp_size, "%s.tmp", path);
+
+    FILE *out_file = fopen(temp_path, "wb");
+    uint64_t bytes = 0;
+    bool ok = out_file && png_image_write(&watch->png, file_sink(out_file), &bytes);
+    if (out_file && fclose(out_file) != 0) ok = false;
+    ok = ok && rename(temp_path, path) == 0;
+    if (!ok) {
+        fprintf(stderr, "Failed to write PNG file '%s'!\n", path);
+        remove(temp_path);
+    } else {
+        stats->bytes_written += bytes;
+        stats->images++;
+    }
+    free(temp_path);
+    stats->encode_seconds += now_seconds() - start;
+    return ok;
+}
+
+// Function to render a new version of the input and write it out. Returns false on failure.
+static bool watch_render(WatchState *watch, char *code, size_t code_size) {
+    RenderStats stats = {0};
+    double start = now_seconds();
+    bool ok;
+    int rows = -1;
+    if (watch->job->palette || job_format(watch->job) != OUTPUT_PNG) {
+        // The palette depends on every pixel, so indexed images are always rendered whole. Kept
+        // rows are PNG chunks, so other formats are rendered whole as well.
+        ok = render_code(code, code_size, watch->job, watch->worker) == 0;
+        free(watch->code);
+        watch->code = code;
+        watch->code_size = code_size;
+    } else {
+        ok = watch_update(watch, code, code_size, &stats, &rows) && watch_write(watch, &stats);
+        scratch_end_render();
+        save_glyph_files(&watch->worker->context->loaded);
+        render_stats_add(&watch->worker->stats, &stats);
+    }
+    double elapsed_ms = (now_seconds() - start) * 1000.0;
+    if (!ok) {
+        return false;
+    }
+    if (rows < 0) {
+        printf("Rendered '%s' (%.1f ms)\n", watch->job->output_path, elapsed_ms);
+    } else {
+        printf("Updated '%s': %d rows redrawn (%.1f ms)\n", watch->job->output_path, rows, elapsed_ms);
+    }
+    fflush(stdout);
+    return true;
+}
+
+// Function to render the job's input and keep it rendered until SIGINT/SIGTERM. Returns a
+// process exit code.
+int run_watch(const RenderJob *job, RenderWorker *worker) {
+#ifdef __linux__
+    // The directory is watched rather than the file, so editors that save by renaming a new
+    // file over the old one are seen too
+    const char *slash = strrchr(job->input_path, '/');
+    const char *name = slash ? slash + 1 : job->input_path;
+    char directory[PATH_MAX];
+    if (slash) {
+        snprintf(directory, sizeof(directory), "%.*s", (int)(slash - job->input_path), job->input_path);
+        if (directory[0] == '\0') strcpy(directory, "/");
+    } else {
+        strcpy(directory, ".");
+    }
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        fprintf(stderr, "Error: Could not watch '%s': %s\n", directory, strerror(errno));
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+
+    // No SA_RESTART, so a signal interrupts poll() and the loop below can exit
+    struct sigaction action = {0};
+    action.sa_handler = watch_signal_handler;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    WatchState watch = { .job = job, .worker = worker };
+    int exit_code = 0;
+    size_t code_size = 0;
+    char *code = load_file(job->input_path, &code_size);
+    if (!code) {
+        fprintf(stderr, "Error: Could not read input file '%s'.\n", job->input_path);
+        exit_code = 1;
+    } else if (!watch_render(&watch, code, code_size)) {
+        exit_code = 1;
+    }
+    log_message(LOG_INFO, "Watching '%s' for changes", job->input_path);
+
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (!watch_stop_requested) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        if (poll(&pfd, 1, -1) <= 0) continue;
+
+        // Drain events until the directory has been quiet for a moment
+        bool changed = false;
+        do {
+            ssize_t length = read(fd, events, sizeof(events));
+            for (ssize_t offset = 0; offset < length;) {
+                const struct inotify_event *event = (const struct inotify_event *)(events + offset);
+                if (event->len > 0 && strcmp(event->name, name) == 0) changed = true;
+                offset += sizeof(struct inotify_event) + event->len;
+            }
+        } while (!watch_stop_requested && poll(&pfd, 1, WATCH_SETTLE_MS) > 0);
+        if (!changed || watch_stop_requested) continue;
+
+        code = load_file(job->input_path, &code_size);
+        if (!code) {
+            log_message(LOG_WARN, "Could not read '%s'; waiting for the next save", job->input_path);
+            continue;
+        }
+        if (watch.code && code_size == watch.code_size && memcmp(code, watch.code, code_size) == 0) {
+            free(code); // Saved without changes
+            continue;
+        }
+        exit_code = watch_render(&watch, code, code_size) ? 0 : 1;
+    }
+
+    watch_reset(&watch);
+    free(watch.code);
+    close(fd);
+    return exit_code;
+#else
+    (void)job;
+    (void)worker;
+    (void)watch_render;
+    fprintf(stderr, "Error: --watch needs inotify, which is only available on Linux.\n");
+    return 1;
+#endif
+}
+
+// --- Render Daemon ---
+//
+// `--serve SOCKET` keeps discovered fonts, parsed fonts and glyph caches warm and renders
+// requests arriving on a Unix domain socket. Each request is a block of "key value" header
+// lines ended by an empty line, followed by the code bytes:
+//
+//   RENDER
+//   font JetBrainsMono-Regular   (optional)
+//   size 18                      (optional)
+//   width 800                    (optional)
+//   height 600                   (optional)
+//   level 6                      (optional: PNG compression level 0-9)
+//   palette 1                    (optional: indexed-color PNG)
+//   language python              (optional: highlighting language, default plain text)
+//   output /path/to/out.png      (optional: daemon writes the file instead of returning it)
+//   length 1234
+//   <empty line><1234 bytes of code>
+//
+// The reply is "OK <n>\n" followed by n bytes of PNG (n is 0 when the daemon wrote the file),
+// or "ERROR <message>\n". "STATS" (followed by an empty line) returns the latency report the
+// same way. A connection may carry any number of requests. A connection that sends nothing for
+// DAEMON_IDLE_SECONDS is closed, so idle clients cannot hold on to every worker, and on
+// SIGINT/SIGTERM open connections are shut down once their current request is answered.
+
+#define DAEMON_MAX_REQUEST_BYTES (64 * 1024 * 1024)
+#define DAEMON_IDLE_SECONDS 30       // Read and write timeout of a connection
+#define DAEMON_LATENCY_SAMPLES 10000 // Latency percentiles cover the most recent requests
+#define DAEMON_REPORT_EVERY 100      // Log a latency report to stderr every N renders
+
+typedef struct {
+    int fd;
+    char buffer[4096];
+    size_t pos;
+    size_t len;
+} ConnReader;
+
+typedef struct {
+    int listen_fd;
+    int *pending_fds;            // Accepted connections waiting for a worker (ring buffer)
+    int pending_capacity;
+    int pending_head;
+    int pending_count;
+    int *active_fds;             // Connection each worker is serving, or -1
+    int worker_count;
+    bool stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    RenderContext *context;
+    OutputCache *cache;          // Shared by every worker, or NULL
+
+    pthread_mutex_t stats_lock;
+    double latencies_ms[DAEMON_LATENCY_SAMPLES];
+    unsigned long requests;      // Successful renders since startup
+    unsigned long failures;
+} RenderDaemon;
+
+static volatile sig_atomic_t daemon_stop_requested = 0;
+
+static void daemon_signal_handler(int signum) {
+    (void)signum;
+    daemon_stop_requested = 1;
+}
+
+// Buffered read of up to `size` bytes; returns bytes read, 0 on EOF, -1 on error
+static ssize_t conn_read(ConnReader *reader, void *out, size_t size) {
+    if (reader->pos == reader->len) {
+        if (size >= sizeof(reader->buffer)) {
+            ssize_t n;
+            do { n = read(reader->fd, out, size); } while (n < 0 && errno == EINTR);
+            return n;
+        }
+        ssize_t n;
+        do { n = read(reader->fd, reader->buffer, sizeof(reader->buffer)); } while (n < 0 && errno == EINTR);
+        if (n <= 0) return n;
+        reader->pos = 0;
+        reader->len = (size_t)n;
+    }
+    size_t available = reader->len - reader->pos;
+    size_t take = size < available ? size : available;
+    memcpy(out, reader->buffer + reader->pos, take);
+    reader->pos += take;
+    return (ssize_t)take;
+}
+
+static bool conn_read_exact(ConnReader *reader, void *out, size_t size) {
+    uint8_t *dst = out;
+    while (size > 0) {
+        ssize_t n = conn_read(reader, dst, size);
+        if (n <= 0) return false;
+        dst += n;
+        size -= (size_t)n;
+    }
+    return true;
+}
+
+// Read one '\n'-terminated line (without the newline). Returns false on EOF or overlong lines.
+static bool conn_read_line(ConnReader *reader, char *line, size_t size) {
+    size_t len = 0;
+    for (;;) {
+        char c;
+        if (conn_read(reader, &c, 1) != 1) return false;
+        if (c == '\n') break;
+        if (len + 1 >= size) return false;
+        line[len++] = c;
+    }
+    if (len > 0 && line[len - 1] == '\r') len--;
+    line[len] = '\0';
+    return true;
+}
+
+static bool send_reply(int fd, const void *body, size_t size) {
+    char header[64];
+    int len = snprintf(header, sizeof(header), "OK %zu\n", size);
+    return write_all(fd, header, len) && (size == 0 || write_all(fd, body, size));
+}
+
+static bool send_error(int fd, const char *message) {
+    char line[512];
+    int len = snprintf(line, sizeof(line), "ERROR %s\n", message);
+    return write_all(fd, line, len);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Function to format the daemon's latency report into out
+void daemon_latency_report(RenderDaemon *daemon, char *out, size_t size) {
+    static double sorted[DAEMON_LATENCY_SAMPLES];
+    static pthread_mutex_t sorted_lock = PTHREAD_MUTEX_INITIALIZER;
+
+    pthread_mutex_lock(&sorted_lock);
+    pthread_mutex_lock(&daemon->stats_lock);
+    unsigned long requests = daemon->requests;
+    unsigned long failures = daemon->failures;
+    int samples = requests < DAEMON_LATENCY_SAMPLES ? (int)requests : DAEMON_LATENCY_SAMPLES;
+    memcpy(sorted, daemon->latencies_ms, sizeof(double) * samples);
+    pthread_mutex_unlock(&daemon->stats_lock);
+
+    if (samples == 0) {
+        snprintf(out, size, "requests=0 failures=%lu\n", failures);
+    } else {
+        qsort(sorted, samples, sizeof(double), compare_doubles);
+        double p50 = sorted[(samples - 1) * 50 / 100];
+        double p99 = sorted[(samples - 1) * 99 / 100];
+        snprintf(out, size, "requests=%lu failures=%lu p50_ms=%.2f p99_ms=%.2f max_ms=%.2f (last %d)\n",
+                 requests, failures, p50, p99, sorted[samples - 1], samples);
+    }
+    pthread_mutex_unlock(&sorted_lock);
+}
+
+static void daemon_record(RenderDaemon *daemon, bool ok, double elapsed_ms) {
+    bool report = false;
+    pthread_mutex_lock(&daemon->stats_lock);
+    if (ok) {
+        daemon->latencies_ms[daemon->requests % DAEMON_LATENCY_SAMPLES] = elapsed_ms;
+        daemon->requests++;
+        report = daemon->requests % DAEMON_REPORT_EVERY == 0;
+    } else {
+        daemon->failures++;
+    }
+    pthread_mutex_unlock(&daemon->stats_lock);
+
+    if (report) {
+        char line[256];
+        daemon_latency_report(daemon, line, sizeof(line));
+        log_message(LOG_INFO, "Latency: %s", line);
+    }
+}
+
+// Function to serve requests on one connection until the client hangs up
+static void daemon_serve_connection(RenderDaemon *daemon, RenderWorker *worker, int fd) {
+    ConnReader reader = { .fd = fd };
+    char line[1024];
+
+    while (conn_read_line(&reader, line, sizeof(line))) {
+        if (line[0] == '\0') continue; // Tolerate blank lines between requests
+
+        bool is_render = strcmp(line, "RENDER") == 0;
+        bool is_stats = strcmp(line, "STATS") == 0;
+        RenderJob job = { .font_pixel_height = 18.0f, .png_level = PNG_DEFAULT_LEVEL, .png_threads = 1, .raster_threads = 1,
+                          .cache = daemon->cache };
+        char font_name[256] = "";
+        char language[32] = "";
+        char output_path[1024] = "";
+        long long length = -1;
+        const char *error = (is_render || is_stats) ? NULL : "unknown command";
+
+        // Header lines up to the empty separator line
+        for (;;) {
+            if (!conn_read_line(&reader, line, sizeof(line))) return;
+            if (line[0] == '\0') break;
+            char *value = strchr(line, ' ');
+            if (!value) {
+                error = "malformed header line";
+                continue;
+            }
+            *value++ = '\0';
+            if (strcmp(line, "font") == 0) {
+                snprintf(font_name, sizeof(font_name), "%s", value);
+            } else if (strcmp(line, "size") == 0) {
+                job.font_pixel_height = atof(value);
+                if (job.font_pixel_height <= 0) error = "font size must be positive";
+            } else if (strcmp(line, "width") == 0) {
+                job.width = atoi(value);
+            } else if (strcmp(line, "height") == 0) {
+                job.height = atoi(value);
+            } else if (strcmp(line, "level") == 0) {
+                job.png_level = atoi(value);
+                if (job.png_level < 0 || job.png_level > 9) error = "level must be 0-9";
+            } else if (strcmp(line, "language") == 0) {
+                snprintf(language, sizeof(language), "%s", value);
+                if (!find_language(language)) error = "unknown language";
+            } else if (strcmp(line, "palette") == 0) {
+                job.palette = atoi(value) != 0;
+            } else if (strcmp(line, "format") == 0) {
+                job.format = output_format_from_name(value);
+                if (job.format == OUTPUT_AUTO) error = "format must be png, ppm, raw or qoi";
+            } else if (strcmp(line, "output") == 0) {
+                snprintf(output_path, sizeof(output_path), "%s", value);
+            } else if (strcmp(line, "length") == 0) {
+                length = atoll(value);
+            } else {
+                error = "unknown header";
+            }
+        }
+
+        if (is_stats && !error) {
+            char report[256];
+            daemon_latency_report(daemon, report, sizeof(report));
+            if (!send_reply(fd, report, strlen(report))) return;
+            continue;
+        }
+        if (!error && (length < 0 || length > DAEMON_MAX_REQUEST_BYTES)) {
+            error = "missing or too large length";
+        }
+        if (error && length < 0) {
+            send_error(fd, error);
+            return; // Cannot find the next request without a length
+        }
+
+        // Always consume the body so the connection stays in sync
+        char *code = malloc((size_t)length + 1);
+        if (!code) {
+            send_error(fd, "out of memory");
+            return;
+        }
+        if (!conn_read_exact(&reader, code, (size_t)length)) {
+            free(code);
+            return;
+        }
+        code[length] = '\0';
+
+        if (!error && font_name[0] && !find_font_path(&daemon->context->fonts, font_name)) {
+            error = "unknown font";
+        }
+        if (error) {
+            free(code);
+            daemon_record(daemon, false, 0);
+            if (!send_error(fd, error)) return;
+            continue;
+        }
+
+        ByteBuffer png = {0};
+        job.font_name = font_name[0] ? font_name : NULL;
+        job.language = language[0] ? language : NULL;
+        job.input_path = "<socket>";
+        if (output_path[0]) {
+            job.output_path = output_path;
+        } else {
+            job.output_buffer = &png;
+        }
+
+        double start = now_seconds();
+        int result = render_code(code, (size_t)length, &job, worker);
+        double elapsed_ms = (now_seconds() - start) * 1000.0;
+        free(code);
+        daemon_record(daemon, result == 0, elapsed_ms);
+
+        bool sent = (result == 0) ? send_reply(fd, png.data, png.size) : send_error(fd, "render failed");
+        byte_buffer_free(&png);
+        if (!sent) return;
+    }
+}
+
+static void *daemon_worker_main(void *arg) {
+    RenderDaemon *daemon = arg;
+    RenderWorker worker = { .context = daemon->context };
+
+    for (;;) {
+        pthread_mutex_lock(&daemon->lock);
+        while (daemon->pending_count == 0 && !daemon->stopping) {
+            pthread_cond_wait(&daemon->ready, &daemon->lock);
+        }
+        if (daemon->pending_count == 0) { // Stopping and nothing left to serve
+            pthread_mutex_unlock(&daemon->lock);
+            break;
+        }
+        int fd = daemon->pending_fds[daemon->pending_head];
+        daemon->pending_head = (daemon->pending_head + 1) % daemon->pending_capacity;
+        daemon->pending_count--;
+        int slot = 0;
+        while (daemon->active_fds[slot] >= 0) slot++; // One slot per worker, so one is free
+        daemon->active_fds[slot] = fd;
+        if (daemon->stopping) {
+            shutdown(fd, SHUT_RD); // Answer what the client already sent, then hang up
+        }
+        pthread_mutex_unlock(&daemon->lock);
+
+        daemon_serve_connection(daemon, &worker, fd);
+
+        pthread_mutex_lock(&daemon->lock);
+        daemon->active_fds[slot] = -1;
+        pthread_mutex_unlock(&daemon->lock);
+        close(fd);
+    }
+
+    worker_free(&worker);
+    return NULL;
+}
+
+// Function to run the render daemon until SIGINT/SIGTERM. Returns a process exit code.
+int run_daemon(RenderContext *context, const char *socket_path, int thread_count, OutputCache *cache) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path '%s' is too long.\n", socket_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        perror("socket");
+        return 1;
+    }
+    unlink(socket_path); // Remove a stale socket left by a previous run
+    // Only the owner may connect, since a request can have the daemon write to any path it can.
+    // The mode is set before listen(), so nobody can connect in between.
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || chmod(socket_path, 0600) != 0 ||
+        listen(listen_fd, 64) != 0) {
+        fprintf(stderr, "Error: Could not listen on '%s': %s\n", socket_path, strerror(errno));
+        close(listen_fd);
+        return 1;
+    }
+
+    // No SA_RESTART, so a signal interrupts accept() and the loop below can exit
+    struct sigaction action = {0};
+    action.sa_handler = daemon_signal_handler;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    RenderDaemon *daemon = calloc(1, sizeof(RenderDaemon));
+    pthread_t *threads = malloc(sizeof(pthread_t) * thread_count);
+    if (!daemon || !threads) {
+        fprintf(stderr, "Memory allocation failed for daemon!\n");
+        free(daemon);
+        free(threads);
+        close(listen_fd);
+        unlink(socket_path);
+        return 1;
+    }
+    daemon->listen_fd = listen_fd;
+    daemon->context = context;
+    daemon->cache = cache;
+    daemon->pending_capacity = thread_count * 4;
+    daemon->pending_fds = malloc(sizeof(int) * daemon->pending_capacity);
+    daemon->active_fds = malloc(sizeof(int) * thread_count);
+    daemon->worker_count = thread_count;
+    for (int i = 0; daemon->active_fds && i < thread_count; ++i) {
+        daemon->active_fds[i] = -1;
+    }
+    pthread_mutex_init(&daemon->lock, NULL);
+    pthread_cond_init(&daemon->ready, NULL);
+    pthread_mutex_init(&daemon->stats_lock, NULL);
+
+    int started = 0;
+    if (daemon->pending_fds && daemon->active_fds) {
+        for (; started < thread_count; ++started) {
+            if (pthread_create(&threads[started], NULL, daemon_worker_main, daemon) != 0) break;
+        }
+    }
+    if (started == 0) {
+        fprintf(stderr, "Error: Could not start daemon worker threads.\n");
+        free(daemon->pending_fds);
+        free(daemon->active_fds);
+        free(daemon);
+        free(threads);
+        close(listen_fd);
+        unlink(socket_path);
+        return 1;
+    }
+    log_message(LOG_INFO, "Serving on '%s' with %d worker threads (%d fonts discovered)",
+                socket_path, started, context->fonts.count);
+
+    while (!daemon_stop_requested) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            perror("accept");
+            break;
+        }
+        struct timeval timeout = { .tv_sec = DAEMON_IDLE_SECONDS };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        pthread_mutex_lock(&daemon->lock);
+        if (daemon->pending_count == daemon->pending_capacity) {
+            pthread_mutex_unlock(&daemon->lock);
+            send_error(fd, "server busy");
+            close(fd);
+            continue;
+        }
+        int tail = (daemon->pending_head + daemon->pending_count) % daemon->pending_capacity;
+        daemon->pending_fds[tail] = fd;
+        daemon->pending_count++;
+        pthread_cond_signal(&daemon->ready);
+        pthread_mutex_unlock(&daemon->lock);
+    }
+
+    // Stop reading from open connections, so workers answer the requests already received
+    // instead of waiting for clients to hang up, then exit
+    pthread_mutex_lock(&daemon->lock);
+    daemon->stopping = true;
+    for (int i = 0; i < daemon->worker_count; ++i) {
+        if (daemon->active_fds[i] >= 0) shutdown(daemon->active_fds[i], SHUT_RD);
+    }
+    pthread_cond_broadcast(&daemon->ready);
+    pthread_mutex_unlock(&daemon->lock);
+    for (int i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    char report[256];
+    daemon_latency_report(daemon, report, sizeof(report));
+    log_message(LOG_INFO, "Shutting down. Latency: %s", report);
+
+    close(listen_fd);
+    unlink(socket_path);
+    pthread_mutex_destroy(&daemon->lock);
+    pthread_cond_destroy(&daemon->ready);
+    pthread_mutex_destroy(&daemon->stats_lock);
+    free(daemon->pending_fds);
+    free(daemon->active_fds);
+    free(daemon);
+    free(threads);
+    return 0;
+}
+
+// Function to send one request to a running daemon (the bundled client).
+// With job == NULL the daemon's latency report is printed instead. Returns 0 on success.
+int run_client(const char *socket_path, const RenderJob *job) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path '%s' is too long.\n", socket_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "Error: Could not connect to '%s': %s\n", socket_path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+
+    char header[2048];
+    size_t code_size = 0;
+    char *code = NULL;
+    int header_len;
+    if (job) {
+        code = load_file(job->input_path, &code_size);
+        if (!code) {
+            fprintf(stderr, "Error: Could not read input file '%s'.\n", job->input_path);
+            close(fd);
+            return 1;
+        }
+        header_len = snprintf(header, sizeof(header), "RENDER\nsize %g\nlevel %d\nlength %zu\n",
+                              job->font_pixel_height, job->png_level, code_size);
+        if (job->font_name) header_len += snprintf(header + header_len, sizeof(header) - header_len, "font %s\n", job->font_name);
+        if (job->width > 0) header_len += snprintf(header + header_len, sizeof(header) - header_len, "width %d\n", job->width);
+        if (job->height > 0) header_len += snprintf(header + header_len, sizeof(header) - header_len, "height %d\n", job->height);
+        if (job->palette) header_len += snprintf(header + header_len, sizeof(header) - header_len, "palette 1\n");
+        if (job_format(job) != OUTPUT_PNG) {
+            header_len += snprintf(header + header_len, sizeof(header) - header_len, "format %s\n", output_format_names[job_format(job)]);
+        }
+        // The daemon never sees the file name, so the language is picked here
+        const char *language = job->language ? job->language : language_for_path(job->input_path)->name;
+        header_len += snprintf(header + header_len, sizeof(header) - header_len, "language %s\n", language);
+        header_len += snprintf(header + header_len, sizeof(header) - header_len, "\n");
+    } else {
+        header_len = snprintf(header, sizeof(header), "STATS\n\n");
+    }
+
+    bool ok = write_all(fd, header, header_len) && (code_size == 0 || write_all(fd, code, code_size));
+    free(code);
+
+    ConnReader reader = { .fd = fd };
+    char status[512];
+    if (!ok || !conn_read_line(&reader, status, sizeof(status))) {
+        fprintf(stderr, "Error: No reply from daemon.\n");
+        close(fd);
+        return 1;
+    }
+    if (strncmp(status, "OK ", 3) != 0) {
+        fprintf(stderr, "Daemon: %s\n", status);
+        close(fd);
+        return 1;
+    }
+
+    size_t size = strtoull(status + 3, NULL, 10);
+    uint8_t *body = malloc(size + 1);
+    if (!body || !conn_read_exact(&reader, body, size)) {
+        fprintf(stderr, "Error: Truncated reply from daemon.\n");
+        free(body);
+        close(fd);
+        return 1;
+    }
+    close(fd);
+
+    int result = 0;
+    if (!job || is_stdout_path(job->output_path)) {
+        result = fwrite(body, 1, size, stdout) == size && fflush(stdout) == 0 ? 0 : 1;
+    } else {
+        FILE *out = fopen(job->output_path, "wb");
+        if (!out || fwrite(body, 1, size, out) != size) {
+            fprintf(stderr, "Failed to write %s file '%s'!\n", output_format_label(job_format(job)), job->output_path);
+            result = 1;
+        }
+        if (out && fclose(out) != 0) result = 1;
+        if (result == 0) printf("Successfully wrote '%s'\n", job->output_path);
+    }
+    free(body);
+    return result;
+}
+
+// --- Library API ---
+//
+// The functions declared in code-to-image.h. A context owns the font catalog, the fonts loaded
+// from it and the theme. Each render borrows an idle worker (glyph caches and drawing threads)
+// for the length of the call, so concurrent calls never share a glyph cache and later calls
+// find it warm.
+
+static pthread_once_t span_blend_once = PTHREAD_ONCE_INIT;
+
+RenderContext *cti_context_create(const char *font_root, bool rescan_fonts) {
+    pthread_once(&span_blend_once, span_blend_init);
+    RenderContext *context = calloc(1, sizeof(RenderContext));
+    if (!context) return NULL;
+    pthread_mutex_init(&context->loaded.lock, NULL);
+    context->loaded.glyph_files = true;
+    pthread_mutex_init(&context->workers_lock, NULL);
+    context->theme = default_theme;
+    discover_fonts(&context->fonts, font_root, rescan_fonts);
+    if (!font_fallback_init(&context->fallback, &context->fonts, &context->loaded, NULL)) {
+        cti_context_free(context);
+        return NULL;
+    }
+    context->loaded.fallback = &context->fallback;
+    return context;
+}
+
+void cti_context_free(RenderContext *context) {
+    if (!context) return;
+    for (int i = 0; i < context->idle_count; ++i) {
+        worker_free(context->idle_workers[i]);
+        free(context->idle_workers[i]);
+    }
+    free(context->idle_workers);
+    free_loaded_fonts(&context->loaded);
+    font_fallback_free(&context->fallback);
+    free_discovered_fonts(&context->fonts);
+    pthread_mutex_destroy(&context->loaded.lock);
+    pthread_mutex_destroy(&context->workers_lock);
+    free(context);
+}
+
+static bool is_hex_color(const char *color) {
+    return color && color[0] == '#' && strlen(color) == 7 && strspn(color + 1, "0123456789abcdefABCDEF") == 6;
+}
+
+bool cti_context_set_fallback(RenderContext *context, const char *list) {
+    FontFallback fallback;
+    if (!font_fallback_init(&fallback, &context->fonts, &context->loaded, list)) {
+        font_fallback_free(&fallback);
+        return false;
+    }
+    font_fallback_free(&context->fallback);
+    context->fallback = fallback;
+    return true;
+}
+
+void cti_context_set_glyph_files(RenderContext *context, bool enabled) {
+    context->loaded.glyph_files = enabled;
+}
+
+bool cti_context_set_theme(RenderContext *context, const CtiTheme *theme) {
+    const char *colors[8] = { theme->background, theme->code_background, theme->text, theme->comment,
+                              theme->keyword, theme->function, theme->string, theme->literal };
+    for (int i = 0; i < 8; ++i) {
+        if (!is_hex_color(colors[i])) return false;
+    }
+    for (int i = 0; i < 8; ++i) {
+        memcpy(context->theme_colors[i], colors[i], 8);
+    }
+    char (*copy)[8] = context->theme_colors;
+    context->theme = (Theme){ copy[0], copy[1], copy[2], copy[3], copy[4], copy[5], copy[6], copy[7] };
+    return true;
+}
+
+int cti_font_count(const RenderContext *context) {
+    return context->fonts.count;
+}
+
+const char *cti_font_name(const RenderContext *context, int index) {
+    return index >= 0 && index < context->fonts.count ? context->fonts.fonts[index].name : NULL;
+}
+
+CtiOptions cti_default_options(void) {
+    return (CtiOptions){ .font_pixel_height = 18.0f, .scale = 1.0f, .png_level = PNG_DEFAULT_LEVEL, .threads = 1 };
+}
+
+static RenderJob job_from_options(const CtiOptions *options) {
+    int threads = options->threads > 0 ? options->threads : 1;
+    return (RenderJob){
+        .font_name = options->font_name,
+        .language = options->language,
+        .font_pixel_height = options->font_pixel_height,
+        .scale = options->scale,
+        .width = options->width,
+        .height = options->height,
+        .png_level = options->png_level,
+        .png_threads = threads,
+        .raster_threads = threads,
+        .palette = options->palette,
+        .sdf = options->sdf,
+    };
+}
+
+// Function to take an idle worker of the context, or make a new one
+static RenderWorker *context_acquire_worker(RenderContext *context) {
+    RenderWorker *worker = NULL;
+    pthread_mutex_lock(&context->workers_lock);
+    if (context->idle_count > 0) {
+        worker = context->idle_workers[--context->idle_count];
+    }
+    pthread_mutex_unlock(&context->workers_lock);
+    if (!worker) {
+        worker = calloc(1, sizeof(RenderWorker));
+        if (worker) worker->context = context;
+    }
+    return worker;
+}
+
+static void context_release_worker(RenderContext *context, RenderWorker *worker) {
+    pthread_mutex_lock(&context->workers_lock);
+    if (context->idle_count == context->idle_capacity) {
+        int capacity = context->idle_capacity ? context->idle_capacity * 2 : 4;
+        RenderWorker **idle = realloc(context->idle_workers, sizeof(RenderWorker *) * capacity);
+        if (!idle) {
+            pthread_mutex_unlock(&context->workers_lock);
+            worker_free(worker);
+            free(worker);
+            return;
+        }
+        context->idle_workers = idle;
+        context->idle_capacity = capacity;
+    }
+    context->idle_workers[context->idle_count++] = worker;
+    pthread_mutex_unlock(&context->workers_lock);
+}
+
+int cti_measure(RenderContext *context, const CtiOptions *options, const char *code, size_t size,
+                int *out_width, int *out_height) {
+    RenderJob job = job_from_options(options);
+    RenderWorker *worker = context_acquire_worker(context);
+    if (!worker) return 1;
+    RenderStats stats = {0};
+    RenderPlan plan;
+    int result = render_plan_init(&plan, code, size, &job, worker, &stats);
+    if (result == 0) {
+        *out_width = plan.layout.width;
+        *out_height = plan.layout.height;
+        render_plan_free(&plan);
+    }
+    context_release_worker(context, worker);
+    return result;
+}
+
+int cti_render_pixels(RenderContext *context, const CtiOptions *options, const char *code, size_t size,
+                      uint8_t *pixels, int width, int height) {
+    RenderJob job = job_from_options(options);
+    RenderWorker *worker = context_acquire_worker(context);
+    if (!worker) return 1;
+    int result = render_pixels(code, size, &job, worker, pixels, width, height);
+    context_release_worker(context, worker);
+    return result;
+}
+
+int cti_render_png(RenderContext *context, const CtiOptions *options, const char *code, size_t size,
+                   CtiWriteFn write, void *user) {
+    RenderJob job = job_from_options(options);
+    ByteSink sink = { write, user };
+    job.output_sink = &sink;
+    RenderWorker *worker = context_acquire_worker(context);
+    if (!worker) return 1;
+    int result = render_code(code, size, &job, worker);
+    context_release_worker(context, worker);
+    return result;
+}
+
+// Function to print usage, listing the fonts of catalog (or of Fonts/ when catalog is NULL)
+void print_usage(const char *progname, const FontCatalog *catalog) {
+    FontCatalog own = {0};
+    if (!catalog) {
+        discover_fonts(&own, "Fonts", false); // So the list below is complete
+        catalog = &own;
+    }
+    fprintf(stderr, "Usage: %s [options] <output_image_path>\n", progname);
+    fprintf(stderr, "       %s [options] -i FILE -i FILE ... [output_dir]\n", progname);
+    fprintf(stderr, "       %s [options] --batch MANIFEST\n", progname);
+    fprintf(stderr, "       %s [options] --serve SOCKET\n", progname);
+    fprintf(stderr, "       %s [options] --client SOCKET -i FILE <output_image_path>\n\n", progname);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -i FILE    Input code file to convert (e.g., my_script.c). Repeat to render several files.\n");
+    fprintf(stderr, "  -f FONT    Select font (e.g., 'JetBrainsMono-Regular'). See available fonts below.\n");
+    fprintf(stderr, "  -fs SIZE   Set font size in pixels (default: 18.0)\n");
+    fprintf(stderr, "  -l LANG    Highlighting language (default: from the input file extension):\n");
+    fprintf(stderr, "            ");
+    for (int l = 0; l < LANGUAGE_COUNT; ++l) {
+        fprintf(stderr, " %s", languages[l].name);
+    }
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -w WIDTH   Set image width in pixels (default: calculated based on content, or 200 if no content)\n"); // Updated help
+    fprintf(stderr, "  -h HEIGHT  Set image height in pixels (default: calculated based on content, or 100 if no content)\n"); // Updated help
+    fprintf(stderr, "  --batch MANIFEST  Render every 'INPUT OUTPUT [FONT [SIZE]]' line of MANIFEST\n");
+    fprintf(stderr, "  -j THREADS Worker threads for batch rendering and --serve, or drawing and PNG compression threads\n");
+    fprintf(stderr, "             for a single image (default: number of CPUs)\n");
+    fprintf(stderr, "  --png-level LEVEL PNG compression level, 0 (stored) to 9 (smallest) (default: 6)\n");
+    fprintf(stderr, "  --palette         Write an indexed-color PNG (exact palette, or quantized above 256 colors)\n");
+    fprintf(stderr, "  --format FORMAT   Output format: png, ppm, raw (RGB rows, no header) or qoi\n");
+    fprintf(stderr, "                    (default: from the output extension, else png). Output '-' is stdout.\n");
+    fprintf(stderr, "  --rescan-fonts    Ignore the font index and rescan the Fonts/ directory\n");
+    fprintf(stderr, "  --fallback LIST   Fonts to draw characters the selected font lacks, comma-separated, or 'none'\n");
+    fprintf(stderr, "                    (default: every available font, in order)\n");
+    fprintf(stderr, "  --watch           Render again every time the -i file is saved, redrawing only changed lines\n");
+    fprintf(stderr, "  --sdf             Draw glyphs from per-font signed distance fields built once for every size\n");
+    fprintf(stderr, "  --scales LIST     Write the image at each comma-separated scale, e.g. 1,2,3,0.5\n");
+    fprintf(stderr, "                    (out.png, out@2x.png, out@3x.png, out@0.5x.png)\n");
+    fprintf(stderr, "  --no-glyph-files  Do not keep rasterized glyphs in ~/.cache/code-to-image/glyphs between runs\n");
+    fprintf(stderr, "  --cache           Reuse PNGs rendered before from identical input and options\n");
+    fprintf(stderr, "  --cache-dir DIR   Keep the output cache in DIR (default: ~/.cache/code-to-image/renders)\n");
+    fprintf(stderr, "  --cache-size MB   Evict least recently used entries above MB megabytes (default: 256)\n");
+    fprintf(stderr, "  --serve SOCKET    Run as a render daemon on a Unix domain socket\n");
+    fprintf(stderr, "  --client SOCKET   Send the -i file to a running daemon and write the PNG it returns\n");
+    fprintf(stderr, "  --server-stats    With --client, print the daemon's latency report instead\n");
+    fprintf(stderr, "  --stats[=json]    Print phase timings, work counters and peak memory to stderr when done\n");
+    fprintf(stderr, "  -v, -vv           Log info, or info and debug, messages to stderr\n");
+    fprintf(stderr, "  --log-level LEVEL Log messages up to LEVEL: off (default), warn, info or debug\n");
+    fprintf(stderr, "\nAvailable Fonts (from ./Fonts/ directory):\n");
+    if (catalog->count == 0) {
+        fprintf(stderr, "  No fonts found. Ensure .ttf files are in 'Fonts/' or its subdirectories.\n");
+    } else {
+        for (int i = 0; i < catalog->count; ++i) {
+            fprintf(stderr, "  - %s\n", catalog->fonts[i].name);
+        }
+    }
+    fprintf(stderr, "\n");
+    free_discovered_fonts(&own);
+}
+
+
+// bench/bench.c includes this file for its functions and brings its own main
+#ifndef CODE_TO_IMAGE_NO_MAIN
+int main(int argc, char **argv) {
+    const char *output_image_path = NULL;
+    const char *manifest_path = NULL;
+    const char *serve_socket = NULL;
+    const char *client_socket = NULL;
+    bool server_stats = false;
+    bool watch = false;
+    float scales[RENDER_MAX_SCALES];
+    int scale_count = 0; // 0 renders the one output at 1x
+    const char **input_file_paths = NULL; // Every -i argument, in order
+    int input_file_count = 0;
+    int thread_count = 0; // 0 means one per CPU
+    RenderJob defaults = {
+        .font_name = NULL,
+        .font_pixel_height = 18.0f,
+        .width = 0,  // Use 0 to indicate not set by user
+        .height = 0, // Use 0 to indicate not set by user
+        .png_level = PNG_DEFAULT_LEVEL,
+        .png_threads = 1, // Batch and daemon workers already run in parallel
+        .raster_threads = 1,
+    };
+
+    bool rescan_fonts = false;
+    const char *fallback_list = NULL; // NULL means every font
+    bool glyph_files = true;
+    bool use_cache = false;
+    const char *cache_dir = NULL; // NULL means the default location
+    uint64_t cache_mb = OUTPUT_CACHE_DEFAULT_MB;
+    OutputCache output_cache;
+    RenderContext *context = NULL;
+    StatsFormat stats_format = STATS_OFF;
+    RenderStats stats = {0};
+    bool rendered = false; // Whether there are statistics to print
+    double run_start = now_seconds();
+    double discovery_seconds = 0.0;
+
+    input_file_paths = malloc(sizeof(char *) * argc);
+    if (!input_file_paths) {
+        fprintf(stderr, "Memory allocation failed for arguments!\n");
+        return 1;
+    }
+
+    // Parse arguments
+    int exit_code = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-u") == 0) {
+            print_usage(argv[0], NULL);
+            goto cleanup; // EXIT IMMEDIATELY AFTER PRINTING HELP
+        }
+        else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            input_file_paths[input_file_count++] = argv[++i];
+        }
+        else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            manifest_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            serve_socket = argv[++i];
+        }
+        else if (strcmp(argv[i], "--client") == 0 && i + 1 < argc) {
+            client_socket = argv[++i];
+        }
+        else if (strcmp(argv[i], "--server-stats") == 0) {
+            server_stats = true;
+        }
+        else if (strcmp(argv[i], "--rescan-fonts") == 0) {
+            rescan_fonts = true;
+        }
+        else if (strcmp(argv[i], "--fallback") == 0 && i + 1 < argc) {
+            fallback_list = argv[++i];
+        }
+        else if (strcmp(argv[i], "--no-glyph-files") == 0) {
+            glyph_files = false;
+        }
+        else if (strcmp(argv[i], "--watch") == 0) {
+            watch = true;
+        }
+        else if (strcmp(argv[i], "--sdf") == 0) {
+            defaults.sdf = true;
+        }
+        else if (strcmp(argv[i], "--scales") == 0 && i + 1 < argc) {
+            const char *list = argv[++i];
+            scale_count = 0;
+            for (;;) {
+                char *end = NULL;
+                float scale = strtof(list, &end);
+                if (end == list || scale <= 0 || scale > 16 || scale_count == RENDER_MAX_SCALES || (*end != ',' && *end != '\0')) {
+                    fprintf(stderr, "Error: --scales takes up to %d comma-separated factors between 0 and 16 (e.g. 1,2,3).\n", RENDER_MAX_SCALES);
+                    exit_code = 1;
+                    goto cleanup;
+                }
+                scales[scale_count++] = scale;
+                if (*end == '\0') break;
+                list = end + 1;
+            }
+        }
+        else if (strcmp(argv[i], "--cache") == 0) {
+            use_cache = true;
+        }
+        else if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc) {
+            use_cache = true;
+            cache_dir = argv[++i];
+        }
+        else if (strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc) {
+            char *end = NULL;
+            long long megabytes = strtoll(argv[++i], &end, 10);
+            if (*end != '\0' || megabytes < 0) {
+                fprintf(stderr, "Error: Cache size must be a number of megabytes.\n");
+                exit_code = 1;
+                goto cleanup;
+            }
+            use_cache = true;
+            cache_mb = (uint64_t)megabytes;
+        }
+        else if (strcmp(argv[i], "--stats") == 0) {
+            stats_format = STATS_TEXT;
+        }
+        else if (strcmp(argv[i], "--stats=json") == 0) {
+            stats_format = STATS_JSON;
+        }
+        else if (strcmp(argv[i], "-v") == 0) {
+            log_level = LOG_INFO;
+        }
+        else if (strcmp(argv[i], "-vv") == 0) {
+            log_level = LOG_DEBUG;
+        }
+        else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+            if (!parse_log_level(argv[++i], &log_level)) {
+                fprintf(stderr, "Error: Log level must be one of off, warn, info or debug.\n");
+                exit_code = 1;
+                goto cleanup;
+            }
+        }
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            thread_count = atoi(argv[++i]);
+            if (thread_count <= 0) {
+                fprintf(stderr, "Error: Thread count must be positive.\n");
+                exit_code = 1;
+                goto cleanup;
+            }
+        }
+        else if (strcmp(argv[i], "--png-level") == 0 && i + 1 < argc) {
+            char *end = NULL;
+            defaults.png_level = (int)strtol(argv[++i], &end, 10);
+            if (*end != '\0' || defaults.png_level < 0 || defaults.png_level > 9) {
+                fprintf(stderr, "Error: PNG level must be between 0 and 9.\n");
+                exit_code = 1;
+                goto cleanup;
+            }
+        }
+        else if ((strcmp(argv[i], "-l") == 0 || strcmp(argv[i], "--language") == 0) && i + 1 < argc) {
+            defaults.language = argv[++i];
+            if (!find_language(defaults.language)) {
+                fprintf(stderr, "Error: Unknown language '%s'.\n", defaults.language);
+                print_usage(argv[0], NULL);
+                exit_code = 1;
+                goto cleanup;
+            }
+        }
+        else if (strcmp(argv[i], "--palette") == 0) {
+            defaults.palette = true;
+        }
+        else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            defaults.format = output_format_from_name(argv[++i]);
+            if (defaults.format == OUTPUT_AUTO) {
+                fprintf(stderr, "Error: Unknown output format '%s' (png, ppm, raw or qoi).\n", argv[i]);
+                exit_code = 1;
+                goto cleanup;
+            }
+        }
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            defaults.font_name = argv[++i];
+        } else if (strcmp(argv[i], "-fs") == 0 && i + 1 < argc) {
+            defaults.font_pixel_height = atof(argv[++i]);
+            if (defaults.font_pixel_height <= 0) {
+                fprintf(stderr, "Error: Font size must be positive.\n");
+                exit_code = 1;
+                goto cleanup;
+            }
+        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            defaults.width = atoi(argv[++i]);
+            if (defaults.width <= 0) {
+                fprintf(stderr, "Error: Image width must be positive.\n");
+                exit_code = 1;
+                goto cleanup;
+            }
+        } else if (strcmp(argv[i], "-h") == 0 && i + 1 < argc) {
+            defaults.height = atoi(argv[++i]);
+            if (defaults.height <= 0) {
+                fprintf(stderr, "Error: Image height must be positive.\n");
+                exit_code = 1;
+                goto cleanup;
+            }
+        } else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            fprintf(stderr, "Unknown option '%s'\n", argv[i]);
+            print_usage(argv[0], NULL);
+            exit_code = 1;
+            goto cleanup;
+        } else {
+            output_image_path = argv[i]; // Positional argument for output file
+        }
+    }
+
+    // Fonts are discovered after argument parsing; the client never needs them
+    if (!client_socket) {
+        double discovery_start = now_seconds();
+        context = cti_context_create("Fonts", rescan_fonts);
+        discovery_seconds = now_seconds() - discovery_start;
+        if (!context) {
+            fprintf(stderr, "Memory allocation failed for the render context!\n");
+            exit_code = 1;
+            goto cleanup;
+        }
+        if (fallback_list && !cti_context_set_fallback(context, fallback_list)) {
+            exit_code = 1;
+            goto cleanup;
+        }
+        cti_context_set_glyph_files(context, glyph_files);
+    }
+
+    if (!client_socket && defaults.font_name && !find_font_path(&context->fonts, defaults.font_name)) {
+        fprintf(stderr, "Error: Specified font '%s' not found.\n", defaults.font_name);
+        print_usage(argv[0], &context->fonts); // Print usage again if font not found
+        exit_code = 1;
+        goto cleanup;
+    }
+    if (thread_count == 0) {
+        thread_count = default_thread_count();
+    }
+    if (use_cache && !client_socket) {
+        if (!output_cache_open(&output_cache, cache_dir, cache_mb << 20)) {
+            fprintf(stderr, "Error: Could not open the output cache directory: %s\n", strerror(errno));
+            exit_code = 1;
+            goto cleanup;
+        }
+        defaults.cache = &output_cache;
+    }
+
+    // Without an output path, the image goes to highlighted_code with the format's extension
+    const char *default_extension = output_format_names[defaults.format != OUTPUT_AUTO ? defaults.format : OUTPUT_PNG];
+    char default_output_path[64];
+    snprintf(default_output_path, sizeof(default_output_path), "highlighted_code.%s", default_extension);
+    const char *output_path = output_image_path ? output_image_path : default_output_path;
+    if (defaults.palette && job_format(&(RenderJob){ .format = defaults.format, .output_path = output_path }) != OUTPUT_PNG) {
+        fprintf(stderr, "Error: --palette only applies to PNG output.\n");
+        exit_code = 1;
+        goto cleanup;
+    }
+
+    // --- Daemon and client ---
+    if (serve_socket) {
+        exit_code = run_daemon(context, serve_socket, thread_count, defaults.cache);
+        goto cleanup;
+    }
+    if (client_socket) {
+        if (server_stats) {
+            exit_code = run_client(client_socket, NULL);
+            goto cleanup;
+        }
+        if (input_file_count != 1) {
+            fprintf(stderr, "Error: --client needs exactly one -i file.\n");
+            exit_code = 1;
+            goto cleanup;
+        }
+        RenderJob request = defaults;
+        request.input_path = input_file_paths[0];
+        request.output_path = output_path;
+        exit_code = run_client(client_socket, &request);
+        goto cleanup;
+    }
+
+    if (watch && (manifest_path || input_file_count > 1)) {
+        fprintf(stderr, "Error: --watch renders a single -i file.\n");
+        exit_code = 1;
+        goto cleanup;
+    }
+    if (scale_count > 0 && (manifest_path || input_file_count > 1 || watch)) {
+        fprintf(stderr, "Error: --scales renders a single -i file.\n");
+        exit_code = 1;
+        goto cleanup;
+    }
+    if ((watch || scale_count > 0) && is_stdout_path(output_path)) {
+        fprintf(stderr, "Error: --watch and --scales write files, not '-'.\n");
+        exit_code = 1;
+        goto cleanup;
+    }
+
+    // --- Batch: manifest file ---
+    if (manifest_path) {
+        int job_count = 0;
+        char *manifest_text = NULL;
+        RenderJob *jobs = load_manifest(manifest_path, &defaults, &job_count, &manifest_text);
+        if (!jobs && !manifest_text) {
+            exit_code = 1;
+            goto cleanup;
+        }
+        exit_code = run_batch(context, jobs, job_count, thread_count, &stats) == 0 ? 0 : 1;
+        rendered = true;
+        free(jobs);
+        free(manifest_text);
+        goto cleanup;
+    }
+
+    // --- Batch: several -i files ---
+    if (input_file_count > 1) {
+        const char *output_dir = NULL;
+        if (output_image_path) {
+            if (!is_directory(output_image_path)) {
+                fprintf(stderr, "Error: With several -i files the output must be a directory ('%s' is not).\n", output_image_path);
+                exit_code = 1;
+                goto cleanup;
+            }
+            output_dir = output_image_path;
+        }
+        RenderJob *jobs = calloc(input_file_count, sizeof(RenderJob));
+        if (!jobs) {
+            fprintf(stderr, "Memory allocation failed for batch jobs!\n");
+            exit_code = 1;
+            goto cleanup;
+        }
+        for (int i = 0; i < input_file_count; ++i) {
+            jobs[i] = defaults;
+            jobs[i].input_path = input_file_paths[i];
+            jobs[i].output_path = batch_output_path(input_file_paths[i], output_dir, default_extension);
+            if (!jobs[i].output_path) {
+                fprintf(stderr, "Memory allocation failed for batch jobs!\n");
+                exit_code = 1;
+                break;
+            }
+        }
+        if (exit_code == 0) {
+            exit_code = run_batch(context, jobs, input_file_count, thread_count, &stats) == 0 ? 0 : 1;
+            rendered = true;
+        }
+        for (int i = 0; i < input_file_count; ++i) {
+            free((char *)jobs[i].output_path);
+        }
+        free(jobs);
+        goto cleanup;
+    }
+
+    // --- Single image ---
+    if (input_file_count == 0) {
+        fprintf(stderr, "Error: No input code file specified. Use -i <filepath>.\n");
+        print_usage(argv[0], NULL);
+        exit_code = 1;
+        goto cleanup;
+    }
+    RenderJob job = defaults;
+    job.input_path = input_file_paths[0];
+    job.output_path = output_path;
+    job.png_threads = thread_count; // Only one image, so draw and compress it in parallel
+    job.raster_threads = thread_count;
+    if (job.font_name == NULL && context->fonts.count > 0) {
+        log_message(LOG_INFO, "No font specified. Defaulting to '%s'.", context->fonts.fonts[0].name);
+    }
+
+    RenderWorker worker = { .context = context };
+    if (watch) {
+        exit_code = run_watch(&job, &worker);
+    } else if (scale_count > 0) {
+        // One input, loaded once; with --sdf every scale resamples the same distance fields
+        size_t code_size = 0;
+        char *code_content = load_file(job.input_path, &code_size);
+        if (!code_content) {
+            fprintf(stderr, "Error: Could not read input file '%s'.\n", job.input_path);
+            exit_code = 1;
+        }
+        for (int s = 0; code_content && s < scale_count; ++s) {
+            RenderJob scaled = job;
+            scaled.scale = scales[s];
+            char *path = scaled_output_path(job.output_path, scales[s]);
+            if (!path) {
+                fprintf(stderr, "Memory allocation failed for output paths!\n");
+                exit_code = 1;
+                break;
+            }
+            scaled.output_path = path;
+            if (render_code(code_content, code_size, &scaled, &worker) == 0) {
+                printf("Successfully wrote '%s'\n", path);
+            } else {
+                exit_code = 1;
+            }
+            free(path);
+        }
+        free(code_content);
+    } else {
+        exit_code = render_job(&job, &worker, NULL);
+        if (exit_code == 0 && !is_stdout_path(job.output_path)) {
+            printf("Successfully wrote '%s'\n", job.output_path);
+        }
+    }
+    unsigned long hits = 0, misses = 0;
+    worker_cache_stats(&worker, &hits, &misses);
+    log_message(LOG_DEBUG, "Glyph cache: %lu hits, %lu misses", hits, misses);
+    render_stats_add(&stats, &worker.stats);
+    rendered = true;
+    worker_free(&worker);
+
+cleanup:
+    if (rendered && stats_format != STATS_OFF) {
+        print_stats(&stats, discovery_seconds, now_seconds() - run_start, stats_format);
+    }
+    // --- Cleanup ---
+    if (defaults.cache) {
+        output_cache_close(defaults.cache);
+    }
+    free(input_file_paths);
+    cti_context_free(context); // Fonts, font files and glyph caches
+    scratch_thread_exit();
+    return exit_code;
+}
+#endif // CODE_TO_IMAGE_NO_MAIN
+
+#ifdef CODE_TO_IMAGE_NO_MAIN
+#pragma GCC visibility pop
+#endif
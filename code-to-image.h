@@ -0,0 +1,96 @@
+// code-to-image.h - rendering API for embedding code-to-image in another program
+//
+// Build the library by compiling code-to-image.c without its command-line main:
+//
+//   gcc -O2 -fPIC -I. -I./stb -DCODE_TO_IMAGE_NO_MAIN -c code-to-image.c -o code-to-image.o
+//   objcopy --localize-hidden code-to-image.o
+//
+// and link with -lm -lpthread. Only the cti_* functions are exported; objcopy turns the hidden
+// internals (stb_truetype among them) into local symbols, so a statically linked host may have
+// its own. A shared library built from the object exports only cti_* without that step.
+//
+// A context discovers fonts once and then keeps parsed fonts, glyph caches and the theme for
+// every render made with it. Any number of threads may render with one context at the same
+// time; set the theme before the first render.
+
+#ifndef CODE_TO_IMAGE_H
+#define CODE_TO_IMAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__)
+#define CTI_API __attribute__((visibility("default")))
+#else
+#define CTI_API
+#endif
+
+typedef struct RenderContext RenderContext;
+
+// Colors of an image, as "#RRGGBB"
+typedef struct {
+    const char *background;
+    const char *code_background;
+    const char *text;
+    const char *comment;
+    const char *keyword;
+    const char *function;
+    const char *string;
+    const char *literal;
+} CtiTheme;
+
+// How to render; start from cti_default_options()
+typedef struct {
+    const char *font_name;   // Discovered font name; NULL selects the first font
+    const char *language;    // Highlighting language, e.g. "c" or "python"; NULL means plain text
+    float font_pixel_height;
+    float scale;             // Pixel density: multiplies font size, padding and width/height
+    int width;               // 0 means calculated from content
+    int height;              // 0 means calculated from content
+    int png_level;           // Deflate level 0-9
+    bool palette;            // Indexed-color PNG
+    bool sdf;                // Glyphs from signed distance fields
+    int threads;             // Threads drawing and compressing this one image
+} CtiOptions;
+
+// Receives encoded bytes in order; returns false to abort the render
+typedef bool (*CtiWriteFn)(void *user, const void *data, size_t size);
+
+// Function to create a context with the fonts found under font_root (e.g. "Fonts"), using the
+// on-disk font index unless rescan_fonts is set. Returns NULL if memory runs out.
+CTI_API RenderContext *cti_context_create(const char *font_root, bool rescan_fonts);
+CTI_API void cti_context_free(RenderContext *context);
+
+// Function to choose the fonts that draw characters the selected font lacks: a comma-separated
+// list of font names, "none", or NULL for every discovered font (the default). Call it before
+// the first render. Returns false if a font is not found.
+CTI_API bool cti_context_set_fallback(RenderContext *context, const char *list);
+
+// Function to turn glyph files off or on (the default). Glyph files keep rasterized glyphs in
+// the user's cache directory, so later renders, in this process or another, reuse them instead
+// of rasterizing again. Call it before the first render.
+CTI_API void cti_context_set_glyph_files(RenderContext *context, bool enabled);
+
+// Function to replace the default theme. Returns false if a color is not "#RRGGBB".
+CTI_API bool cti_context_set_theme(RenderContext *context, const CtiTheme *theme);
+
+CTI_API int cti_font_count(const RenderContext *context);
+CTI_API const char *cti_font_name(const RenderContext *context, int index);
+
+CTI_API CtiOptions cti_default_options(void);
+
+// Function to compute the size of the image of size bytes of code. Returns 0 on success.
+CTI_API int cti_measure(RenderContext *context, const CtiOptions *options, const char *code, size_t size,
+                        int *out_width, int *out_height);
+
+// Function to draw the image into pixels: width * height packed RGB pixels, where width and
+// height are what cti_measure reported. Returns 0 on success.
+CTI_API int cti_render_pixels(RenderContext *context, const CtiOptions *options, const char *code, size_t size,
+                              uint8_t *pixels, int width, int height);
+
+// Function to render a PNG, streaming it to write as it is encoded. Returns 0 on success.
+CTI_API int cti_render_png(RenderContext *context, const CtiOptions *options, const char *code, size_t size,
+                           CtiWriteFn write, void *user);
+
+#endif // CODE_TO_IMAGE_H